@@ -4,12 +4,41 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include <array>
 #include <deque>
 #include <map>
 #include <iterator>
 #include <iostream>
 #include <utility>
 #include <type_traits>
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <fstream>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <random>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace trie
 {
@@ -19,618 +48,6559 @@ struct SetCounter { };
 namespace detail
 {
 
-template <typename AtomT, typename PrefixHolderT>
-struct TrieNode : public PrefixHolderT
+/**
+ * @brief Size-class slab arena
+ *
+ * Serves nodes, child tables, values and keys of the trie out of
+ * large slabs requested from the upstream allocator. Released blocks
+ * are kept in per-size-class free lists and reused; the slabs are
+ * only returned to the upstream allocator all at once by release().
+ * Blocks larger than CMaxSmall and over-aligned objects are requested
+ * from upstream directly.
+ */
+template <typename Allocator>
+struct TrieArena
 {
 private:
-    typedef TrieNode<AtomT, PrefixHolderT> self_type;
-    typedef self_type * self_pointer;
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<char> UpstreamT;
 
-    self_pointer * data = nullptr;
-    uint32_t size = 0; /* Will still be 64 bit due to alignment */
+    struct Block { Block * next; };
+
+    struct Slab
+    {
+        Slab * prev;
+        Slab * next;
+        size_t size;
+    };
 
 public:
-    typedef self_type * const * map_iterator;
+    static const size_t CGranule  = sizeof(void *);
+    static const size_t CMaxSmall = 4096;
+    static const size_t CMinSlab  = 4096;
+    static const size_t CMaxSlab  = 1024 * 1024;
+    static const size_t CClasses  = CMaxSmall / CGranule;
 
-    TrieNode(int hint) { if (hint > 0) { resize(hint); } }
+private:
+    UpstreamT upstream;
 
-    inline static int atom_hash(AtomT x, uint32_t mask) {
-        return (x & mask);
-    }
+    Slab * slabs = nullptr;
+    Slab * large = nullptr;
+    char * cur   = nullptr;
+    char * lim   = nullptr;
 
-    inline static int least_uncolliding_size(AtomT a, AtomT b)
-    {
-        unsigned int v = ((int) a ^ (int) b);
-        return (v & -v) << 1;
-    }
+    size_t next_slab = CMinSlab;
+    size_t total     = 0;
 
-    static self_type * value(map_iterator x) { return *x; };
+    /* The table takes 4K, so it is only set up with the first slab */
+    Block ** free_lists = nullptr;
 
-    void resize(uint32_t new_size)
+    Slab * upstream_allocate(size_t n, Slab *& list)
     {
-        self_pointer * ndata = (new_size == 0) ?
-            nullptr : (new self_pointer[new_size]);
+        Slab * x = reinterpret_cast<Slab *>(upstream.allocate(sizeof(Slab) + n));
 
-        std::fill(ndata, ndata + new_size, nullptr);
+        x->prev = nullptr;
+        x->next = list;
+        x->size = n;
 
-        if (new_size > size) {
-            for (uint32_t i = 0; i < size; ++i) {
-                if (data[i] != nullptr) {
-                    ndata[atom_hash(*data[i]->kbegin(), new_size - 1)] = data[i];
-                }
-            }
-        }
+        if (list != nullptr) { list->prev = x; }
+        list = x;
+        total += sizeof(Slab) + n;
 
-        delete[] data;
-        data = ndata;
-        size = new_size;
+        return x;
     }
 
-    map_iterator find(AtomT x) const 
+    void upstream_deallocate(Slab * x, Slab *& list)
     {
-        if (size != 0)
-        {
-            map_iterator result = data + atom_hash(x, size-1);
+        if (x->prev != nullptr) { x->prev->next = x->next; } else { list = x->next; }
+        if (x->next != nullptr) { x->next->prev = x->prev; }
 
-            if (nullptr != *result and (*result)->starts_with(x)) {
-                return result;
-            }
-        }
+        total -= sizeof(Slab) + x->size;
+        upstream.deallocate(reinterpret_cast<char *>(x), sizeof(Slab) + x->size);
+    }
 
-        return nullptr;
+    void push_free(void * p, size_t n)
+    {
+        Block *& head = free_lists[n / CGranule - 1];
+        Block * x = static_cast<Block *>(p);
+
+        x->next = head;
+        head = x;
     }
 
-    ~TrieNode() { resize(0); };
+    /* Puts the rest of the current slab to the free lists */
+    void free_rest()
+    {
+        while (lim - cur >= (ptrdiff_t) CGranule)
+        {
+            size_t chunk = std::min((size_t) (lim - cur) & ~(CGranule - 1), CMaxSmall);
+            push_free(cur, chunk);
+            cur += chunk;
+        }
+    }
 
-    void put(self_type * edge)
+    /* Moves all the slabs of the other list to the front of the list */
+    static void splice(Slab *& list, Slab *& other)
     {
-        AtomT x = *edge->kbegin();
+        if (other == nullptr) { return; }
 
-        if (size == 0) { resize(2); }
+        Slab * tail = other;
+        while (tail->next != nullptr) { tail = tail->next; }
 
-        int hash = atom_hash(x, size-1);
+        tail->next = list;
+        if (list != nullptr) { list->prev = tail; }
 
-        if (data[hash] == nullptr) {
-            data[hash] = edge;
-            return;
+        list = other;
+        other = nullptr;
+    }
+
+    void new_slab(size_t n)
+    {
+        if (free_lists == nullptr)
+        {
+            free_lists = reinterpret_cast<Block **>(
+                upstream_allocate(CClasses * sizeof(Block *), large) + 1);
+            std::fill(free_lists, free_lists + CClasses, nullptr);
         }
 
-        resize(least_uncolliding_size(x, *data[hash]->kbegin()));
+        /* Do not waste the rest of the current slab */
+        free_rest();
 
-        data[atom_hash(x, size-1)] = edge;
-    }
+        size_t slab_size = std::max(next_slab, n);
+        next_slab = std::min(next_slab * 2, CMaxSlab);
 
-    map_iterator begin() const { return data; }
-    map_iterator end()   const { return data + size; }
-    std::nullptr_t nf()  const { return nullptr; }
+        Slab * x = upstream_allocate(slab_size, slabs);
 
-    void split(self_type * next, int breakIdx)
-    {
-        this->PrefixHolderT::psplit(next, breakIdx);
-        std::swap(this->data, next->data);
-        std::swap(this->size, next->size);
-        this->swap_value(*next);
-        put(next);
+        cur = reinterpret_cast<char *>(x + 1);
+        lim = cur + slab_size;
     }
-};
 
-template <typename AtomT, typename NodeT>
-struct TrieIteratorInternal
-{
-    typedef std::vector< AtomT > key_type;
-    typedef typename NodeT::map_iterator traverse_ptr;
+public:
+    explicit TrieArena(const Allocator & alloc = Allocator())
+        : upstream(alloc) { }
 
-    key_type base_prefix;
-    const NodeT * m_root;
-    std::vector<traverse_ptr> m_ptrs;
+    /** @brief The number of bytes an allocation of n bytes really takes */
+    static size_t rounded(size_t n) {
+        return n == 0 ? CGranule : (n + CGranule - 1) & ~(CGranule - 1);
+    }
 
-    TrieIteratorInternal(const NodeT * a_root) : m_root(a_root) { };
+    Allocator get_allocator() const { return Allocator(upstream); }
 
-    const NodeT * get(int i = 0) const
-    {
-        int j = (int) m_ptrs.size() + i;
-        return j > 0 ? NodeT::value(m_ptrs[j - 1]) : (j == 0 ? m_root : nullptr);
-    }
+    TrieArena(const TrieArena &) = delete;
+    TrieArena & operator = (const TrieArena &) = delete;
 
-    typename NodeT::value_type & get_value() const
-    {
-        NodeT * top = const_cast<NodeT *>(m_ptrs.empty() ? m_root : NodeT::value(m_ptrs.back()));
-        return top->get_value();
-    }
+    ~TrieArena() { release(); }
 
-    std::basic_string<AtomT> get_key_str()
+    void * allocate(size_t n)
     {
-        std::basic_string<AtomT> result(base_prefix.begin(), base_prefix.end());
+        n = rounded(n);
+
+        if (n > CMaxSmall) {
+            return upstream_allocate(n, large) + 1;
+        }
 
-        const NodeT * i = m_root;
+        if (free_lists == nullptr) { new_slab(n); }
 
-        std::copy(i->kbegin(), i->kend(), std::back_inserter(result));
+        Block *& head = free_lists[n / CGranule - 1];
 
-        for (auto && traverse_ptr : m_ptrs)
+        if (head != nullptr)
         {
-            i = NodeT::value(traverse_ptr);
-            std::copy(i->kbegin(), i->kend(), std::back_inserter(result));
+            Block * result = head;
+            head = head->next;
+            return result;
         }
 
+        if (lim - cur < (ptrdiff_t) n) { new_slab(n); }
+
+        void * result = cur;
+        cur += n;
         return result;
     }
 
-    key_type get_key()
+    void deallocate(void * p, size_t n)
     {
-        key_type result(base_prefix);
+        n = rounded(n);
 
-        const NodeT * i = m_root;
-        result.insert(result.back(), i->kbegin(), i->kend());
-
-        for (auto && traverse_ptr : m_ptrs)
-        {
-            i = traverse_ptr->second;
-            result.insert(result.back(), i->kbegin(), i->kend());
+        if (n > CMaxSmall) {
+            upstream_deallocate(static_cast<Slab *>(p) - 1, large);
+        } else {
+            push_free(p, n);
         }
+    }
 
-        return result;
+    /**
+     * Makes sure, that the next \a n bytes of allocations will
+     * be served contiguously from a single slab.
+     */
+    void reserve(size_t n)
+    {
+        if (lim - cur < (ptrdiff_t) n) { new_slab(n); }
     }
 
-    bool step_down()
+    /**
+     * Objects aligned stricter than a granule get an upstream block of
+     * their own, with the slab header stored right before the object.
+     */
+    void * allocate_aligned(size_t n, size_t align)
     {
-        const NodeT * x = get();
-        traverse_ptr it = x->begin();
+        Slab * x = upstream_allocate(n + align + sizeof(Slab *), large);
+        uintptr_t p = reinterpret_cast<uintptr_t>(x + 1) + sizeof(Slab *);
 
-        while (it != x->end()
-                and NodeT::value(it) == nullptr) { 
-            ++it; 
-        }
+        p = (p + align - 1) & ~(uintptr_t) (align - 1);
+        reinterpret_cast<Slab **>(p)[-1] = x;
 
-        if (it != x->end()) 
-        {
-            m_ptrs.push_back(it);
-            return true;
-        }
+        return reinterpret_cast<void *>(p);
+    }
 
-        return false;
+    void deallocate_aligned(void * p)
+    {
+        upstream_deallocate(static_cast<Slab **>(p)[-1], large);
     }
 
-    bool step_fore()
+    template <typename T, typename ... Args>
+    T * create(Args && ... args)
     {
-        const NodeT * up = get(-1);
+        bool aligned = alignof(T) > CGranule;
+        void * p = aligned ? allocate_aligned(sizeof(T), alignof(T)) : allocate(sizeof(T));
+
+        try {
+            return new (p) T(std::forward<Args>(args)...);
+        } catch (...) {
+            if (aligned) { deallocate_aligned(p); } else { deallocate(p, sizeof(T)); }
+            throw;
+        }
+    }
 
-        if (up != nullptr)
-        {
-            do {
-                ++m_ptrs.back();
-            } while (m_ptrs.back() != up->end()
-                and NodeT::value(m_ptrs.back()) == nullptr);
+    template <typename T>
+    void destroy(T * x)
+    {
+        x->~T();
 
-            return m_ptrs.back() != up->end();
+        if (alignof(T) > CGranule) {
+            deallocate_aligned(x);
+        } else {
+            deallocate(x, sizeof(T));
         }
-
-        return false;
     }
 
-    bool step_up()
+    /** @brief Returns all the memory to the upstream allocator at once */
+    void release()
     {
-        m_ptrs.pop_back();
+        while (slabs != nullptr) { upstream_deallocate(slabs, slabs); }
+        while (large != nullptr) { upstream_deallocate(large, large); }
 
-        return step_fore();
+        free_lists = nullptr; /* It was in the large list */
+        cur = lim = nullptr;
+        next_slab = CMinSlab;
     }
 
-    void next()
+    /**
+     * @brief Takes over all the memory of the other arena
+     *
+     * The allocators of the arenas must compare equal. Blocks allocated
+     * from the other arena are then released to this one, the other one
+     * is left empty.
+     */
+    void adopt(TrieArena & other)
     {
-        if (step_down())   { return; }
-        if (step_fore())   { return; }
+        other.free_rest();
 
-        while (!m_ptrs.empty()) {
-            if (step_up()) { return; }
+        splice(slabs, other.slabs);
+        splice(large, other.large);
+
+        if (free_lists == nullptr)
+        {
+            free_lists = other.free_lists;
         }
+        else if (other.free_lists != nullptr)
+        {
+            for (size_t i = 0; i < CClasses; ++i)
+            {
+                Block * head = other.free_lists[i];
+                if (head == nullptr) { continue; }
 
-        m_root = nullptr;
-    }
+                Block * tail = head;
+                while (tail->next != nullptr) { tail = tail->next; }
 
-    bool next_value()
-    {
-        do {
-            next();
-        } while (m_root != nullptr and !get()->has_value());
+                tail->next = free_lists[i];
+                free_lists[i] = head;
+            }
 
-        return m_root != nullptr;
+            /* The table of the other arena is in the large list now */
+            upstream_deallocate(reinterpret_cast<Slab *>(other.free_lists) - 1, large);
+        }
+
+        other.free_lists = nullptr;
+
+        total += other.total;
+        other.total = 0;
+        other.cur = other.lim = nullptr;
     }
 
-    void push(traverse_ptr it)
+    /** @brief The number of bytes held from the upstream allocator */
+    size_t allocated() const noexcept { return total; }
+
+    void swap(TrieArena & other)
     {
-        m_ptrs.push_back(it);
+        std::swap(upstream, other.upstream);
+        std::swap(slabs, other.slabs);
+        std::swap(large, other.large);
+        std::swap(cur, other.cur);
+        std::swap(lim, other.lim);
+        std::swap(next_slab, other.next_slab);
+        std::swap(total, other.total);
+        std::swap(free_lists, other.free_lists);
     }
 };
 
-typedef uint32_t trie_offset_t;
-
-template <typename ValueT>
-struct ValueHolder
+template <typename Allocator> const size_t TrieArena<Allocator>::CGranule;
+template <typename Allocator> const size_t TrieArena<Allocator>::CMaxSmall;
+template <typename Allocator> const size_t TrieArena<Allocator>::CMinSlab;
+template <typename Allocator> const size_t TrieArena<Allocator>::CMaxSlab;
+template <typename Allocator> const size_t TrieArena<Allocator>::CClasses;
+
+/* Child table layouts of the adaptive node (after ART).
+ * Small tables keep the keys sorted, the larger ones are
+ * indexed by the key byte directly. */
+template <typename PointerT>
+struct ChildTable4
 {
-private:
-    std::auto_ptr<ValueT> value;
-public:
-    typedef ValueT value_type; /* Effective type */
+    uint8_t  keys[4];
+    PointerT child[4];
+};
 
-    value_type & get_value()             { return *value; };
-    const value_type & get_value() const { return *value; };
+template <typename PointerT>
+struct ChildTable16
+{
+    uint8_t  keys[16];
+    PointerT child[16];
+};
 
-    bool     has_value() const noexcept  { return value.get() != nullptr; };
-    void     set_value(const ValueT & x) { value.reset(new ValueT(x)); };
-    void     clr_value()                 { set_value(nullptr); };
+template <typename PointerT>
+struct ChildTable48
+{
+    uint8_t  index[256]; /* Slot + 1, zero for no child */
+    PointerT child[48];
+};
 
-    void swap_value(ValueHolder & other) { std::swap(this->value, other.value); };
+template <typename PointerT>
+struct ChildTable256
+{
+    PointerT child[256];
 };
 
-template <>
-struct ValueHolder<SetCounter>
+/* Returns the position of k among the first n keys, or -1 */
+inline int find_key16(const uint8_t * keys, uint8_t k, uint32_t n)
 {
-private:
-    int count = 0;
-public:
-    typedef int value_type; /* Effective type */
+#if defined(__SSE2__)
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char) k),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys)));
+    unsigned mask = _mm_movemask_epi8(cmp) & ((1u << n) - 1);
+
+    return mask != 0 ? __builtin_ctz(mask) : -1;
+#else
+    for (uint32_t i = 0; i < n; ++i) {
+        if (keys[i] == k) { return i; }
+    }
 
-    value_type & get_value() noexcept { return count; };
-    const value_type & get_value() const noexcept { return count; };
+    return -1;
+#endif
+}
 
-    bool     has_value() const noexcept      { return count != 0; };
-    void     set_value(const value_type & x) { count = x; };
-    void     clr_value()                     { count = 0; };
+/* The number of bits set. Without the instruction the builtin is a library call */
+inline unsigned popcount(uint64_t x)
+{
+#if defined(__GNUC__) and defined(__POPCNT__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (unsigned) ((x * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+/* The number of zero bits above the highest set one, x must not be 0 */
+inline unsigned leading_zeros(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(x);
+#else
+    unsigned n = 0;
+    for (; (x & (uint64_t(1) << 63)) == 0; x <<= 1) { ++n; }
+    return n;
+#endif
+}
 
-    void swap_value(ValueHolder & other) { std::swap(count, other.count); };
+/**
+ * Keys of binary_trie_map as strings of bits, the most significant first.
+ * A prefix of a key is kept as the key with the bits after it cleared.
+ */
+template <typename KeyT, typename Enable = void>
+struct BitKey
+{
+    /* No default implementation, keys are unsigned integers or byte arrays */
 };
 
-
-template <typename AtomT, typename ValueT, size_t CMinChunkSize>
-struct PrefixHolder : public ValueHolder<ValueT>
+template <typename KeyT>
+struct BitKey<KeyT, typename std::enable_if<
+    std::is_integral<KeyT>::value and std::is_unsigned<KeyT>::value>::type>
 {
-private:
-    typedef PrefixHolder<AtomT, ValueT, CMinChunkSize> self_type;
-    typedef std::vector<AtomT> ChunkT;
+    static const size_t bits = std::numeric_limits<KeyT>::digits;
 
-    ChunkT * chunk;
-    trie_offset_t begin, end;
-public:
-    typedef const AtomT * key_iterator;
+    static unsigned bit(const KeyT & x, size_t i) { return (x >> (bits - 1 - i)) & 1u; }
 
-    bool starts_with(AtomT x) const { return (*chunk)[begin] == x; };
-    key_iterator kbegin() const { return std::addressof((*chunk)[begin]); };
-    key_iterator kend()   const { return std::addressof((*chunk)[end]); };
-
-    ChunkT * insertion_hint() { return chunk; }
+    static KeyT masked(const KeyT & x, size_t length)
+    {
+        return length == 0 ? 0 : x & (KeyT) (~uint64_t(0) << (bits - length));
+    }
 
-    void setkey(ChunkT * achunk, trie_offset_t k, trie_offset_t kend)
+    /* The number of leading bits a and b share, at most limit */
+    static size_t common(const KeyT & a, const KeyT & b, size_t limit)
     {
-        chunk = achunk;
-        begin = k;
-        end   = kend;
+        uint64_t d = (uint64_t) (a ^ b) << (64 - bits);
+        return d == 0 ? limit : std::min<size_t>(leading_zeros(d), limit);
     }
 
-    void psplit(self_type * next, int breakIdx)
+    /* The width bits (16 at most) from the i-th one, zeros past the end */
+    static unsigned chunk(const KeyT & x, size_t i, size_t width)
     {
-        next->chunk = chunk;
-        next->begin = this->begin + breakIdx;
-        next->end   = this->end;
-        this->end   = next->begin;
+        return (unsigned) ((((uint64_t) x << (64 - bits)) << i) >> (64 - width));
     }
 };
 
-template <typename AtomT, typename ValueT>
-struct PrefixHolder<AtomT, ValueT, 0> : public ValueHolder<ValueT>
+/* Addresses like IPv6 ones, in the network byte order */
+template <size_t N>
+struct BitKey< std::array<uint8_t, N> >
 {
-private:
-    typedef PrefixHolder<AtomT, ValueT, 0> self_type;
-    typedef std::vector<AtomT>     ChunkT;
+    typedef std::array<uint8_t, N> KeyT;
 
-    AtomT  * prefix;
-    size_t prefix_len;
-    ValueT * value = nullptr;
-public:
-    typedef const AtomT * key_iterator;
+    static const size_t bits = N * 8;
 
-    bool starts_with(AtomT x) const { return *prefix == x; };
-    key_iterator kbegin() const { return prefix; };
-    key_iterator kend()   const { return prefix + prefix_len; };
+    static unsigned bit(const KeyT & x, size_t i) { return (x[i >> 3] >> (7 - (i & 7))) & 1u; }
 
-    std::nullptr_t insertion_hint() { return nullptr; }
+    static KeyT masked(KeyT x, size_t length)
+    {
+        for (size_t i = length >> 3; i < N; ++i) {
+            x[i] &= i == (length >> 3) ? (uint8_t) (0xff00u >> (length & 7)) : 0;
+        }
 
-    void setkey(ChunkT * achunk, trie_offset_t k, trie_offset_t kend)
+        return x;
+    }
+
+    static size_t common(const KeyT & a, const KeyT & b, size_t limit)
     {
-        prefix     = std::addressof(achunk->begin()[k]);
-        prefix_len = kend - k;
+        for (size_t i = 0; i < N and i * 8 < limit; ++i)
+        {
+            if (a[i] != b[i]) {
+                return std::min<size_t>(i * 8 + leading_zeros((uint64_t) (a[i] ^ b[i]) << 56), limit);
+            }
+        }
+
+        return limit;
     }
 
-    void psplit(self_type * next, int breakIdx)
+    static unsigned chunk(const KeyT & x, size_t i, size_t width)
     {
-        next->prefix     = this->prefix + breakIdx;
-        next->prefix_len = this->prefix_len - breakIdx;
-        this->prefix_len -= next->prefix_len;
+        size_t j = i >> 3;
+        uint32_t v = (uint32_t) x[j] << 16 | (j + 1 < N ? (uint32_t) x[j + 1] << 8 : 0) |
+            (j + 2 < N ? x[j + 2] : 0);
+
+        return (v >> (24 - (i & 7) - width)) & ((1u << width) - 1);
     }
 };
 
-template<typename AtomT, typename ValueT, size_t CMinChunkSize, 
-    typename Spec = void>
-struct TrieNodeSelector
+/* Whether the visitor takes the key along with the value */
+template <typename F, typename K, typename V>
+struct takes_key
 {
-    /* No default implementation.
-     * Must be specialized by code, which tries to use it. */
-};
+    template <typename G>
+    static auto test(int) -> decltype((void) std::declval<G &>()(
+        std::declval<const K &>(), std::declval<V &>()), std::true_type());
 
-template<typename AtomT, typename ValueT, size_t CMinChunkSize>
-struct TrieNodeSelector<AtomT, ValueT, CMinChunkSize, 
-    typename std::enable_if<std::is_integral<AtomT>::value>::type>
-{
-    typedef PrefixHolder<char, ValueT, CMinChunkSize>  PrefixHolderType;
-    typedef TrieNode<AtomT, PrefixHolderType>    type;
-};
+    template <typename>
+    static std::false_type test(...);
 
+    static const bool value = decltype(test<F>(0))::value;
 };
 
-template <typename AtomT, typename ValueT, size_t CMinChunkSize = 0, 
-    typename NodeImpl = typename detail::TrieNodeSelector<AtomT, ValueT, CMinChunkSize>::type >
-struct trie_map
-{
-private:
-    typedef NodeImpl NodeT;
-    typedef detail::TrieIteratorInternal<AtomT, NodeT> IteratorInternalT;
+template <typename F, typename K, typename V>
+inline auto visit(F & f, const K & key, V & value, std::true_type)
+    -> decltype(f(key, value)) { return f(key, value); }
 
-    /* We use deque in order to make edge storage stable */
-    typedef std::deque< NodeT >                    EdgeStorageT;
-public:
-    typedef typename NodeImpl::value_type          value_type;
-    typedef typename IteratorInternalT::key_type   key_type;
-    typedef typename NodeImpl::key_iterator        key_iterator;
+template <typename F, typename K, typename V>
+inline auto visit(F & f, const K &, V & value, std::false_type)
+    -> decltype(f(value)) { return f(value); }
 
-    typedef value_type mapped_type; /* Defined for the compatibility with map */
-private:
-    typedef std::vector<AtomT> ChunkT;
-    typedef std::deque<ChunkT> InternalStorageT;
+/* Hints the cache line holding p is about to be read */
+inline void prefetch(const void * p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p, 0, 3);
+#else
+    (void) p;
+#endif
+}
+
+/* Lexicographic order of atoms, the same as std::char_traits has */
+template <typename AtomT>
+inline bool atom_less(AtomT a, AtomT b)
+{
+    typedef typename std::make_unsigned<AtomT>::type UnsignedT;
+    return (UnsignedT) a < (UnsignedT) b;
+}
 
-    /* The number of elements */
-    size_t msize = 0;
-    InternalStorageT keys;
+/**
+ * Glob pattern: '?' matches any atom, '*' any run of atoms, "[...]" one
+ * of the atoms or ranges listed, "[!...]" or "[^...]" any other one,
+ * '\\' makes the next atom literal. A '[' without the closing ']' is
+ * a literal one. The pattern is a sequence of tokens, matched as a set
+ * of positions in it; position size() is the accepting one.
+ */
+template <typename AtomT>
+struct GlobPattern
+{
+    enum Kind : uint8_t { CLiteral, CAny, CStar, CClass };
 
-    template<typename KeyIterator>
-    void insert_infix(KeyIterator it, KeyIterator end, NodeT * parent, NodeT * n)
+    struct Token
     {
-        size_t ksize = std::distance(it, end);
-        ChunkT * target = parent == nullptr ? nullptr : parent->insertion_hint();
+        Kind kind;
+        bool negated;
+        AtomT atom;
+        size_t ranges; /* The first one of the class */
+        size_t range_count;
+    };
 
-        if ((target == nullptr) or (target->size() + ksize) > CMinChunkSize)
+    std::vector<Token> tokens;
+    std::vector< std::pair<AtomT, AtomT> > ranges;
+
+    explicit GlobPattern(const std::basic_string<AtomT> & pattern)
+    {
+        for (size_t i = 0; i < pattern.size(); ++i)
         {
-            if (CMinChunkSize == 0 or keys.empty() or 
-                    (keys.back().size() + ksize) > CMinChunkSize)
-            {
-                keys.emplace_back();
-                keys.back().reserve(CMinChunkSize);
+            AtomT x = pattern[i];
+            Token t { CLiteral, false, x, 0, 0 };
+
+            if (x == AtomT('?')) {
+                t.kind = CAny;
+            } else if (x == AtomT('*')) {
+                if (!tokens.empty() and tokens.back().kind == CStar) { continue; }
+                t.kind = CStar;
+            } else if (x == AtomT('\\') and i + 1 < pattern.size()) {
+                t.atom = pattern[++i];
+            } else if (x == AtomT('[')) {
+                size_t end = parse_class(pattern, i + 1, t);
+                if (end != 0) { i = end; }
             }
 
-            target = std::addressof(keys.back());
+            tokens.push_back(t);
+        }
+    }
+
+    /* Returns the position of the closing ']', 0 if there is none */
+    size_t parse_class(const std::basic_string<AtomT> & pattern, size_t i, Token & t)
+    {
+        size_t first = ranges.size();
+
+        if (i < pattern.size() and (pattern[i] == AtomT('!') or pattern[i] == AtomT('^')))
+        {
+            t.negated = true;
+            ++i;
         }
 
-        /* WARNING : Here, we rely on the fact, that vector pointers always
-         * remain stable if values inserted fit into reserved space, which
-         * should work in practice, but std::vector specification
-         * does not guarantee that.
-         */
-        detail::trie_offset_t kidx    = target->size();
-        target->insert(target->end(), it, end);
-        detail::trie_offset_t kendidx = target->size();
+        /* A ']' right after the '[' is a literal one */
+        for (size_t j = i; j < pattern.size(); ++j)
+        {
+            if (pattern[j] == AtomT(']') and j > i)
+            {
+                t.kind = CClass;
+                t.ranges = first;
+                t.range_count = ranges.size() - first;
+                return j;
+            }
 
-        n->setkey(target, kidx, kendidx);
-    }
+            AtomT lo = pattern[j];
+            AtomT hi = lo;
 
-    EdgeStorageT edges;
+            if (j + 2 < pattern.size() and pattern[j + 1] == AtomT('-') and pattern[j + 2] != AtomT(']'))
+            {
+                hi = pattern[j + 2];
+                j += 2;
+            }
 
-    NodeT * root() { return std::addressof(*edges.begin()); }
+            ranges.push_back(std::make_pair(lo, hi));
+        }
 
-    NodeT * new_edge(int hint)
-    {
-        edges.emplace_back(hint);
-        return std::addressof(edges.back());
+        ranges.resize(first);
+        t.negated = false;
+        return 0;
     }
 
-    template<typename KeyIterator>
-    NodeT * insert_edge(NodeT * parent, KeyIterator it, KeyIterator end, const value_type & value)
+    bool matches(const Token & t, AtomT x) const
     {
-        NodeT * n = new_edge(0);
-        insert_infix(it, end, parent, n);
-        if (parent != nullptr) { parent->put(n); }
-        n->set_value(value);
-        return n;
-    }
+        switch (t.kind)
+        {
+        case CLiteral: return x == t.atom;
+        case CAny:     return true;
+        case CStar:    return true;
+        case CClass:
+            for (size_t i = t.ranges; i < t.ranges + t.range_count; ++i)
+            {
+                if (!atom_less(x, ranges[i].first) and !atom_less(ranges[i].second, x)) {
+                    return !t.negated;
+                }
+            }
 
-    template<typename ReplacePolicy>
-    void insert_value(NodeT & at, const value_type & value, const ReplacePolicy & replace)
-    {
-        if (at.has_value()) {
-            replace(at.get_value(), value);
-        } else {
-            at.set_value(value);
+            return t.negated;
         }
-    }
 
-    typedef std::shared_ptr<IteratorInternalT> IteratorPtr;
+        return false;
+    }
+};
+
+/**
+ * Key iterators, which are known to point into contiguous memory,
+ * so that comparison can be done on the memory directly.
+ */
+template <typename KeyIterator, typename AtomT>
+struct is_contiguous_iterator : std::integral_constant<bool,
+    (std::is_pointer<KeyIterator>::value and std::is_same<AtomT,
+        typename std::remove_cv<typename std::remove_pointer<KeyIterator>::type>::type>::value)
+    or std::is_same<KeyIterator, typename std::basic_string<AtomT>::iterator>::value
+    or std::is_same<KeyIterator, typename std::basic_string<AtomT>::const_iterator>::value
+    or std::is_same<KeyIterator, typename std::vector<AtomT>::iterator>::value
+    or std::is_same<KeyIterator, typename std::vector<AtomT>::const_iterator>::value>
+{ };
+
+/* Returns the length of the common prefix of the first n atoms of a and b */
+template <typename AtomT>
+inline size_t common_prefix(const AtomT * a, const AtomT * b, size_t n)
+{
+    const char * x = reinterpret_cast<const char *>(a);
+    const char * y = reinterpret_cast<const char *>(b);
+    size_t bytes = n * sizeof(AtomT);
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i cmp = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(y + i)));
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(cmp);
+
+        if (mask != 0) { return (i + __builtin_ctz(mask)) / sizeof(AtomT); }
+    }
+#endif
+
+#if defined(__SSE2__)
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i cmp = _mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + i)));
+        unsigned mask = ~(unsigned) _mm_movemask_epi8(cmp) & 0xffff;
+
+        if (mask != 0) { return (i + __builtin_ctz(mask)) / sizeof(AtomT); }
+    }
+#endif
+
+    for (i /= sizeof(AtomT); i < n and a[i] == b[i]; ++i) { }
+
+    return i;
+}
+
+/* Advances both k and it past the common prefix of the ranges */
+template <typename AtomT, typename KeyIterator>
+inline void skip_common(const AtomT *& k, const AtomT * kend,
+    KeyIterator & it, KeyIterator end, std::false_type)
+{
+    while ((it != end) and (k != kend) and (*k == *it))
+        { ++k; ++it; }
+}
+
+template <typename AtomT, typename KeyIterator>
+inline void skip_common(const AtomT *& k, const AtomT * kend,
+    KeyIterator & it, KeyIterator end, std::true_type)
+{
+    size_t n = std::min<size_t>(kend - k, end - it);
+
+    if (n != 0)
+    {
+        size_t m = common_prefix(k, std::addressof(*it), n);
+        k  += m;
+        it += m;
+    }
+}
+
+template <typename AtomT, typename KeyIterator>
+inline void skip_common(const AtomT *& k, const AtomT * kend,
+    KeyIterator & it, KeyIterator end)
+{
+    skip_common(k, kend, it, end, is_contiguous_iterator<KeyIterator, AtomT>());
+}
+
+/**
+ * Summary of the values in the subtree of a node, which trie_map keeps
+ * up to date. add() and remove() account for a value added or removed
+ * below, remove() returns false if the summary has to be recomputed from
+ * the node value and the summaries of its children with merge().
+ *
+ * This one keeps nothing.
+ */
+struct NoSummary
+{
+    static const bool enabled = false;
+    static const size_t max_size = SIZE_MAX; /* The number of values it can count */
+
+    template <typename V> void add(const V &) { }
+    template <typename V> bool remove(const V &) { return true; }
+    void merge(const NoSummary &) { }
+};
+
+/* The greatest value in the subtree */
+template <typename V>
+struct MaxSummary
+{
+    static_assert(std::is_arithmetic<V>::value, "values must be numbers to be scored");
+
+    static const bool enabled = true;
+    static const size_t max_size = SIZE_MAX;
+
+    V best = std::numeric_limits<V>::lowest();
+
+    void add(const V & x) { if (best < x) { best = x; } }
+    bool remove(const V & x) { return x < best; }
+    void merge(const MaxSummary & other) { add(other.best); }
+};
+
+/* The number of values in the subtree, 32 bits keep the node size */
+struct CountSummary
+{
+    static const bool enabled = true;
+    static const size_t max_size = UINT32_MAX;
+
+    uint32_t count = 0;
+
+    template <typename V> void add(const V &) { ++count; }
+    template <typename V> bool remove(const V &) { --count; return true; }
+    void merge(const CountSummary & other) { count += other.count; }
+};
+
+template <typename AtomT, typename PrefixHolderT, typename SummaryT = NoSummary>
+struct TrieNode : public PrefixHolderT
+{
+    static_assert(sizeof(AtomT) == 1, "adaptive child tables are indexed by bytes");
+
+    typedef SummaryT summary_type;
+
+private:
+    typedef TrieNode<AtomT, PrefixHolderT, SummaryT> self_type;
+    typedef self_type * self_pointer;
+
+    typedef ChildTable4<self_pointer>   Table4;
+    typedef ChildTable16<self_pointer>  Table16;
+    typedef ChildTable48<self_pointer>  Table48;
+    typedef ChildTable256<self_pointer> Table256;
+
+    enum : uint8_t { CNone = 0, CNode4, CNode16, CNode48, CNode256 };
+
+    /* Position of the end of any table */
+    enum : uint32_t { CEnd = 256 };
+
+    void * data = nullptr;
+    uint16_t count = 0;
+    uint8_t  kind = CNone;
+
+    /* Fits into the padding after the table header, if small */
+    SummaryT m_summary;
+
+    Table4   * t4()   const { return static_cast<Table4 *>(data); }
+    Table16  * t16()  const { return static_cast<Table16 *>(data); }
+    Table48  * t48()  const { return static_cast<Table48 *>(data); }
+    Table256 * t256() const { return static_cast<Table256 *>(data); }
+
+    static uint32_t capacity_of(uint8_t k)
+    {
+        static const uint32_t capacity[] = { 0, 4, 16, 48, 256 };
+        return capacity[k];
+    }
+
+    static size_t bytes_of(uint8_t k)
+    {
+        static const size_t bytes[] = { 0, sizeof(Table4), sizeof(Table16),
+            sizeof(Table48), sizeof(Table256) };
+        return bytes[k];
+    }
+
+    static uint8_t kind_for(uint32_t n)
+    {
+        return n == 0 ? CNone : n <= 4 ? CNode4 : n <= 16 ? CNode16 :
+            n <= 48 ? CNode48 : CNode256;
+    }
+
+    /* Position of the first child at or after pos */
+    uint32_t first_from(uint32_t pos) const
+    {
+        switch (kind)
+        {
+        case CNode4:
+        case CNode16:
+            return pos < count ? pos : CEnd;
+        case CNode48:
+            for (; pos < CEnd; ++pos) { if (t48()->index[pos] != 0) { return pos; } }
+            break;
+        case CNode256:
+            for (; pos < CEnd; ++pos) { if (t256()->child[pos] != nullptr) { return pos; } }
+            break;
+        }
+
+        return CEnd;
+    }
+
+    self_pointer child_at(uint32_t pos) const
+    {
+        switch (kind)
+        {
+        case CNode4:   return t4()->child[pos];
+        case CNode16:  return t16()->child[pos];
+        case CNode48:  return t48()->child[t48()->index[pos] - 1];
+        case CNode256: return t256()->child[pos];
+        }
+
+        return nullptr;
+    }
+
+    uint8_t key_at(uint32_t pos) const
+    {
+        switch (kind)
+        {
+        case CNode4:   return t4()->keys[pos];
+        case CNode16:  return t16()->keys[pos];
+        }
+
+        return (uint8_t) pos;
+    }
+
+    template <typename KeysT, typename ChildT>
+    static void insert_sorted(KeysT keys, ChildT child, uint32_t n, uint8_t k, self_pointer x)
+    {
+        uint32_t i = n;
+
+        for (; i > 0 and keys[i - 1] > k; --i)
+        {
+            keys[i]  = keys[i - 1];
+            child[i] = child[i - 1];
+        }
+
+        keys[i]  = k;
+        child[i] = x;
+    }
+
+    /* Puts a child into a table, which is known to have room for it */
+    void insert_into(uint8_t k, self_pointer x)
+    {
+        switch (kind)
+        {
+        case CNode4:
+            insert_sorted(t4()->keys, t4()->child, count, k, x);
+            break;
+        case CNode16:
+            insert_sorted(t16()->keys, t16()->child, count, k, x);
+            break;
+        case CNode48:
+        {
+            uint32_t slot = 0;
+            while (t48()->child[slot] != nullptr) { ++slot; }
+            t48()->child[slot] = x;
+            t48()->index[k] = slot + 1;
+            break;
+        }
+        case CNode256:
+            t256()->child[k] = x;
+            break;
+        }
+
+        ++count;
+    }
+
+    /* Moves children into the table of another layout */
+    template <typename ArenaT>
+    void relayout(ArenaT & arena, uint8_t new_kind)
+    {
+        self_type old;
+
+        std::swap(old.data, data);
+        std::swap(old.kind, kind);
+        std::swap(old.count, count);
+
+        if (new_kind != CNone)
+        {
+            data = arena.allocate(bytes_of(new_kind));
+            std::memset(data, 0, bytes_of(new_kind));
+            kind = new_kind;
+
+            for (map_iterator it = old.begin(); it != old.end(); ++it) {
+                insert_into(old.key_at(it.pos), value(it));
+            }
+        }
+
+        if (old.data != nullptr) {
+            arena.deallocate(old.data, bytes_of(old.kind));
+        }
+    }
+
+public:
+    struct map_iterator
+    {
+        const self_type * node;
+        uint32_t pos;
+
+        map_iterator() : node(nullptr), pos(0) { }
+        map_iterator(const self_type * anode, uint32_t apos) : node(anode), pos(apos) { }
+
+        map_iterator & operator ++() {
+            pos = node->first_from(pos + 1);
+            return *this;
+        }
+
+        bool operator == (const map_iterator & other) const {
+            return node == other.node and pos == other.pos;
+        }
+
+        bool operator != (const map_iterator & other) const {
+            return not (*this == other);
+        }
+    };
+
+    TrieNode() { }
+
+    inline static uint8_t atom_key(AtomT x) { return (uint8_t) x; }
+
+    static self_type * value(map_iterator x) { return x.node->child_at(x.pos); };
+
+    /** @brief Preallocates the table for the given number of children */
+    template <typename ArenaT>
+    void reserve(ArenaT & arena, uint32_t n)
+    {
+        if (n > capacity_of(kind)) { relayout(arena, kind_for(n)); }
+    }
+
+    template <typename ArenaT>
+    void clear(ArenaT & arena)
+    {
+        relayout(arena, CNone);
+    }
+
+    map_iterator find(AtomT x) const 
+    {
+        uint8_t k = atom_key(x);
+
+        switch (kind)
+        {
+        case CNode4:
+            for (uint32_t i = 0; i < count; ++i) {
+                if (t4()->keys[i] == k) { return map_iterator(this, i); }
+            }
+            break;
+        case CNode16:
+        {
+            int i = find_key16(t16()->keys, k, count);
+            if (i >= 0) { return map_iterator(this, i); }
+            break;
+        }
+        case CNode48:
+            if (t48()->index[k] != 0) { return map_iterator(this, k); }
+            break;
+        case CNode256:
+            if (t256()->child[k] != nullptr) { return map_iterator(this, k); }
+            break;
+        }
+
+        return nf();
+    }
+
+    /* Replaces the child at the position, keeping its atom */
+    void set_child(map_iterator pos, self_pointer x)
+    {
+        switch (kind)
+        {
+        case CNode4:   t4()->child[pos.pos] = x; break;
+        case CNode16:  t16()->child[pos.pos] = x; break;
+        case CNode48:  t48()->child[t48()->index[pos.pos] - 1] = x; break;
+        case CNode256: t256()->child[pos.pos] = x; break;
+        }
+    }
+
+    /* Gives a copy of another node its own copy of the child table */
+    template <typename ArenaT>
+    void unshare_table(ArenaT & arena)
+    {
+        if (data != nullptr)
+        {
+            void * copy = arena.allocate(bytes_of(kind));
+            std::memcpy(copy, data, bytes_of(kind));
+            data = copy;
+        }
+    }
+
+    /* Hints the part of the table find(x) reads into the cache */
+    void prefetch(AtomT x) const
+    {
+        uint8_t k = atom_key(x);
+
+        switch (kind)
+        {
+        case CNode4:
+        case CNode16:  detail::prefetch(data); break;
+        case CNode48:  detail::prefetch(t48()->index + k); break;
+        case CNode256: detail::prefetch(t256()->child + k); break;
+        }
+    }
+
+    /** @brief Returns the first child, which atom is greater than x */
+    map_iterator find_after(AtomT x) const
+    {
+        uint8_t k = atom_key(x);
+
+        switch (kind)
+        {
+        case CNode4:
+        case CNode16:
+            for (uint32_t i = 0; i < count; ++i) {
+                if (key_at(i) > k) { return map_iterator(this, i); }
+            }
+            break;
+        case CNode48:
+        case CNode256:
+            return map_iterator(this, first_from(k + 1u));
+        }
+
+        return end();
+    }
+
+    bool empty() const { return count == 0; }
+
+    uint32_t child_count() const { return count; }
+
+    /* The number of bytes the table with exactly fitting layout takes */
+    size_t table_footprint() const { return bytes_of(kind_for(count)); }
+
+    /** @brief Returns the only child of the node, or nullptr if
+     *  there are either no children or more than one.
+     */
+    self_type * single_child() const
+    {
+        return count == 1 ? value(begin()) : nullptr;
+    }
+
+    template <typename ArenaT>
+    void remove(ArenaT & arena, AtomT x)
+    {
+        map_iterator it = find(x);
+        uint8_t k = atom_key(x);
+
+        switch (kind)
+        {
+        case CNode4:
+            std::copy(t4()->keys + it.pos + 1, t4()->keys + count, t4()->keys + it.pos);
+            std::copy(t4()->child + it.pos + 1, t4()->child + count, t4()->child + it.pos);
+            break;
+        case CNode16:
+            std::copy(t16()->keys + it.pos + 1, t16()->keys + count, t16()->keys + it.pos);
+            std::copy(t16()->child + it.pos + 1, t16()->child + count, t16()->child + it.pos);
+            break;
+        case CNode48:
+            t48()->child[t48()->index[k] - 1] = nullptr;
+            t48()->index[k] = 0;
+            break;
+        case CNode256:
+            t256()->child[k] = nullptr;
+            break;
+        }
+
+        --count;
+
+        /* Shrink with some hysteresis to avoid relayouts back and forth */
+        if (count == 0 or (kind == CNode16 and count <= 3) or
+                (kind == CNode48 and count <= 12) or
+                (kind == CNode256 and count <= 40))
+        {
+            relayout(arena, kind_for(count));
+        }
+    }
+
+    template <typename ArenaT>
+    void put(ArenaT & arena, self_type * edge)
+    {
+        if (count == capacity_of(kind)) {
+            relayout(arena, kind_for(count + 1));
+        }
+
+        insert_into(atom_key(*edge->kbegin()), edge);
+    }
+
+    map_iterator begin() const { return map_iterator(this, first_from(0)); }
+    map_iterator end()   const { return map_iterator(this, CEnd); }
+    map_iterator nf()    const { return map_iterator(); }
+
+    SummaryT & summary() { return m_summary; }
+    const SummaryT & summary() const { return m_summary; }
+
+    /* The subtree keeps its values, so both nodes keep the summary */
+    template <typename ArenaT>
+    void split(ArenaT & arena, self_type * next, int breakIdx)
+    {
+        this->PrefixHolderT::psplit(next, breakIdx);
+        swap_children(*next);
+        this->swap_value(*next);
+        next->m_summary = m_summary;
+        put(arena, next);
+    }
+
+    /**
+     * The inverse of split(). Absorbs the only child of the node,
+     * taking its suffix, children and value. Key storage of both
+     * nodes must be adjacent (see PrefixHolder::adjacent).
+     */
+    void merge(self_type * next)
+    {
+        this->PrefixHolderT::pmerge(next);
+        swap_children(*next);
+        this->swap_value(*next);
+        m_summary = next->m_summary;
+    }
+
+    void swap_children(self_type & other)
+    {
+        std::swap(this->data, other.data);
+        std::swap(this->count, other.count);
+        std::swap(this->kind, other.kind);
+    }
+};
+
+/**
+ * Node for atoms wider than a byte, like UTF-32 code points or token ids,
+ * which are too many for tables indexed by atoms. Children are kept in
+ * a table of their atoms sorted in the order of atom_less and a parallel
+ * table of pointers. Small tables are scanned, larger ones are bisected.
+ * Tables double and halve, the capacity is kept in front of them.
+ */
+template <typename AtomT, typename PrefixHolderT, typename SummaryT = NoSummary>
+struct WideTrieNode : public PrefixHolderT
+{
+    static_assert(std::is_integral<AtomT>::value, "atoms must be integral");
+
+    typedef SummaryT summary_type;
+
+private:
+    typedef WideTrieNode<AtomT, PrefixHolderT, SummaryT> self_type;
+    typedef self_type * self_pointer;
+    typedef typename std::make_unsigned<AtomT>::type KeyT;
+
+    /* The table is the header, the children, then their atoms */
+    struct Header
+    {
+        uint64_t capacity;
+    };
+
+    static const uint32_t CMinCapacity = 4;
+
+    /* Tables up to that size are scanned */
+    static const uint32_t CScan = 16;
+
+    /* Position of the end of any table */
+    enum : uint32_t { CEnd = 0xffffffffu };
+
+    void * data = nullptr;
+    uint32_t count = 0;
+
+    SummaryT m_summary;
+
+    uint32_t capacity() const
+    {
+        return data == nullptr ? 0 : (uint32_t) static_cast<const Header *>(data)->capacity;
+    }
+
+    self_pointer * children() const
+    {
+        return reinterpret_cast<self_pointer *>(static_cast<Header *>(data) + 1);
+    }
+
+    KeyT * keys() const { return reinterpret_cast<KeyT *>(children() + capacity()); }
+
+    static size_t bytes_of(uint32_t capacity)
+    {
+        return capacity == 0 ? 0 : sizeof(Header) + capacity * (sizeof(self_pointer) + sizeof(KeyT));
+    }
+
+    static uint32_t capacity_for(uint32_t n)
+    {
+        uint32_t capacity = n == 0 ? 0 : CMinCapacity;
+        while (capacity < n) { capacity *= 2; }
+        return capacity;
+    }
+
+    /* Position of the first child, which atom is not less than k */
+    uint32_t lower(KeyT k) const
+    {
+        const KeyT * a = keys();
+
+        if (count <= CScan)
+        {
+            uint32_t i = 0;
+            while (i < count and a[i] < k) { ++i; }
+            return i;
+        }
+
+        /* Without branches, which the random atoms would mispredict */
+        const KeyT * base = a;
+
+        for (uint32_t n = count; n > 1; )
+        {
+            uint32_t half = n / 2;
+            base = base[half] < k ? base + half : base;
+            n -= half;
+        }
+
+        return (uint32_t) (base - a) + (*base < k ? 1 : 0);
+    }
+
+    template <typename ArenaT>
+    void resize(ArenaT & arena, uint32_t new_capacity)
+    {
+        void * old = data;
+        size_t old_bytes = bytes_of(capacity());
+        self_pointer * old_children = old == nullptr ? nullptr : children();
+        KeyT * old_keys = old == nullptr ? nullptr : keys();
+
+        data = nullptr;
+
+        if (new_capacity != 0)
+        {
+            data = arena.allocate(bytes_of(new_capacity));
+            static_cast<Header *>(data)->capacity = new_capacity;
+
+            std::copy(old_children, old_children + count, children());
+            std::copy(old_keys, old_keys + count, keys());
+        }
+
+        if (old != nullptr) {
+            arena.deallocate(old, old_bytes);
+        }
+    }
+
+public:
+    struct map_iterator
+    {
+        const self_type * node;
+        uint32_t pos;
+
+        map_iterator() : node(nullptr), pos(0) { }
+        map_iterator(const self_type * anode, uint32_t apos) : node(anode), pos(apos) { }
+
+        map_iterator & operator ++() {
+            pos = pos + 1 < node->count ? pos + 1 : CEnd;
+            return *this;
+        }
+
+        bool operator == (const map_iterator & other) const {
+            return node == other.node and pos == other.pos;
+        }
+
+        bool operator != (const map_iterator & other) const {
+            return not (*this == other);
+        }
+    };
+
+    WideTrieNode() { }
+
+    static self_type * value(map_iterator x) { return x.node->children()[x.pos]; };
+
+    /** @brief Preallocates the table for the given number of children */
+    template <typename ArenaT>
+    void reserve(ArenaT & arena, uint32_t n)
+    {
+        if (n > capacity()) { resize(arena, capacity_for(n)); }
+    }
+
+    template <typename ArenaT>
+    void clear(ArenaT & arena)
+    {
+        count = 0;
+        resize(arena, 0);
+    }
+
+    map_iterator find(AtomT x) const
+    {
+        uint32_t i = lower((KeyT) x);
+        return i < count and keys()[i] == (KeyT) x ? map_iterator(this, i) : nf();
+    }
+
+    /* Replaces the child at the position, keeping its atom */
+    void set_child(map_iterator pos, self_pointer x)
+    {
+        children()[pos.pos] = x;
+    }
+
+    /* Gives a copy of another node its own copy of the child table */
+    template <typename ArenaT>
+    void unshare_table(ArenaT & arena)
+    {
+        if (data != nullptr)
+        {
+            void * copy = arena.allocate(bytes_of(capacity()));
+            std::memcpy(copy, data, bytes_of(capacity()));
+            data = copy;
+        }
+    }
+
+    /* Hints the atoms find(x) starts with into the cache */
+    void prefetch(AtomT) const
+    {
+        if (data != nullptr) { detail::prefetch(keys()); }
+    }
+
+    /** @brief Returns the first child, which atom is greater than x */
+    map_iterator find_after(AtomT x) const
+    {
+        uint32_t i = lower((KeyT) x);
+        if (i < count and keys()[i] == (KeyT) x) { ++i; }
+
+        return i < count ? map_iterator(this, i) : end();
+    }
+
+    bool empty() const { return count == 0; }
+
+    uint32_t child_count() const { return count; }
+
+    /* The number of bytes the table with exactly fitting layout takes */
+    size_t table_footprint() const { return bytes_of(capacity_for(count)); }
+
+    /** @brief Returns the only child of the node, or nullptr if
+     *  there are either no children or more than one.
+     */
+    self_type * single_child() const
+    {
+        return count == 1 ? children()[0] : nullptr;
+    }
+
+    template <typename ArenaT>
+    void remove(ArenaT & arena, AtomT x)
+    {
+        uint32_t i = find(x).pos;
+
+        std::copy(children() + i + 1, children() + count, children() + i);
+        std::copy(keys() + i + 1, keys() + count, keys() + i);
+        --count;
+
+        /* Shrink with some hysteresis to avoid resizing back and forth,
+         * a table of the minimal capacity stays as it is */
+        uint32_t fit = capacity_for(count);
+        if (count <= capacity() / 4 and fit < capacity()) { resize(arena, fit); }
+    }
+
+    template <typename ArenaT>
+    void put(ArenaT & arena, self_type * edge)
+    {
+        if (count == capacity()) { resize(arena, capacity_for(count + 1)); }
+
+        KeyT k = (KeyT) *edge->kbegin();
+        uint32_t i = lower(k);
+
+        std::copy_backward(children() + i, children() + count, children() + count + 1);
+        std::copy_backward(keys() + i, keys() + count, keys() + count + 1);
+
+        children()[i] = edge;
+        keys()[i] = k;
+        ++count;
+    }
+
+    map_iterator begin() const { return map_iterator(this, count == 0 ? (uint32_t) CEnd : 0); }
+    map_iterator end()   const { return map_iterator(this, CEnd); }
+    map_iterator nf()    const { return map_iterator(); }
+
+    SummaryT & summary() { return m_summary; }
+    const SummaryT & summary() const { return m_summary; }
+
+    template <typename ArenaT>
+    void split(ArenaT & arena, self_type * next, int breakIdx)
+    {
+        this->PrefixHolderT::psplit(next, breakIdx);
+        swap_children(*next);
+        this->swap_value(*next);
+        next->m_summary = m_summary;
+        put(arena, next);
+    }
+
+    void merge(self_type * next)
+    {
+        this->PrefixHolderT::pmerge(next);
+        swap_children(*next);
+        this->swap_value(*next);
+        m_summary = next->m_summary;
+    }
+
+    void swap_children(self_type & other)
+    {
+        std::swap(this->data, other.data);
+        std::swap(this->count, other.count);
+    }
+};
+
+/**
+ * Stack, which keeps first CInline elements in place and
+ * only goes to the heap when it grows deeper than that.
+ */
+template <typename T, size_t CInline>
+struct InlineStack
+{
+private:
+    T m_inline[CInline];
+    std::vector<T> m_spill;
+    uint32_t m_size = 0;
+
+public:
+    InlineStack() { }
+
+    InlineStack(const InlineStack & other)
+        : m_spill(other.m_spill), m_size(other.m_size)
+    {
+        std::copy(other.m_inline, other.m_inline + std::min<size_t>(m_size, CInline), m_inline);
+    }
+
+    InlineStack & operator = (const InlineStack & other)
+    {
+        std::copy(other.m_inline, other.m_inline + std::min<size_t>(other.m_size, CInline), m_inline);
+        m_spill = other.m_spill;
+        m_size  = other.m_size;
+        return *this;
+    }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    T & operator [](size_t i) { return i < CInline ? m_inline[i] : m_spill[i - CInline]; }
+    const T & operator [](size_t i) const { return i < CInline ? m_inline[i] : m_spill[i - CInline]; }
+
+    T & back() { return (*this)[m_size - 1]; }
+    const T & back() const { return (*this)[m_size - 1]; }
+
+    void push_back(const T & x)
+    {
+        if (m_size < CInline) {
+            m_inline[m_size] = x;
+        } else {
+            m_spill.push_back(x);
+        }
+
+        ++m_size;
+    }
+
+    void pop_back()
+    {
+        if (m_size > CInline) { m_spill.pop_back(); }
+        --m_size;
+    }
+};
+
+/**
+ * Position in the trie: the path of child table positions from the
+ * trie root to the current node. Iteration is limited to the subtrie
+ * of the node at depth m_floor.
+ */
+template <typename AtomT, typename NodeT>
+struct TrieCursor
+{
+    typedef std::vector< AtomT > key_type;
+    typedef typename NodeT::map_iterator traverse_ptr;
+
+    /* Paths up to that depth do not need the heap */
+    static const size_t CInlineDepth = 24;
+
+    const NodeT * m_root;
+    InlineStack<traverse_ptr, CInlineDepth> m_ptrs;
+    uint32_t m_floor = 0;
+
+    TrieCursor(const NodeT * a_root = nullptr) : m_root(a_root) { };
+
+    const NodeT * get(int i = 0) const
+    {
+        if (m_root == nullptr) { return nullptr; }
+
+        int j = (int) m_ptrs.size() + i;
+        return j > 0 ? NodeT::value(m_ptrs[j - 1]) : (j == 0 ? m_root : nullptr);
+    }
+
+    typename NodeT::value_type & get_value() const
+    {
+        return const_cast<NodeT *>(get())->get_value();
+    }
+
+    template <typename OutputIterator>
+    void copy_key(OutputIterator output) const
+    {
+        output = std::copy(m_root->kbegin(), m_root->kend(), output);
+
+        for (size_t i = 0; i < m_ptrs.size(); ++i)
+        {
+            const NodeT * x = NodeT::value(m_ptrs[i]);
+            output = std::copy(x->kbegin(), x->kend(), output);
+        }
+    }
+
+    std::basic_string<AtomT> get_key_str() const
+    {
+        std::basic_string<AtomT> result;
+        copy_key(std::back_inserter(result));
+        return result;
+    }
+
+    key_type get_key() const
+    {
+        key_type result;
+        copy_key(std::back_inserter(result));
+        return result;
+    }
+
+    /* Reads the key label by label */
+    struct KeyReader
+    {
+        const TrieCursor & cursor;
+        size_t level = 0;
+        typename NodeT::key_iterator k, kend;
+
+        explicit KeyReader(const TrieCursor & a_cursor)
+            : cursor(a_cursor), k(cursor.m_root->kbegin()), kend(cursor.m_root->kend()) { }
+
+        bool done()
+        {
+            while (k == kend)
+            {
+                if (level == cursor.m_ptrs.size()) { return true; }
+
+                const NodeT * x = NodeT::value(cursor.m_ptrs[level++]);
+                k = x->kbegin();
+                kend = x->kend();
+            }
+
+            return false;
+        }
+    };
+
+    /* Compares the keys in the order of iteration without building them,
+     * the cursors may be in different tries */
+    bool key_less(const TrieCursor & other) const
+    {
+        KeyReader a(*this);
+        KeyReader b(other);
+
+        for (; ; ++a.k, ++b.k)
+        {
+            if (b.done()) { return false; }
+            if (a.done()) { return true; }
+            if (*a.k != *b.k) { return atom_less(*a.k, *b.k); }
+        }
+    }
+
+    bool step_down()
+    {
+        const NodeT * x = get();
+        traverse_ptr it = x->begin();
+
+        if (it != x->end()) 
+        {
+            m_ptrs.push_back(it);
+            return true;
+        }
+
+        return false;
+    }
+
+    bool step_fore()
+    {
+        if (m_ptrs.size() > m_floor)
+        {
+            const NodeT * up = get(-1);
+            return ++m_ptrs.back() != up->end();
+        }
+
+        return false;
+    }
+
+    bool step_up()
+    {
+        m_ptrs.pop_back();
+
+        return step_fore();
+    }
+
+    /* Moves to the next node, which is not in the subtree of the current one */
+    bool next_subtree()
+    {
+        if (step_fore())   { return true; }
+
+        while (m_ptrs.size() > m_floor) {
+            if (step_up()) { return true; }
+        }
+
+        m_root = nullptr;
+        return false;
+    }
+
+    void next()
+    {
+        if (step_down())   { return; }
+        next_subtree();
+    }
+
+    bool next_value()
+    {
+        do {
+            next();
+        } while (m_root != nullptr and !get()->has_value());
+
+        return m_root != nullptr;
+    }
+
+    void push(traverse_ptr it)
+    {
+        m_ptrs.push_back(it);
+    }
+
+    /* Limits further iteration to the subtrie of the current node */
+    void set_floor()
+    {
+        m_floor = m_ptrs.size();
+    }
+};
+
+typedef uint32_t trie_offset_t;
+
+/* Values up to this size are kept in the node, if they are trivially copyable */
+static const size_t CInlineValueSize = sizeof(void *);
+
+/* Values too big or not trivially copyable to be kept in the node live in the arena */
+template <typename ValueT, typename Enable = void>
+struct ValueHolder
+{
+private:
+    ValueT * value = nullptr;
+public:
+    typedef ValueT value_type; /* Effective type */
+
+    value_type & get_value()             { return *value; };
+    const value_type & get_value() const { return *value; };
+
+    bool     has_value() const noexcept  { return value != nullptr; };
+
+    /* The number of bytes the value takes out of the node */
+    static size_t value_footprint() { return sizeof(ValueT); }
+
+    /* The new value is built first, a throwing constructor keeps the old one */
+    template <typename ArenaT>
+    void set_value(ArenaT & arena, const ValueT & x)
+    {
+        ValueT * fresh = arena.template create<ValueT>(x);
+        clr_value(arena);
+        value = fresh;
+    };
+
+    template <typename ArenaT, typename ... Args>
+    void emplace_value(ArenaT & arena, Args && ... args)
+    {
+        ValueT * fresh = arena.template create<ValueT>(std::forward<Args>(args)...);
+        clr_value(arena);
+        value = fresh;
+    };
+
+    template <typename ArenaT>
+    void clr_value(ArenaT & arena)
+    {
+        if (value != nullptr) {
+            arena.destroy(value);
+            value = nullptr;
+        }
+    };
+
+    void swap_value(ValueHolder & other) { std::swap(this->value, other.value); };
+};
+
+/**
+ * Trivially copyable values up to CInlineValueSize bytes are kept in the
+ * node with a presence flag in place of the pointer to the value, which
+ * saves an allocation per key. Splitting and merging nodes moves the
+ * values between them, so that inserting or erasing a key may move the
+ * values of other keys.
+ */
+template <typename ValueT>
+struct ValueHolder<ValueT, typename std::enable_if<
+    std::is_trivially_copyable<ValueT>::value and sizeof(ValueT) <= CInlineValueSize>::type>
+{
+private:
+    /* Raw storage, as the value may not be default constructible */
+    typename std::aligned_storage<sizeof(ValueT), alignof(ValueT)>::type value;
+    bool present = false;
+public:
+    typedef ValueT value_type; /* Effective type */
+
+    value_type & get_value()             { return *reinterpret_cast<ValueT *>(&value); };
+    const value_type & get_value() const { return *reinterpret_cast<const ValueT *>(&value); };
+
+    bool     has_value() const noexcept  { return present; };
+
+    static size_t value_footprint() { return 0; }
+
+    template <typename ArenaT>
+    void set_value(ArenaT &, const ValueT & x)
+    {
+        new (&value) ValueT(x);
+        present = true;
+    };
+
+    /* Built aside, a throwing constructor keeps the old value */
+    template <typename ArenaT, typename ... Args>
+    void emplace_value(ArenaT &, Args && ... args)
+    {
+        ValueT x(std::forward<Args>(args)...);
+        new (&value) ValueT(x);
+        present = true;
+    };
+
+    template <typename ArenaT>
+    void clr_value(ArenaT &) { present = false; };
+
+    void swap_value(ValueHolder & other)
+    {
+        std::swap(value, other.value);
+        std::swap(present, other.present);
+    };
+};
+
+template <>
+struct ValueHolder<SetCounter>
+{
+private:
+    int count = 0;
+public:
+    typedef int value_type; /* Effective type */
+
+    value_type & get_value() noexcept { return count; };
+    const value_type & get_value() const noexcept { return count; };
+
+    bool     has_value() const noexcept      { return count != 0; };
+
+    static size_t value_footprint() { return 0; }
+
+    template <typename ArenaT>
+    void     set_value(ArenaT &, const value_type & x) { count = x; };
+
+    template <typename ArenaT, typename ... Args>
+    void     emplace_value(ArenaT &, Args && ... args) { count = value_type(std::forward<Args>(args)...); };
+
+    template <typename ArenaT>
+    void     clr_value(ArenaT &)                       { count = 0; };
+
+    void swap_value(ValueHolder & other) { std::swap(count, other.count); };
+};
+
+
+/**
+ * Piece of arena holding keys of several edges,
+ * the atoms follow the header immediately.
+ */
+template <typename AtomT>
+struct KeyChunk
+{
+    trie_offset_t size;
+    trie_offset_t capacity;
+    trie_offset_t live; /* Atoms of the keys still in use */
+
+    AtomT * data() { return reinterpret_cast<AtomT *>(this + 1); }
+    const AtomT * data() const { return reinterpret_cast<const AtomT *>(this + 1); }
+};
+
+template <typename AtomT, typename ValueT, size_t CMinChunkSize>
+struct PrefixHolder : public ValueHolder<ValueT>
+{
+private:
+    typedef PrefixHolder<AtomT, ValueT, CMinChunkSize> self_type;
+    typedef KeyChunk<AtomT> ChunkT;
+
+    ChunkT * chunk = nullptr;
+    trie_offset_t begin = 0, end = 0;
+public:
+    typedef const AtomT * key_iterator;
+
+    bool starts_with(AtomT x) const { return chunk->data()[begin] == x; };
+    key_iterator kbegin() const { return chunk->data() + begin; };
+    key_iterator kend()   const { return chunk->data() + end; };
+
+    ChunkT * insertion_hint() { return chunk; }
+
+    void setkey(ChunkT * achunk, trie_offset_t k, trie_offset_t kend)
+    {
+        chunk = achunk;
+        begin = k;
+        end   = kend;
+    }
+
+    /* Points to the key of the other node, which does not own it any more */
+    void share_key(const self_type * x)
+    {
+        setkey(x->chunk, x->begin, x->end);
+    }
+
+    void psplit(self_type * next, int breakIdx)
+    {
+        next->chunk = chunk;
+        next->begin = this->begin + breakIdx;
+        next->end   = this->end;
+        this->end   = next->begin;
+    }
+
+    bool adjacent(const self_type * next) const
+    {
+        return chunk == next->chunk and end == next->begin;
+    }
+
+    void pmerge(const self_type * next)
+    {
+        this->end = next->end;
+    }
+};
+
+template <typename AtomT, typename ValueT>
+struct PrefixHolder<AtomT, ValueT, 0> : public ValueHolder<ValueT>
+{
+private:
+    typedef PrefixHolder<AtomT, ValueT, 0> self_type;
+
+    AtomT  * prefix = nullptr;
+    size_t prefix_len = 0;
+public:
+    typedef const AtomT * key_iterator;
+
+    bool starts_with(AtomT x) const { return *prefix == x; };
+    key_iterator kbegin() const { return prefix; };
+    key_iterator kend()   const { return prefix + prefix_len; };
+
+    std::nullptr_t insertion_hint() { return nullptr; }
+
+    void setkey(AtomT * akey, size_t len)
+    {
+        prefix     = akey;
+        prefix_len = len;
+    }
+
+    /* Points to the key of the other node, which does not own it any more */
+    void share_key(const self_type * x)
+    {
+        setkey(x->prefix, x->prefix_len);
+    }
+
+    void psplit(self_type * next, int breakIdx)
+    {
+        next->prefix     = this->prefix + breakIdx;
+        next->prefix_len = this->prefix_len - breakIdx;
+        this->prefix_len -= next->prefix_len;
+    }
+
+    bool adjacent(const self_type * next) const
+    {
+        return prefix + prefix_len == next->prefix;
+    }
+
+    void pmerge(const self_type * next)
+    {
+        this->prefix_len += next->prefix_len;
+    }
+};
+
+template<typename AtomT, typename ValueT, size_t CMinChunkSize, 
+    typename SummaryT = NoSummary, typename Spec = void>
+struct TrieNodeSelector
+{
+    /* No default implementation.
+     * Must be specialized by code, which tries to use it. */
+};
+
+/* Byte atoms index adaptive tables, wider ones are kept in sorted ones */
+template<typename AtomT, typename ValueT, size_t CMinChunkSize, typename SummaryT>
+struct TrieNodeSelector<AtomT, ValueT, CMinChunkSize, SummaryT,
+    typename std::enable_if<std::is_integral<AtomT>::value>::type>
+{
+    typedef PrefixHolder<AtomT, ValueT, CMinChunkSize>  PrefixHolderType;
+    typedef typename std::conditional<sizeof(AtomT) == 1,
+        TrieNode<AtomT, PrefixHolderType, SummaryT>,
+        WideTrieNode<AtomT, PrefixHolderType, SummaryT> >::type type;
+};
+
+/**
+ * Layout of the immutable trie image (see trie_map::write_image()).
+ * All the numbers are in the native byte order, every section
+ * starts at a multiple of CImageAlign from the image start.
+ *
+ *   header | nodes | child nodes | child atoms | keys | values
+ *
+ * Nodes are stored in depth-first order with children ordered
+ * by their first atom, so that the subtree of node i takes the
+ * indexes [i, subtree_end) and the order of nodes is the order
+ * of keys. Node 0 is the root.
+ */
+enum : uint32_t
+{
+    CImageVersion = 1,
+    CImageEndian  = 0x01020304,
+    CImageAlign   = 8,
+    CImageNone    = 0xffffffffu,
+};
+
+struct ImageHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t atom_size;
+    uint32_t value_size;
+
+    uint64_t node_count;
+    uint64_t child_count;
+    uint64_t atom_count;
+    uint64_t value_count;
+
+    uint64_t nodes_offset;
+    uint64_t children_offset;
+    uint64_t atoms_offset;
+    uint64_t keys_offset;
+    uint64_t values_offset;
+    uint64_t total_size;
+};
+
+struct ImageNode
+{
+    uint64_t key_offset;  /* In atoms, into the key section */
+    uint32_t key_len;
+    uint32_t parent;      /* CImageNone for the root */
+    uint32_t child_begin; /* Into the child node and child atom sections */
+    uint32_t child_count;
+    uint32_t subtree_end;
+    uint32_t value_index; /* CImageNone if the node has no value */
+};
+
+static const char CImageMagic[8] = { 't', 'r', 'i', 'e', 'i', 'm', 'g', '1' };
+
+inline uint64_t image_align(uint64_t x)
+{
+    return (x + CImageAlign - 1) / CImageAlign * CImageAlign;
+}
+
+/**
+ * Epoch based reclamation. Readers announce the epoch they started in,
+ * the writer tags the memory it unlinks with the epoch it was unlinked in
+ * and reuses it once every active reader has announced a later epoch.
+ * There are CSlots reader slots. When all of them are taken, further
+ * readers block till one is left.
+ */
+struct EpochDomain
+{
+    enum : size_t { CSlots = 128 };
+
+    /* Padded to a cache line, as slots of different threads are adjacent */
+    struct Slot
+    {
+        std::atomic<uint64_t> epoch; /* 0 for a free slot */
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::atomic<uint64_t> global;
+    Slot slots[CSlots];
+
+    /* Readers waiting for a slot, leave() only locks when there are some */
+    std::atomic<size_t> waiting;
+    std::mutex lock;
+    std::condition_variable freed;
+
+    EpochDomain() : global(1), waiting(0)
+    {
+        for (size_t i = 0; i < CSlots; ++i) { slots[i].epoch.store(0, std::memory_order_relaxed); }
+    }
+
+    /* One pass over the slots, starting at the hint */
+    bool try_enter(size_t & hint)
+    {
+        for (size_t i = 0; i < CSlots; ++i)
+        {
+            size_t x = (hint + i) % CSlots;
+            uint64_t expected = 0;
+
+            if (slots[x].epoch.load() == 0 and
+                    slots[x].epoch.compare_exchange_strong(expected, global.load()))
+            {
+                hint = x;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /* Takes a free slot, preferably the one the thread had last time */
+    size_t enter()
+    {
+        static thread_local size_t hint =
+            std::hash<std::thread::id>()(std::this_thread::get_id()) % CSlots;
+
+        if (try_enter(hint)) { return hint; }
+
+        /* All the slots are taken, wait for a reader to leave. The slot
+         * is looked for after announcing the wait, so that no leave()
+         * in between is missed */
+        std::unique_lock<std::mutex> guard(lock);
+        ++waiting;
+
+        while (!try_enter(hint)) { freed.wait(guard); }
+
+        --waiting;
+        return hint;
+    }
+
+    void leave(size_t x)
+    {
+        slots[x].epoch.store(0);
+
+        if (waiting.load() != 0)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            freed.notify_one();
+        }
+    }
+
+    /* Starts the next epoch, returns the finished one */
+    uint64_t advance() { return global.fetch_add(1); }
+
+    /* Memory unlinked in an epoch before this one is not reachable by readers */
+    uint64_t oldest() const
+    {
+        uint64_t result = global.load();
+
+        for (size_t i = 0; i < CSlots; ++i)
+        {
+            uint64_t x = slots[i].epoch.load();
+            if (x != 0 and x < result) { result = x; }
+        }
+
+        return result;
+    }
+};
+
+/**
+ * Read-only file mapping, unmapped on destruction. Where mmap()
+ * is not available the file is read into an aligned buffer.
+ */
+struct MappedFile
+{
+    const void * data = nullptr;
+    size_t size = 0;
+
+    MappedFile() { }
+
+    explicit MappedFile(const std::string & path)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) { throw std::runtime_error("trie::MappedFile: cannot open " + path); }
+
+        struct stat st;
+
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("trie::MappedFile: cannot stat " + path);
+        }
+
+        if (st.st_size > 0)
+        {
+            void * p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+            if (p == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("trie::MappedFile: cannot map " + path);
+            }
+
+            data = p;
+            size = st.st_size;
+        }
+
+        ::close(fd);
+#else
+        std::ifstream stream(path.c_str(), std::ios::binary | std::ios::ate);
+        if (!stream) { throw std::runtime_error("trie::MappedFile: cannot open " + path); }
+
+        size = stream.tellg();
+        buffer.reset(new uint64_t[size / sizeof(uint64_t) + 1]);
+        stream.seekg(0);
+
+        if (!stream.read(reinterpret_cast<char *>(buffer.get()), size)) {
+            throw std::runtime_error("trie::MappedFile: cannot read " + path);
+        }
+
+        data = buffer.get();
+#endif
+    }
+
+    MappedFile(MappedFile && other) noexcept { swap(other); }
+
+    MappedFile & operator = (MappedFile && other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    void swap(MappedFile & other) noexcept
+    {
+        std::swap(data, other.data);
+        std::swap(size, other.size);
+#if !(defined(__unix__) || defined(__APPLE__))
+        std::swap(buffer, other.buffer);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (data != nullptr) { ::munmap(const_cast<void *>(data), size); }
+#endif
+    }
+
+private:
+#if !(defined(__unix__) || defined(__APPLE__))
+    std::unique_ptr<uint64_t[]> buffer;
+#endif
+};
+
+};
+
+/**
+ * @brief The node trie_map uses by default
+ *
+ * The allocator comes after the node in the parameters of trie_map,
+ * so it is spelled out to give a custom allocator.
+ */
+template <typename AtomT, typename ValueT, size_t CMinChunkSize = 0>
+using trie_node = typename detail::TrieNodeSelector<AtomT, ValueT, CMinChunkSize>::type;
+
+template <typename AtomT, typename ValueT, size_t CMinChunkSize = 0, 
+    typename NodeImpl = typename detail::TrieNodeSelector<AtomT, ValueT, CMinChunkSize>::type,
+    typename Allocator = std::allocator<char> >
+struct trie_map
+{
+private:
+    template <typename, typename, size_t, typename>
+    friend struct concurrent_trie_map;
+
+    template <typename, typename>
+    friend struct aho_corasick;
+
+    typedef NodeImpl NodeT;
+    typedef detail::TrieCursor<AtomT, NodeT> CursorT;
+
+    /* Nodes, child tables, values and keys all live in the arena */
+    typedef detail::TrieArena<Allocator>           ArenaT;
+public:
+    typedef typename NodeImpl::value_type          value_type;
+    typedef typename CursorT::key_type             key_type;
+    typedef typename NodeImpl::key_iterator        key_iterator;
+
+    typedef value_type mapped_type; /* Defined for the compatibility with map */
+private:
+    typedef detail::KeyChunk<AtomT> ChunkT;
+    typedef typename NodeT::summary_type SummaryT;
+
+    /* The nodes from the root down to the one being changed */
+    typedef detail::InlineStack<NodeT *, CursorT::CInlineDepth> PathT;
+
+    /* The number of elements */
+    size_t msize = 0;
+    size_t nedges = 0;
+
+    ArenaT arena;
+    NodeT * m_root = nullptr;
+
+    /* The last chunk keys were appended to */
+    ChunkT * last_chunk = nullptr;
+
+    template<typename KeyIterator>
+    void insert_infix(KeyIterator it, KeyIterator end, NodeT * parent, NodeT * n)
+    {
+        insert_infix(it, end, parent, n,
+            std::integral_constant<bool, CMinChunkSize == 0>());
+    }
+
+    /**
+     * Every key gets its own piece of arena. trie_map keeps each piece
+     * owned by a single node (see split_key() and merge_edge()), so that
+     * erase() can return it to the arena.
+     */
+    template<typename KeyIterator>
+    void insert_infix(KeyIterator it, KeyIterator end, NodeT *, NodeT * n, std::true_type)
+    {
+        size_t ksize = std::distance(it, end);
+        AtomT * target = static_cast<AtomT *>(arena.allocate(ksize * sizeof(AtomT)));
+
+        std::copy(it, end, target);
+        n->setkey(target, ksize);
+    }
+
+    /* Keys are packed into chunks of at least CMinChunkSize atoms,
+     * preferably into the one holding the parent key */
+    template<typename KeyIterator>
+    void insert_infix(KeyIterator it, KeyIterator end, NodeT * parent, NodeT * n, std::false_type)
+    {
+        size_t ksize = std::distance(it, end);
+        ChunkT * target = parent == nullptr ? nullptr : parent->insertion_hint();
+
+        if ((target == nullptr) or (target->size + ksize) > target->capacity)
+        {
+            if (last_chunk == nullptr or
+                    (last_chunk->size + ksize) > last_chunk->capacity)
+            {
+                size_t capacity = std::max(CMinChunkSize, ksize);
+
+                last_chunk = static_cast<ChunkT *>(
+                    arena.allocate(sizeof(ChunkT) + capacity * sizeof(AtomT)));
+                last_chunk->size = 0;
+                last_chunk->capacity = capacity;
+                last_chunk->live = 0;
+            }
+
+            target = last_chunk;
+        }
+
+        detail::trie_offset_t kidx = target->size;
+        std::copy(it, end, target->data() + kidx);
+        target->size += ksize;
+        target->live += ksize;
+
+        n->setkey(target, kidx, target->size);
+    }
+
+    NodeT * root() { return m_root; }
+
+    NodeT * new_edge(int hint)
+    {
+        NodeT * n = arena.template create<NodeT>();
+        if (hint > 0) { n->reserve(arena, hint); }
+        ++nedges;
+        return n;
+    }
+
+    /* The memory is returned to the arena size class free lists,
+     * which new_edge() takes from */
+    void release_edge(NodeT * n)
+    {
+        n->clear(arena);
+        n->clr_value(arena);
+        arena.destroy(n);
+        --nedges;
+    }
+
+    /* Returns the piece of the key to the arena */
+    void release_key(std::nullptr_t, const AtomT * k, size_t len)
+    {
+        arena.deallocate(const_cast<AtomT *>(k), len * sizeof(AtomT));
+    }
+
+    /**
+     * A chunk is returned once none of its atoms are in use. The last
+     * chunk is reused instead, the chunk of the root is kept, as an empty
+     * root key points into it without holding any atoms.
+     */
+    void release_key(ChunkT * chunk, const AtomT *, size_t len)
+    {
+        chunk->live -= len;
+
+        if (chunk->live != 0) { return; }
+
+        if (chunk == last_chunk) {
+            chunk->size = 0;
+        } else if (m_root == nullptr or m_root->insertion_hint() != chunk) {
+            arena.deallocate(chunk, sizeof(ChunkT) + chunk->capacity * sizeof(AtomT));
+        }
+    }
+
+    void release_key(NodeT * n)
+    {
+        release_key(n->insertion_hint(), n->kbegin(), n->kend() - n->kbegin());
+    }
+
+    /**
+     * Splits the key of the node at idx with split() and gives each part
+     * a piece of arena of its own, the parts would share the piece otherwise.
+     * The pieces are allocated before anything is changed. The old piece
+     * is released, unless it is not owned, then it is the caller's.
+     */
+    template <typename SplitFn>
+    void split_key(NodeT * n, NodeT * next, size_t idx, SplitFn split, bool owned = true)
+    {
+        split_key(n, next, idx, split, owned, std::integral_constant<bool, CMinChunkSize == 0>());
+    }
+
+    /* Chunks count the atoms in use, the parts stay where they are */
+    template <typename SplitFn>
+    void split_key(NodeT *, NodeT *, size_t, SplitFn split, bool, std::false_type) { split(); }
+
+    template <typename SplitFn>
+    void split_key(NodeT * n, NodeT * next, size_t idx, SplitFn split, bool owned, std::true_type)
+    {
+        const AtomT * old = n->kbegin();
+        size_t len = n->kend() - old;
+
+        AtomT * head = static_cast<AtomT *>(arena.allocate(idx * sizeof(AtomT)));
+        AtomT * tail = nullptr;
+
+        try {
+            tail = static_cast<AtomT *>(arena.allocate((len - idx) * sizeof(AtomT)));
+            split();
+        } catch (...) {
+            arena.deallocate(head, idx * sizeof(AtomT));
+            if (tail != nullptr) { arena.deallocate(tail, (len - idx) * sizeof(AtomT)); }
+            throw;
+        }
+
+        std::copy(old, old + idx, head);
+        std::copy(old + idx, old + len, tail);
+        n->setkey(head, idx);
+        next->setkey(tail, len - idx);
+
+        if (owned) { release_key(nullptr, old, len); }
+    }
+
+    /**
+     * Merges the node with its only child. If the keys of the nodes
+     * are not adjacent in a chunk, the joined key is copied, separate
+     * pieces of arena are never joined in place. Returns whether it was
+     * copied: the old keys are then released, unless they are not owned.
+     * concurrent_trie_map retires them instead, as readers may still use them.
+     */
+    bool merge_edge(NodeT * n, NodeT * next, bool owned = true)
+    {
+        bool copied = CMinChunkSize == 0 or !n->adjacent(next);
+
+        if (copied)
+        {
+            key_type joined(n->kbegin(), n->kend());
+            size_t breakIdx = joined.size();
+
+            auto head = n->insertion_hint();
+            auto tail = next->insertion_hint();
+            const AtomT * hk = n->kbegin();
+            const AtomT * tk = next->kbegin();
+
+            joined.insert(joined.end(), next->kbegin(), next->kend());
+            insert_infix(joined.begin(), joined.end(), n, n);
+
+            if (owned)
+            {
+                release_key(head, hk, breakIdx);
+                release_key(tail, tk, joined.size() - breakIdx);
+            }
+
+            n->psplit(next, breakIdx);
+        }
+
+        n->merge(next);
+        release_edge(next);
+        return copied;
+    }
+
+    template<typename KeyIterator>
+    NodeT * insert_edge(NodeT * parent, KeyIterator it, KeyIterator end)
+    {
+        NodeT * n = new_edge(0);
+        insert_infix(it, end, parent, n);
+        if (parent != nullptr) { parent->put(arena, n); }
+        return n;
+    }
+
+    template<typename KeyIterator>
+    NodeT * insert_edge(NodeT * parent, KeyIterator it, KeyIterator end, const value_type & value)
+    {
+        NodeT * n = insert_edge(parent, it, end);
+        n->set_value(arena, value);
+        return n;
+    }
+
+    /* Recomputes the summary of the node from its value and its children */
+    static void summarize(NodeT * n)
+    {
+        SummaryT result;
+
+        if (n->has_value()) { result.add(n->get_value()); }
+
+        for (auto it = n->begin(); it != n->end(); ++it) {
+            if (NodeT::value(it) != nullptr) { result.merge(NodeT::value(it)->summary()); }
+        }
+
+        n->summary() = result;
+    }
+
+    /* The value at the end of the path was replaced, old or now may be missing */
+    static void summary_update(const PathT & path, const value_type * old, const value_type * now)
+    {
+        for (size_t i = path.size(); i-- > 0; )
+        {
+            NodeT * x = path[i];
+
+            if (old == nullptr or x->summary().remove(*old)) {
+                if (now != nullptr) { x->summary().add(*now); }
+            } else {
+                summarize(x);
+            }
+        }
+    }
+
+    /* Visits every node of the trie, parents before children */
+    template<typename Callback>
+    static void for_each_node(NodeT * n, Callback f)
+    {
+        std::vector<NodeT *> stack(1, n);
+
+        while (!stack.empty())
+        {
+            NodeT * x = stack.back();
+            stack.pop_back();
+
+            for (auto it = x->begin(); it != x->end(); ++it) {
+                if (NodeT::value(it) != nullptr) { stack.push_back(NodeT::value(it)); }
+            }
+
+            f(x);
+        }
+    }
+
+    /* The number of arena bytes a squeezed copy of the subtree takes */
+    size_t footprint(NodeT * n) const
+    {
+        size_t result = 0;
+
+        for_each_node(n, [&result] (NodeT * x) {
+            result += ArenaT::rounded(sizeof(NodeT))
+                + ArenaT::rounded((x->kend() - x->kbegin()) * sizeof(AtomT))
+                + (x->empty() ? 0 : ArenaT::rounded(x->table_footprint()))
+                + (x->has_value() and x->value_footprint() != 0 ? ArenaT::rounded(x->value_footprint()) : 0);
+        });
+
+        return result;
+    }
+
+    /* Copies the trie into the (new) arena in depth-first order */
+    void clone_from(const NodeT * old_root)
+    {
+        std::vector< std::pair<const NodeT *, NodeT *> > stack(1,
+            std::make_pair(old_root, (NodeT *) nullptr));
+
+        while (!stack.empty())
+        {
+            const NodeT * x = stack.back().first;
+            NodeT * parent = stack.back().second;
+            stack.pop_back();
+
+            NodeT * n = arena.template create<NodeT>();
+            insert_infix(x->kbegin(), x->kend(), parent, n);
+
+            if (parent == nullptr) {
+                m_root = n;
+            } else {
+                parent->put(arena, n);
+            }
+
+            n->reserve(arena, x->child_count());
+
+            if (x->has_value()) { n->set_value(arena, x->get_value()); }
+            n->summary() = x->summary();
+
+            /* Children go in reverse, so that they are popped in order */
+            size_t mark = stack.size();
+
+            for (auto it = x->begin(); it != x->end(); ++it) {
+                stack.push_back(std::make_pair(NodeT::value(it), n));
+            }
+
+            std::reverse(stack.begin() + mark, stack.end());
+        }
+    }
+
+    void destroy_values()
+    {
+        if (!std::is_trivially_destructible<value_type>::value and m_root != nullptr) {
+            for_each_node(m_root, [this] (NodeT * n) { n->clr_value(arena); });
+        }
+    }
+
+public:
+    explicit trie_map(const Allocator & alloc = Allocator())
+        : arena(alloc) { }
+
+    trie_map(const trie_map &) = delete;
+    trie_map & operator = (const trie_map &) = delete;
+
+    trie_map(trie_map && other) { swap(other); }
+
+    trie_map & operator = (trie_map && other)
+    {
+        clear();
+        swap(other);
+        return *this;
+    }
+
+    ~trie_map() { destroy_values(); }
+
+    void swap(trie_map & other)
+    {
+        std::swap(msize, other.msize);
+        std::swap(nedges, other.nedges);
+        std::swap(m_root, other.m_root);
+        std::swap(last_chunk, other.last_chunk);
+        arena.swap(other.arena);
+    }
+
+    /** @brief The iterator, which is a cursor over the trie
+     *
+     *  There is no const iterator counterpart, because there is no real
+     *  benefit in making this iterator const.
+     *
+     *  The iterator keeps the path from the root to the current node
+     *  in place, so copying it and iterating do not touch the heap
+     *  unless the path is deeper than TrieCursor::CInlineDepth.
+     *  Keys are not stored, key() reconstructs them from the path.
+     */
+    struct iterator : public std::forward_iterator_tag
+    {
+        friend struct trie_map;
+
+    private:
+        CursorT _impl;
+
+        void normalize() {
+            if (!_impl.get()->has_value()) { ++(*this); }
+        }
+
+        explicit iterator(const CursorT & a_impl)
+            : _impl(a_impl) { normalize(); }
+
+    public:
+        iterator() { };
+
+        value_type & value() {
+            return _impl.get_value();
+        }
+
+        std::basic_string<AtomT> key() const {
+            return _impl.get_key_str();
+        }
+
+        /** @brief Whether the key is less than the key of the other
+         *  iterator, which may be of another trie. The keys are not built.
+         */
+        bool key_less(const iterator & other) const {
+            return _impl.key_less(other._impl);
+        }
+
+        value_type & operator *() { return value(); }
+
+        /*
+         * There is only one increment operator, since the postfix one
+         * is very heavy if implemented correctly.
+         */
+        iterator & operator ++()
+        {
+            if (_impl.m_root != nullptr)  {
+                _impl.next_value();
+            }
+
+            return *this;
+        }
+
+        /**
+         * Kept for compatibility, iterators are regular values now.
+         */
+        iterator clone() const { return *this; }
+
+        bool operator == (const iterator & other) const
+        {
+            return _impl.get() == other._impl.get();
+        }
+
+        bool operator != (const iterator & other) const
+        {
+            return not (*this == other);
+        }
+    };
+
+private:
+    typedef typename NodeT::map_iterator NodeItr;
+
+    /**
+     * Generalized lookup algorithm.
+     */
+    template<typename KeyIterator, typename A, typename B, typename C, typename D, typename E>
+    static inline void general_search
+    (
+        NodeT * n,
+        KeyIterator it,
+        KeyIterator end,
+        A exactMatchAction,
+        B noNextEdgeAction,
+        C endInTheMiddleAction,
+        D splitInTheMiddleAction,
+        E edgeAction
+    )
+    {
+        key_iterator kbegin = n->kbegin();
+
+        while (n != nullptr)
+        {
+            key_iterator kend   = n->kend();
+            key_iterator k      = kbegin;
+
+            detail::skip_common(k, kend, it, end);
+
+            if (it == end)
+            {
+                if (k == kend) {
+                    exactMatchAction(n);
+                } else {
+                    endInTheMiddleAction(n, k);
+                }
+
+                return;
+            }
+            else if (k != kend)
+            {
+                splitInTheMiddleAction(n, k, it);
+                return;
+            }
+
+            NodeItr next_edge = n->find(*it);
+
+            if (next_edge == n->nf())
+            {
+                noNextEdgeAction(n, it);
+                return;
+            }
+
+            edgeAction(next_edge, it);
+
+            n = NodeT::value(next_edge);
+            kbegin = n->kbegin() + 1;
+            ++it; /* Already found the first character */
+        }
+    }
+
+    /* The value of a key, which is not yet in the trie */
+    typedef detail::ValueHolder<ValueT> HolderT;
+
+    /**
+     * Finds the place of the key in one pass. If the key is there,
+     * update(node) changes its value, otherwise make(holder) constructs
+     * the new value before the trie is changed, so that a throwing
+     * constructor leaves it intact. The cursor, when given, is moved
+     * to the key. Returns whether the key was inserted.
+     */
+    template<typename KeyIterator, typename Make, typename Update>
+    bool insert_int(KeyIterator it, KeyIterator end, Make make, Update update, CursorT * output)
+    {
+        if (m_root == nullptr)
+        {
+            HolderT fresh;
+            make(fresh);
+
+            m_root = insert_edge(nullptr, it, end);
+            m_root->swap_value(fresh);
+            m_root->summary().add(m_root->get_value());
+            ++msize;
+
+            if (output != nullptr) { output->m_root = m_root; }
+            return true;
+        }
+
+        enum { CExact, CNoNextEdge, CEndInTheMiddle, CSplit } place = CExact;
+        NodeT * at = nullptr;
+        key_iterator eit = nullptr;
+        KeyIterator kit = end;
+
+        PathT path;
+        if (SummaryT::enabled) { path.push_back(root()); }
+        if (output != nullptr) { output->m_root = m_root; }
+
+        general_search(root(), it, end,
+            [&place, &at] (NodeT * n) { place = CExact; at = n; },
+
+            [&place, &at, &kit] (NodeT * n, KeyIterator k) {
+                place = CNoNextEdge; at = n; kit = k;
+            },
+
+            [&place, &at, &eit] (NodeT * n, key_iterator e) {
+                place = CEndInTheMiddle; at = n; eit = e;
+            },
+
+            [&place, &at, &eit, &kit] (NodeT * n, key_iterator e, KeyIterator k) {
+                place = CSplit; at = n; eit = e; kit = k;
+            },
+
+            [&path, output] (NodeItr x, KeyIterator) {
+                if (SummaryT::enabled) { path.push_back(NodeT::value(x)); }
+                if (output != nullptr) { output->push(x); }
+            }
+        );
+
+        if (place == CExact and at->has_value())
+        {
+            if (SummaryT::enabled)
+            {
+                value_type old = at->get_value();
+                update(*at);
+                summary_update(path, &old, &at->get_value());
+            } else {
+                update(*at);
+            }
+
+            return false;
+        }
+
+        if (msize >= SummaryT::max_size) {
+            throw std::length_error("trie::insert: too many keys to count");
+        }
+
+        HolderT fresh;
+        make(fresh);
+
+        NodeT * leaf = at;
+
+        try {
+            if (place == CEndInTheMiddle or place == CSplit)
+            {
+                NodeT * next = new_edge(place == CSplit ? 2 : 1);
+                size_t idx = eit - at->kbegin();
+
+                split_key(at, next, idx, [this, at, next, idx] () { at->split(arena, next, idx); });
+            }
+
+            if (place == CSplit or place == CNoNextEdge) {
+                leaf = insert_edge(at, kit, end);
+            }
+        } catch (...) {
+            fresh.clr_value(arena);
+            throw;
+        }
+
+        leaf->swap_value(fresh);
+        ++msize;
+
+        if (leaf != at)
+        {
+            if (SummaryT::enabled) { path.push_back(leaf); }
+            if (output != nullptr) { output->push(at->find(*kit)); }
+        }
+
+        summary_update(path, nullptr, &leaf->get_value());
+        return true;
+    }
+
+    /* Keeps the variadic iterator overloads from taking string keys */
+    template<typename KeyIterator>
+    struct NotString : std::enable_if<
+        !std::is_convertible<KeyIterator, std::basic_string<AtomT> >::value or
+            std::is_pointer<KeyIterator>::value> { };
+
+    /* The variadic overloads only take a range of two iterators of the
+     * same type. An array, such as a string literal, is always the key:
+     * emplace("key", "value") must not be read as a range */
+    template<typename KeyIterator, typename EndIterator,
+        typename IteratorT = typename std::decay<KeyIterator>::type>
+    struct KeyRange : std::enable_if<
+        std::is_same<IteratorT, typename std::decay<EndIterator>::type>::value and
+        !std::is_array<typename std::remove_reference<KeyIterator>::type>::value and
+        !std::is_array<typename std::remove_reference<EndIterator>::type>::value and
+        (!std::is_convertible<IteratorT, std::basic_string<AtomT> >::value or
+            std::is_pointer<IteratorT>::value)> { };
+
+public:
+    /** @brief Inserts the value or passes it to replace(old, value)
+     *  if the key is already there
+     *
+     *  Returns whether the key was inserted. Unlike emplace() it does not
+     *  build an iterator, which would make bulk inserts notably slower.
+     */
+    template<typename KeyIterator, typename ReplacePolicy>
+    bool insert(KeyIterator it, KeyIterator end, const value_type & value,
+                    const ReplacePolicy & replace)
+    {
+        return insert_int(it, end,
+            [this, &value] (HolderT & x) { x.set_value(arena, value); },
+            [&value, &replace] (NodeT & n) { replace(n.get_value(), value); },
+            nullptr);
+    }
+
+    /** @brief Moves the value in, replacing the existing one */
+    template<typename KeyIterator, typename = typename NotString<KeyIterator>::type>
+    bool insert(KeyIterator it, KeyIterator end, value_type && value)
+    {
+        return insert_int(it, end,
+            [this, &value] (HolderT & x) { x.emplace_value(arena, std::move(value)); },
+            [&value] (NodeT & n) { n.get_value() = std::move(value); },
+            nullptr);
+    }
+
+    /** @brief Constructs the value in place from the arguments,
+     *  replacing the existing one
+     */
+    template<typename KeyIterator, typename EndIterator, typename ... Args,
+        typename = typename KeyRange<KeyIterator, EndIterator>::type>
+    std::pair<iterator, bool> emplace(KeyIterator && it, EndIterator && end, Args && ... args)
+    {
+        std::pair<iterator, bool> result;
+        result.second = insert_int(it, end,
+            [&] (HolderT & x) { x.emplace_value(arena, std::forward<Args>(args)...); },
+            [&] (NodeT & n) {
+                HolderT fresh;
+                fresh.emplace_value(arena, std::forward<Args>(args)...);
+                n.swap_value(fresh);
+                fresh.clr_value(arena);
+            },
+            &result.first._impl);
+
+        return result;
+    }
+
+    /** @brief Constructs the value in place from the arguments
+     *  only if the key is not there, never touching the existing value
+     */
+    template<typename KeyIterator, typename EndIterator, typename ... Args,
+        typename = typename KeyRange<KeyIterator, EndIterator>::type>
+    std::pair<iterator, bool> try_emplace(KeyIterator && it, EndIterator && end, Args && ... args)
+    {
+        std::pair<iterator, bool> result;
+        result.second = insert_int(it, end,
+            [&] (HolderT & x) { x.emplace_value(arena, std::forward<Args>(args)...); },
+            [] (NodeT &) { },
+            &result.first._impl);
+
+        return result;
+    }
+
+    /** @brief Inserts the value returned by make() if the key is not
+     *  there, otherwise calls update(value)
+     *
+     *  make() is not called for the existing keys, which makes it suitable
+     *  for the values, which are expensive to build.
+     */
+    template<typename KeyIterator, typename MakeFn, typename UpdateFn>
+    std::pair<iterator, bool> upsert(KeyIterator it, KeyIterator end, MakeFn make, UpdateFn update)
+    {
+        std::pair<iterator, bool> result;
+        result.second = insert_int(it, end,
+            [this, &make] (HolderT & x) { x.emplace_value(arena, make()); },
+            [&update] (NodeT & n) { update(n.get_value()); },
+            &result.first._impl);
+
+        return result;
+    }
+
+    size_t size() const noexcept { return msize; }
+
+    template<typename KeyIterator>
+    size_t erase(KeyIterator it, KeyIterator end)
+    {
+        if (m_root == nullptr) { return 0; }
+
+        NodeT * parent = nullptr;
+        NodeT * n = root();
+        bool found = false;
+
+        PathT path;
+        if (SummaryT::enabled) { path.push_back(root()); }
+
+        general_search(root(), it, end,
+            [&found] (NodeT * x) { found = x->has_value(); },
+            [] (NodeT * , KeyIterator) { },
+            [] (NodeT * , key_iterator ) { },
+            [] (NodeT * , key_iterator , KeyIterator ) { },
+            [&parent, &n, &path] (NodeItr x, KeyIterator) {
+                parent = n;
+                n = NodeT::value(x);
+                if (SummaryT::enabled) { path.push_back(n); }
+            }
+        );
+
+        if (!found) { return 0; }
+
+        if (SummaryT::enabled)
+        {
+            value_type old = n->get_value();
+            n->clr_value(arena);
+            summary_update(path, &old, nullptr);
+        } else {
+            n->clr_value(arena);
+        }
+
+        --msize;
+
+        NodeT * child = n->single_child();
+
+        if (child != nullptr) {
+            merge_edge(n, child);
+        } else if (n->empty()) {
+            if (parent == nullptr) {
+                clear();
+                return 1;
+            }
+
+            parent->remove(arena, *n->kbegin());
+            release_key(n);
+            release_edge(n);
+
+            child = parent->single_child();
+
+            if (child != nullptr and !parent->has_value()) {
+                merge_edge(parent, child);
+            }
+        }
+
+        return 1;
+    }
+
+    size_t erase(const std::basic_string<AtomT> & str)
+    {
+        return erase(str.begin(), str.end());
+    }
+
+    /**
+     * @brief Relayouts the trie into a single contiguous block of memory
+     *
+     * Nodes are rewritten in depth-first order, each followed by its
+     * key, child table and value, so that a lookup mostly moves forward
+     * in memory. Child tables get the smallest fitting layout and
+     * storage left behind by erase() is reclaimed. The trie stays
+     * fully mutable. Invalidates all iterators.
+     */
+    void squeeze()
+    {
+        if (m_root == nullptr) { return; }
+
+        ArenaT old(arena.get_allocator());
+        NodeT * old_root = m_root;
+        ChunkT * old_chunk = last_chunk;
+        size_t total = footprint(old_root);
+
+        arena.swap(old);
+        m_root = nullptr;
+        last_chunk = nullptr;
+
+        try {
+            arena.reserve(total);
+            clone_from(old_root);
+        } catch (...) {
+            destroy_values();
+            arena.swap(old);
+            m_root = old_root;
+            last_chunk = old_chunk;
+            throw;
+        }
+
+        if (!std::is_trivially_destructible<value_type>::value) {
+            for_each_node(old_root, [&old] (NodeT * n) { n->clr_value(old); });
+        }
+    }
+
+    void clear()
+    {
+        destroy_values();
+        arena.release();
+        m_root = nullptr;
+        last_chunk = nullptr;
+        msize = 0;
+        nedges = 0;
+    }
+
+    /**
+     * @brief Builds the trie from keys coming in ascending order
+     *
+     * Keeps the path to the last key open and emits every node once,
+     * when no further key can reach it, so nodes are never split and
+     * child tables are allocated with their final size. A key equal to
+     * the previous one replaces its value, a key less than the previous
+     * one throws std::invalid_argument and leaves the builder as it was.
+     * The trie is cleared on construction and is complete after finish().
+     * A builder destroyed before finish(), such as by an exception, leaves
+     * the trie empty.
+     */
+    struct sorted_builder
+    {
+    private:
+        /* An open node, its label spans [begin, end) of the last key */
+        struct Open
+        {
+            NodeT * node;
+            size_t begin;
+            size_t end;
+            size_t children; /* The first of its children in done */
+        };
+
+        trie_map * map;
+        std::vector<Open> path;
+        std::vector<NodeT *> done; /* Emitted nodes, not yet attached */
+        std::basic_string<AtomT> last_key;
+        std::basic_string<AtomT> next_key;
+
+        NodeT * emit(const Open & x)
+        {
+            NodeT * n = x.node;
+            n->reserve(map->arena, done.size() - x.children);
+
+            for (size_t i = x.children; i < done.size(); ++i) {
+                n->put(map->arena, done[i]);
+            }
+
+            if (SummaryT::enabled) { summarize(n); }
+
+            done.resize(x.children);
+            return n;
+        }
+
+        void open(NodeT * parent, size_t common, const value_type & value)
+        {
+            if (map->msize >= SummaryT::max_size) {
+                throw std::length_error("trie::sorted_builder: too many keys to count");
+            }
+
+            NodeT * n = map->new_edge(0);
+
+            map->insert_infix(next_key.begin() + common, next_key.end(), parent, n);
+            path.push_back(Open { n, common, next_key.size(), done.size() });
+
+            try {
+                n->set_value(map->arena, value);
+            } catch (...) {
+                path.pop_back();
+                throw;
+            }
+
+            ++map->msize;
+
+            std::swap(last_key, next_key);
+        }
+
+    public:
+        explicit sorted_builder(trie_map & target) : map(&target) { map->clear(); }
+
+        sorted_builder(const sorted_builder &) = delete;
+        sorted_builder & operator = (const sorted_builder &) = delete;
+
+        /* Unless finished, rolls the trie back to empty */
+        ~sorted_builder()
+        {
+            if (path.empty()) { return; }
+
+            /* The children of the open nodes are all still in done */
+            if (!std::is_trivially_destructible<value_type>::value)
+            {
+                try {
+                    for (const Open & x : path) { x.node->clr_value(map->arena); }
+
+                    for (NodeT * n : done) {
+                        for_each_node(n, [this] (NodeT * x) { x->clr_value(map->arena); });
+                    }
+                } catch (...) {
+                    /* Out of memory for the walk, the rest of the values leak */
+                }
+            }
+
+            map->clear();
+        }
+
+        template <typename KeyIterator>
+        void push(KeyIterator it, KeyIterator end, const value_type & value)
+        {
+            if (path.empty() and map->m_root != nullptr) {
+                throw std::logic_error("trie::sorted_builder: already finished");
+            }
+
+            next_key.assign(it, end);
+
+            if (path.empty())
+            {
+                open(nullptr, 0, value);
+                return;
+            }
+
+            size_t common = detail::common_prefix(last_key.data(), next_key.data(),
+                std::min(last_key.size(), next_key.size()));
+
+            if (common == next_key.size())
+            {
+                if (common != last_key.size()) {
+                    throw std::invalid_argument("trie::sorted_builder: keys are not sorted");
+                }
+
+                path.back().node->set_value(map->arena, value);
+                return;
+            }
+
+            if (common < last_key.size() and
+                    detail::atom_less(next_key[common], last_key[common])) {
+                throw std::invalid_argument("trie::sorted_builder: keys are not sorted");
+            }
+
+            /* Emitting shrinks done to the children of the node before
+             * adding it, so done grows by one at most and no emitted
+             * node gets lost by a failing push_back() below */
+            done.reserve(done.size() + 1);
+
+            /* Nodes diverging from the new key are complete */
+            while (path.size() > 1 and path.back().begin >= common)
+            {
+                NodeT * n = emit(path.back());
+                path.pop_back();
+                done.push_back(n);
+            }
+
+            /* The new key branches off inside the label, the tail
+             * takes the value and the children of the node */
+            Open & x = path.back();
+
+            if (x.end > common)
+            {
+                Open tail = { map->new_edge(0), common, x.end, x.children };
+
+                NodeT * head = x.node;
+                size_t idx = common - x.begin;
+
+                map->split_key(head, tail.node, idx, [head, &tail, idx] () { head->psplit(tail.node, idx); });
+                x.node->swap_value(*tail.node);
+                x.end = common;
+
+                try {
+                    done.push_back(emit(tail));
+                } catch (...) {
+                    tail.node->clr_value(map->arena);
+                    throw;
+                }
+            }
+
+            open(path.back().node, common, value);
+        }
+
+        void push(const std::basic_string<AtomT> & key, const value_type & value)
+        {
+            push(key.begin(), key.end(), value);
+        }
+
+        /** @brief Emits the open nodes, the trie is ready afterwards */
+        void finish()
+        {
+            done.reserve(done.size() + 1);
+
+            while (!path.empty())
+            {
+                NodeT * n = emit(path.back());
+                path.pop_back();
+
+                if (path.empty()) {
+                    map->m_root = n;
+                } else {
+                    done.push_back(n);
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief Replaces the contents with the (key, value) pairs of the sorted range
+     * @see sorted_builder
+     */
+    template <typename InputIterator>
+    void build_sorted(InputIterator first, InputIterator last)
+    {
+        sorted_builder builder(*this);
+
+        for (; first != last; ++first) {
+            builder.push(first->first.begin(), first->first.end(), first->second);
+        }
+
+        builder.finish();
+    }
+
+private:
+    /* A part of the sorted input, built on its own and grafted under parent */
+    template <typename RandomAccessIterator>
+    struct BuildTask
+    {
+        NodeT * parent;
+        RandomAccessIterator first;
+        RandomAccessIterator last;
+        size_t depth; /* The length of the prefix the keys share with parent */
+    };
+
+    /**
+     * Builds the nodes above the parts of at most grain keys,
+     * splitting the range by the atom following the common prefix.
+     */
+    template <typename RandomAccessIterator>
+    void plan_build(NodeT * parent, RandomAccessIterator first, RandomAccessIterator last,
+        size_t depth, size_t grain, std::vector< BuildTask<RandomAccessIterator> > & tasks,
+        std::vector<NodeT *> & top)
+    {
+        if (parent != nullptr and (size_t) (last - first) <= grain)
+        {
+            tasks.push_back(BuildTask<RandomAccessIterator> { parent, first, last, depth });
+            return;
+        }
+
+        const auto & front = first->first;
+        const auto & back = (last - 1)->first;
+
+        if (front.size() < depth or back.size() < depth) {
+            throw std::invalid_argument("trie::build_sorted_parallel: keys are not sorted");
+        }
+
+        size_t common = depth;
+        size_t limit = std::min(front.size(), back.size());
+
+        while (common < limit and *(front.begin() + common) == *(back.begin() + common)) { ++common; }
+
+        NodeT * n = new_edge(0);
+        insert_infix(front.begin() + depth, front.begin() + common, parent, n);
+        top.push_back(n);
+
+        if (parent == nullptr) {
+            m_root = n;
+        } else {
+            parent->put(arena, n);
+        }
+
+        /* Equal keys, the last one wins */
+        for (; first != last and (size_t) first->first.size() == common; ++first)
+        {
+            if (!n->has_value()) { ++msize; }
+            n->set_value(arena, first->second);
+        }
+
+        while (first != last)
+        {
+            if ((size_t) first->first.size() <= common) {
+                throw std::invalid_argument("trie::build_sorted_parallel: keys are not sorted");
+            }
+
+            AtomT atom = *(first->first.begin() + common);
+
+            RandomAccessIterator group = std::partition_point(first, last,
+                [common, atom] (const typename std::iterator_traits<RandomAccessIterator>::value_type & x) {
+                    return (size_t) x.first.size() > common and *(x.first.begin() + common) == atom; });
+
+            if (group != last and !std::lexicographical_compare(
+                    (group - 1)->first.begin(), (group - 1)->first.end(),
+                    group->first.begin(), group->first.end(), detail::atom_less<AtomT>)) {
+                throw std::invalid_argument("trie::build_sorted_parallel: keys are not sorted");
+            }
+
+            plan_build(n, first, group, common, grain, tasks, top);
+            first = group;
+        }
+    }
+
+    template <typename RandomAccessIterator>
+    static void run_build(const BuildTask<RandomAccessIterator> & task, trie_map & part)
+    {
+        sorted_builder builder(part);
+
+        for (RandomAccessIterator x = task.first; x != task.last; ++x)
+        {
+            if ((size_t) x->first.size() <= task.depth) {
+                throw std::invalid_argument("trie::build_sorted_parallel: keys are not sorted");
+            }
+
+            builder.push(x->first.begin() + task.depth, x->first.end(), x->second);
+        }
+
+        builder.finish();
+    }
+
+public:
+    /**
+     * @brief build_sorted() on several threads
+     *
+     * The top of the trie is built first, down to the nodes, below which
+     * at most about 1/(16 * threads) of the keys lie. The subtries under
+     * those are built by sorted_builder in separate tries on the threads,
+     * then their roots are put into the child tables of the top nodes and
+     * their arenas are adopted, so no key is inserted twice.
+     *
+     * @param threads the number of threads, 0 to use all the cores
+     */
+    template <typename RandomAccessIterator>
+    void build_sorted_parallel(RandomAccessIterator first, RandomAccessIterator last,
+        size_t threads = 0)
+    {
+        typedef BuildTask<RandomAccessIterator> TaskT;
+
+        if (threads == 0) { threads = std::max(1u, std::thread::hardware_concurrency()); }
+
+        size_t grain = std::max<size_t>((last - first) / (threads * 16), 1024);
+
+        if (threads == 1 or (size_t) (last - first) <= grain)
+        {
+            build_sorted(first, last);
+            return;
+        }
+
+        clear();
+
+        std::vector<TaskT> tasks;
+        std::vector<trie_map> parts;
+        std::vector<std::exception_ptr> errors;
+        std::vector<size_t> order;
+        std::vector<NodeT *> top;
+
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> pool;
+
+        auto worker = [&] ()
+        {
+            for (size_t i = next++; i < order.size(); i = next++)
+            {
+                try {
+                    run_build(tasks[order[i]], parts[order[i]]);
+                } catch (...) {
+                    errors[order[i]] = std::current_exception();
+                }
+            }
+        };
+
+        try {
+            plan_build(nullptr, first, last, 0, grain, tasks, top);
+
+            parts.reserve(tasks.size());
+            errors.resize(tasks.size());
+
+            for (size_t i = 0; i < tasks.size(); ++i)
+            {
+                parts.emplace_back(arena.get_allocator());
+                order.push_back(i);
+            }
+
+            /* Largest first, so that the threads finish at about the same time */
+            std::sort(order.begin(), order.end(), [&tasks] (size_t a, size_t b) {
+                return tasks[a].last - tasks[a].first > tasks[b].last - tasks[b].first; });
+
+            for (size_t i = 1; i < std::min(threads, tasks.size()); ++i) {
+                pool.emplace_back(worker);
+            }
+
+            worker();
+
+            for (std::thread & x : pool) { x.join(); }
+
+            for (size_t i = 0; i < tasks.size(); ++i)
+            {
+                trie_map & part = parts[i];
+
+                if (errors[i] != nullptr or part.m_root == nullptr) { continue; }
+
+                tasks[i].parent->put(arena, part.m_root);
+                arena.adopt(part.arena);
+
+                msize += part.msize;
+                nedges += part.nedges;
+
+                part.m_root = nullptr;
+                part.last_chunk = nullptr;
+                part.msize = part.nedges = 0;
+            }
+        } catch (...) {
+            /* The threads already started stop after their current task */
+            next = order.size();
+
+            for (std::thread & x : pool) {
+                if (x.joinable()) { x.join(); }
+            }
+
+            clear();
+            throw;
+        }
+
+        for (const std::exception_ptr & x : errors)
+        {
+            if (x != nullptr)
+            {
+                clear();
+                std::rethrow_exception(x);
+            }
+        }
+
+        if (msize > SummaryT::max_size)
+        {
+            clear();
+            throw std::length_error("trie::build_sorted_parallel: too many keys to count");
+        }
+
+        /* The top nodes were planned parents first */
+        if (SummaryT::enabled)
+        {
+            for (size_t i = top.size(); i-- > 0; ) { summarize(top[i]); }
+        }
+    }
+
+    template<typename KeyIterator>
+    bool add(KeyIterator it, KeyIterator end, const value_type & value) {
+        return insert(it, end, value,
+            [] (value_type & old, const value_type & n) { old += n; } );
+    }
+
+    template<typename KeyIterator>
+    bool insert(KeyIterator it, KeyIterator end, const value_type & value) {
+        return insert(it, end, value,
+            [] (value_type & old, const value_type & n) { old = n; });
+    }
+
+    template<typename ReplacePolicy>
+    bool insert(const std::basic_string<AtomT> & str, const value_type & value,
+                    const ReplacePolicy & replace)
+    {
+        return insert(str.begin(), str.end(), value, replace);
+    }
+
+    bool add(const std::basic_string<AtomT> & str, const value_type & value) {
+        return add(str.begin(), str.end(), value);
+    }
+
+    bool insert(const std::basic_string<AtomT> & str, const value_type & value) {
+        return insert(str.begin(), str.end(), value);
+    }
+
+    bool insert(const std::basic_string<AtomT> & str, value_type && value) {
+        return insert(str.begin(), str.end(), std::move(value));
+    }
+
+    template<typename ... Args>
+    std::pair<iterator, bool> emplace(const std::basic_string<AtomT> & str, Args && ... args) {
+        return emplace(str.begin(), str.end(), std::forward<Args>(args)...);
+    }
+
+    template<typename ... Args>
+    std::pair<iterator, bool> try_emplace(const std::basic_string<AtomT> & str, Args && ... args) {
+        return try_emplace(str.begin(), str.end(), std::forward<Args>(args)...);
+    }
+
+    template<typename MakeFn, typename UpdateFn>
+    std::pair<iterator, bool> upsert(const std::basic_string<AtomT> & str, MakeFn make, UpdateFn update) {
+        return upsert(str.begin(), str.end(), make, update);
+    }
+
+private:
+    template<typename _ValueT, 
+        typename = typename std::enable_if<std::is_same<_ValueT, SetCounter>::value>::type>
+    struct SetSpecific { };
+
+public:
+
+    template<typename KeyIterator, typename _ValueT = ValueT, typename = SetSpecific<_ValueT> >
+    bool insert(KeyIterator it, KeyIterator end) {
+        return insert(it, end, 1);
+    }
+
+    template<typename KeyIterator, typename _ValueT = ValueT, typename = SetSpecific<_ValueT>  >
+    bool add(KeyIterator it, KeyIterator end) {
+        return add(it, end, 1);
+    }
+
+    template<typename _ValueT = ValueT, typename = SetSpecific<_ValueT> >
+    bool insert(const std::basic_string<AtomT> & str) {
+        return insert(str.begin(), str.end(), 1);
+    }
+
+    template<typename _ValueT = ValueT, typename = SetSpecific<_ValueT>  >
+    bool add(const std::basic_string<AtomT> & str) {
+        return add(str.begin(), str.end(), 1);
+    }
+
+    template<typename KeyIterator>
+    bool contains(KeyIterator it, KeyIterator end)
+    {
+        if (m_root == nullptr) { return false; }
+
+        bool result = false;
+
+        general_search(root(), it, end,
+            [&result] (NodeT * n) {
+                if (n->has_value()) { result = true; } },
+
+            [] (NodeT * , KeyIterator) { },
+            [] (NodeT * , key_iterator ) { },
+            [] (NodeT * , key_iterator , KeyIterator ) { },
+            [] (NodeItr, KeyIterator) { }
+        );
+
+        return result;
+    }
+
+    bool contains(const std::basic_string<AtomT> & str)
+    {
+        return contains(str.begin(), str.end());
+    }
+
+private:
+    /* Looks for the prefix starting from the node the cursor is at */
+    template <typename KeyIterator, typename CallbackType>
+    static iterator find_prefix_int(CursorT output, KeyIterator it, KeyIterator kend, CallbackType exactMatch)
+    {
+        bool found = false;
+
+        general_search(const_cast<NodeT *>(output.get()), it, kend,
+            /* Exact Match */
+            [&exactMatch, &found] (NodeT * n)  {
+                if (n->has_value()) { exactMatch(); }
+                found = true;
+            },
+
+            [] (NodeT *, KeyIterator) { },
+
+            [&found] (NodeT *, key_iterator) { found = true; },
+
+            [] (NodeT *, key_iterator, KeyIterator) {  },
+
+            [&output] (NodeItr x, KeyIterator) { output.push(x); }
+        );
+
+        if (!found) { return iterator(); }
+
+        output.set_floor();
+        return iterator(output);
+    }
+
+    template <typename KeyIterator>
+    static iterator find_prefix_int(const CursorT & base, KeyIterator it, KeyIterator kend, bool & exactMatch)
+    {
+        exactMatch = false;
+        return find_prefix_int(base, it, kend, [&exactMatch] () { exactMatch = true; });
+    }
+
+    template <typename KeyIterator>
+    static iterator find_prefix_int(const CursorT & base, KeyIterator it, KeyIterator kend, std::nullptr_t)
+    {
+        return find_prefix_int(base, it, kend, [] () {});
+    }
+
+public:
+    template <typename KeyIterator, typename CallbackType>
+    iterator find_prefix(KeyIterator it, KeyIterator kend, CallbackType exactMatch)
+    {
+        if (m_root == nullptr) { return end(); }
+        return find_prefix_int(CursorT(root()), it, kend, exactMatch);
+    }
+
+    /* NOTE : this specialization is needed to catch bool as reference, not as value */
+    template <typename KeyIterator>
+    iterator find_prefix(KeyIterator it, KeyIterator kend, bool & exactMatch)
+    {
+        if (m_root == nullptr) { return end(); }
+        return find_prefix_int(CursorT(root()), it, kend, exactMatch);
+    }
+
+    template <typename KeyIterator, typename CallbackType>
+    iterator find_prefix(const iterator & base, KeyIterator it, KeyIterator kend, CallbackType exactMatch)
+    {
+        if (base._impl.get() == nullptr) {
+            return end();
+        }
+
+        return find_prefix_int(base._impl, it, kend, exactMatch);
+    }
+
+    template <typename CallbackType>
+    iterator find_prefix(const std::basic_string<AtomT> & str, CallbackType exactMatch) {
+        return find_prefix(str.begin(), str.end(), exactMatch);
+    }
+
+    /* NOTE : this "specialization" (overload actually) is needed to catch 
+     * bool as reference, not as value */
+    iterator find_prefix(const std::basic_string<AtomT> & str, bool & exactMatch) {
+        return find_prefix(str.begin(), str.end(), exactMatch);
+    }
+
+    iterator find_prefix(const std::basic_string<AtomT> & str) {
+        return find_prefix(str.begin(), str.end(), [] () {});
+    }
+
+    /**
+     * @brief Calls fn(key, value, distance) for every key within the edit distance of the query
+     *
+     * The distance is the Levenshtein one: the number of atoms inserted,
+     * deleted or replaced. The trie is walked depth first, keeping a row
+     * of the distance matrix per key atom, and a subtree is skipped as
+     * soon as the whole row exceeds max_distance. Keys come in order.
+     */
+    template <typename Callback>
+    void find_fuzzy(const std::basic_string<AtomT> & query, size_t max_distance, Callback fn)
+    {
+        if (m_root == nullptr) { return; }
+
+        struct Item
+        {
+            NodeT * node;
+            size_t depth;
+        };
+
+        const size_t width = query.size() + 1;
+        std::basic_string<AtomT> key;
+        std::vector<size_t> rows(width);
+        std::vector<Item> stack(1, Item { root(), 0 });
+
+        for (size_t j = 0; j < width; ++j) { rows[j] = j; }
+
+        while (!stack.empty())
+        {
+            Item x = stack.back();
+            stack.pop_back();
+
+            key.resize(x.depth);
+            rows.resize((x.depth + 1) * width);
+
+            bool pruned = false;
+
+            for (key_iterator k = x.node->kbegin(); k != x.node->kend() and !pruned; ++k)
+            {
+                key.push_back(*k);
+                rows.resize(rows.size() + width);
+
+                const size_t * prev = rows.data() + rows.size() - 2 * width;
+                size_t * row = rows.data() + rows.size() - width;
+
+                /*
+                 * Only the cells at most max_distance off the diagonal can
+                 * be within the bound, the others count as max_distance + 1
+                 */
+                size_t i = key.size();
+                size_t lo = i > max_distance ? i - max_distance : 1;
+                size_t hi = std::min(query.size(), i + max_distance);
+                size_t prev_hi = std::min(query.size(), i - 1 + max_distance);
+
+                row[0] = std::min(prev[0] + 1, max_distance + 1);
+                if (lo > 1 and lo <= width) { row[lo - 1] = max_distance + 1; }
+
+                size_t best = row[0];
+
+                for (size_t j = lo; j <= hi; ++j)
+                {
+                    size_t up = j <= prev_hi ? prev[j] : max_distance + 1;
+
+                    row[j] = std::min({ up + 1, row[j - 1] + 1,
+                        prev[j - 1] + (query[j - 1] == *k ? 0 : 1) });
+                    best = std::min(best, row[j]);
+                }
+
+                pruned = best > max_distance;
+            }
+
+            if (pruned) { continue; }
+
+            size_t depth = key.size();
+            size_t distance = query.size() <= depth + max_distance ? rows.back() : max_distance + 1;
+
+            if (x.node->has_value() and distance <= max_distance) {
+                fn(key, x.node->get_value(), distance);
+            }
+
+            /* The first child on the top */
+            size_t first = stack.size();
+
+            for (auto it = x.node->begin(); it != x.node->end(); ++it) {
+                if (NodeT::value(it) != nullptr) {
+                    stack.push_back(Item { NodeT::value(it), key.size() });
+                }
+            }
+
+            std::reverse(stack.begin() + first, stack.end());
+        }
+    }
+
+    /** @brief The keys within the edit distance of the query with their distances, in order */
+    std::vector< std::pair<std::basic_string<AtomT>, size_t> >
+        find_fuzzy(const std::basic_string<AtomT> & query, size_t max_distance)
+    {
+        std::vector< std::pair<std::basic_string<AtomT>, size_t> > result;
+
+        find_fuzzy(query, max_distance,
+            [&result] (const std::basic_string<AtomT> & key, value_type &, size_t distance) {
+                result.push_back(std::make_pair(key, distance)); });
+
+        return result;
+    }
+
+    /**
+     * @brief Calls fn(key, value) for every key matching the glob pattern, in order
+     *
+     * The pattern may have '?' for any atom, '*' for any run of atoms,
+     * "[a-z]" or "[!a-z]" for an atom in or out of the listed ones and
+     * '\\' to escape any of those. The trie is walked depth first with
+     * the set of pattern positions reached so far, subtrees are skipped
+     * as soon as the set becomes empty, and while the pattern expects a
+     * literal atom only the child for it is visited.
+     */
+    template <typename Callback>
+    void match_pattern(const std::basic_string<AtomT> & pattern, Callback fn)
+    {
+        typedef detail::GlobPattern<AtomT> PatternT;
+
+        if (m_root == nullptr) { return; }
+
+        PatternT glob(pattern);
+        const size_t accept = glob.tokens.size();
+
+        struct Item
+        {
+            NodeT * node;
+            size_t depth;
+            size_t states; /* The positions reached before the node */
+            size_t count;
+        };
+
+        /* The sets of positions reached at the ends of the nodes on the stack */
+        std::vector<size_t> sets;
+        std::vector<size_t> current, next;
+        std::vector<size_t> seen(accept + 1, 0);
+        size_t stamp = 0;
+
+        /* Adds the position and the ones a '*' can be skipped to */
+        auto add = [&] (std::vector<size_t> & set, size_t p)
+        {
+            for (; seen[p] != stamp; ++p)
+            {
+                seen[p] = stamp;
+                set.push_back(p);
+
+                if (p == accept or glob.tokens[p].kind != PatternT::CStar) { break; }
+            }
+        };
+
+        ++stamp;
+        add(sets, 0);
+
+        std::basic_string<AtomT> key;
+        std::vector<Item> stack(1, Item { root(), 0, 0, sets.size() });
+
+        while (!stack.empty())
+        {
+            Item x = stack.back();
+            stack.pop_back();
+
+            key.resize(x.depth);
+            sets.resize(x.states + x.count);
+            current.assign(sets.begin() + x.states, sets.end());
+
+            for (key_iterator k = x.node->kbegin(); k != x.node->kend() and !current.empty(); ++k)
+            {
+                key.push_back(*k);
+                next.clear();
+                ++stamp;
+
+                for (size_t p : current)
+                {
+                    if (p == accept) { continue; }
+
+                    const typename PatternT::Token & t = glob.tokens[p];
+
+                    if (t.kind == PatternT::CStar) {
+                        add(next, p);
+                    } else if (glob.matches(t, *k)) {
+                        add(next, p + 1);
+                    }
+                }
+
+                current.swap(next);
+            }
+
+            if (current.empty()) { continue; }
+
+            if (x.node->has_value() and
+                    std::find(current.begin(), current.end(), accept) != current.end()) {
+                fn(key, x.node->get_value());
+            }
+
+            size_t states = sets.size();
+            sets.insert(sets.end(), current.begin(), current.end());
+
+            /* A single literal to match leads to a single child */
+            if (current.size() == 1 and current[0] != accept and
+                    glob.tokens[current[0]].kind == PatternT::CLiteral)
+            {
+                NodeItr it = x.node->find(glob.tokens[current[0]].atom);
+
+                if (it != x.node->nf() and NodeT::value(it) != nullptr) {
+                    stack.push_back(Item { NodeT::value(it), key.size(), states, current.size() });
+                }
+
+                continue;
+            }
+
+            if (current.size() == 1 and current[0] == accept) { continue; }
+
+            size_t first = stack.size();
+
+            for (NodeItr it = x.node->begin(); it != x.node->end(); ++it) {
+                if (NodeT::value(it) != nullptr) {
+                    stack.push_back(Item { NodeT::value(it), key.size(), states, current.size() });
+                }
+            }
+
+            std::reverse(stack.begin() + first, stack.end());
+        }
+    }
+
+    template <typename KeyIterator>
+    iterator find(KeyIterator it, KeyIterator kend)
+    {
+        if (m_root == nullptr) { return end(); }
+
+        CursorT output(root());
+        bool found = false;
+
+        general_search(root(), it, kend,
+            [&found] (NodeT * n) { found = n->has_value(); },
+            [] (NodeT *, KeyIterator  ) { },
+            [] (NodeT *, key_iterator ) { },
+            [] (NodeT *, key_iterator, KeyIterator ) { },
+            [&output] (NodeItr x, KeyIterator)   { output.push(x); }
+        );
+
+        return found ? iterator(output) : end();
+    }
+
+    iterator find(const std::basic_string<AtomT> & str)
+    {
+        return find(str.begin(), str.end());
+    }
+
+    iterator begin() { 
+        return m_root == nullptr ? end() :
+            iterator(CursorT(root())); }
+
+    iterator end()   { return iterator(); }
+
+private:
+    /* A node on the stack of a walker with the length of the key above it */
+    struct WalkItem
+    {
+        const NodeT * node;
+        size_t depth;
+    };
+
+    /* A node given away to the other walkers, with the key above it */
+    struct WalkTask
+    {
+        const NodeT * node;
+        std::basic_string<AtomT> prefix;
+    };
+
+    struct WalkQueue
+    {
+        std::mutex lock;
+        std::deque<WalkTask> tasks;
+        char padding[64];
+    };
+
+    /**
+     * Calls visit(worker, key, value) for every value of the subtrie the
+     * cursor is limited to on a number of threads. Each walker goes down
+     * its subtree depth first on a stack of its own. While some walker
+     * is idle, the busy ones move the bottom half of their stacks, which
+     * are the largest subtrees, to their queues, where the idle ones
+     * steal them from. The key is kept only if WithKeys is set.
+     */
+    template <bool WithKeys, typename Visitor>
+    static void parallel_walk(const CursorT & subtrie, size_t threads, Visitor visit)
+    {
+        if (subtrie.m_root == nullptr) { return; }
+
+        WalkTask root { subtrie.m_root, std::basic_string<AtomT>() };
+
+        for (size_t i = 0; i < subtrie.m_floor; ++i)
+        {
+            if (WithKeys) { root.prefix.append(root.node->kbegin(), root.node->kend()); }
+            root.node = NodeT::value(subtrie.m_ptrs[i]);
+        }
+
+        std::vector<WalkQueue> queues(threads);
+        queues[0].tasks.push_back(std::move(root));
+
+        std::atomic<size_t> busy(0);   /* Walkers having a subtree */
+        std::atomic<size_t> queued(1); /* Subtrees in the queues */
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+
+        /* Own queue from the back, the others from the front */
+        auto take = [&] (size_t w, WalkTask & out) -> bool
+        {
+            for (size_t i = 0; i < threads; ++i)
+            {
+                WalkQueue & q = queues[(w + i) % threads];
+                std::lock_guard<std::mutex> guard(q.lock);
+
+                if (q.tasks.empty()) { continue; }
+
+                if (i == 0) {
+                    out = std::move(q.tasks.back());
+                    q.tasks.pop_back();
+                } else {
+                    out = std::move(q.tasks.front());
+                    q.tasks.pop_front();
+                }
+
+                --queued;
+                ++busy;
+                return true;
+            }
+
+            return false;
+        };
+
+        auto worker = [&] (size_t w)
+        {
+            std::vector<WalkItem> stack;
+            std::basic_string<AtomT> key;
+            WalkTask task;
+
+            try {
+                while (!failed.load(std::memory_order_relaxed))
+                {
+                    if (!take(w, task))
+                    {
+                        /* Whoever has a subtree may still give some of it away */
+                        if (busy.load() == 0) { break; }
+
+                        std::this_thread::yield();
+                        continue;
+                    }
+
+                    key.swap(task.prefix);
+                    stack.push_back(WalkItem { task.node, key.size() });
+
+                    while (!stack.empty())
+                    {
+                        WalkItem x = stack.back();
+                        stack.pop_back();
+
+                        if (WithKeys)
+                        {
+                            key.resize(x.depth);
+                            key.append(x.node->kbegin(), x.node->kend());
+                        }
+
+                        if (x.node->has_value()) {
+                            visit(w, key, const_cast<NodeT *>(x.node)->get_value());
+                        }
+
+                        for (auto it = x.node->begin(); it != x.node->end(); ++it) {
+                            if (NodeT::value(it) != nullptr) {
+                                stack.push_back(WalkItem { NodeT::value(it), key.size() });
+                            }
+                        }
+
+                        if (stack.size() > 1 and
+                                threads - busy.load(std::memory_order_relaxed) >
+                                    queued.load(std::memory_order_relaxed))
+                        {
+                            size_t half = stack.size() / 2;
+                            std::lock_guard<std::mutex> guard(queues[w].lock);
+
+                            for (size_t i = 0; i < half; ++i)
+                            {
+                                queues[w].tasks.push_back(WalkTask { stack[i].node,
+                                    WithKeys ? key.substr(0, stack[i].depth) : key });
+                            }
+
+                            queued += half;
+                            stack.erase(stack.begin(), stack.begin() + half);
+                        }
+                    }
+
+                    --busy;
+                }
+            } catch (...) {
+                if (!failed.exchange(true)) { error = std::current_exception(); }
+            }
+        };
+
+        std::vector<std::thread> pool;
+
+        try {
+            for (size_t i = 1; i < threads; ++i) { pool.emplace_back(worker, i); }
+        } catch (...) {
+            failed = true;
+            for (std::thread & x : pool) { x.join(); }
+            throw;
+        }
+
+        worker(0);
+
+        for (std::thread & x : pool) { x.join(); }
+
+        if (error != nullptr) { std::rethrow_exception(error); }
+    }
+
+    static size_t walk_threads(size_t threads)
+    {
+        return threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+public:
+    /**
+     * @brief Calls fn(value) or fn(key, value) for every value of the subtrie on a number of threads
+     *
+     * The subtrie is the one the iterator is limited to: the whole trie
+     * for begin(), the keys with the prefix for find_prefix(). The key is
+     * only built, if fn takes it. The values are visited in no particular
+     * order and fn is called concurrently, while the trie itself must not
+     * be modified until the call returns.
+     *
+     * @param threads the number of threads, 0 to use all the cores
+     */
+    template <typename Function>
+    void parallel_for_each(const iterator & subtrie, Function fn, size_t threads = 0)
+    {
+        typedef std::basic_string<AtomT> KeyT;
+        typedef std::integral_constant<bool,
+            detail::takes_key<Function, KeyT, value_type>::value> WithKeys;
+
+        parallel_walk<WithKeys::value>(subtrie._impl, walk_threads(threads),
+            [&fn] (size_t, const KeyT & key, value_type & value) {
+                detail::visit(fn, key, value, WithKeys()); });
+    }
+
+    /** @brief Calls fn(value) or fn(key, value) for every value on a number of threads */
+    template <typename Function>
+    void parallel_for_each(Function fn, size_t threads = 0)
+    {
+        parallel_for_each(begin(), fn, threads);
+    }
+
+    /**
+     * @brief Combines fn(value) or fn(key, value) of every value of the subtrie on a number of threads
+     *
+     * Every thread folds the results of its values into a copy of init
+     * with combine, then the results of the threads are folded the same
+     * way. Hence combine must be associative and commutative and init
+     * must be its identity, like 0 for a sum.
+     */
+    template <typename T, typename Function, typename Combine>
+    T parallel_reduce(const iterator & subtrie, T init, Function fn, Combine combine, size_t threads = 0)
+    {
+        typedef std::basic_string<AtomT> KeyT;
+        typedef std::integral_constant<bool,
+            detail::takes_key<Function, KeyT, value_type>::value> WithKeys;
+
+        struct Partial
+        {
+            T value;
+            char padding[64];
+        };
+
+        threads = walk_threads(threads);
+        std::vector<Partial> partials(threads, Partial { init, { } });
+
+        parallel_walk<WithKeys::value>(subtrie._impl, threads,
+            [&] (size_t w, const KeyT & key, value_type & value) {
+                partials[w].value = combine(std::move(partials[w].value),
+                    detail::visit(fn, key, value, WithKeys())); });
+
+        for (Partial & x : partials) { init = combine(std::move(init), std::move(x.value)); }
+
+        return init;
+    }
+
+    /** @brief Combines fn(value) or fn(key, value) of every value on a number of threads */
+    template <typename T, typename Function, typename Combine>
+    T parallel_reduce(T init, Function fn, Combine combine, size_t threads = 0)
+    {
+        return parallel_reduce(begin(), std::move(init), fn, combine, threads);
+    }
+
+private:
+    /* Common part of lower_bound() and upper_bound() */
+    template <typename KeyIterator>
+    iterator bound(KeyIterator it, KeyIterator kend, bool upper)
+    {
+        if (m_root == nullptr) { return end(); }
+
+        CursorT output(root());
+
+        /* Whether the whole subtree of the node found precedes the key */
+        bool precedes = false;
+        bool exact = false;
+
+        general_search(root(), it, kend,
+            [&exact, upper] (NodeT * n) {
+                exact = upper and n->has_value(); },
+
+            [&output, &precedes] (NodeT * n, KeyIterator kit) {
+                NodeItr next = n->find_after(*kit);
+
+                if (next != n->end()) {
+                    output.push(next);
+                } else {
+                    precedes = true;
+                }
+            },
+
+            [] (NodeT *, key_iterator) { },
+
+            [&precedes] (NodeT *, key_iterator k, KeyIterator kit) {
+                precedes = detail::atom_less(*k, *kit); },
+
+            [&output] (NodeItr x, KeyIterator) { output.push(x); }
+        );
+
+        if (precedes and !output.next_subtree()) {
+            return end();
+        }
+
+        iterator result(output);
+
+        if (exact) { ++result; }
+
+        return result;
+    }
+
+public:
+    /** @brief Returns the iterator to the first key, which is not less than the given one */
+    template <typename KeyIterator>
+    iterator lower_bound(KeyIterator it, KeyIterator kend) {
+        return bound(it, kend, false);
+    }
+
+    /** @brief Returns the iterator to the first key, which is greater than the given one */
+    template <typename KeyIterator>
+    iterator upper_bound(KeyIterator it, KeyIterator kend) {
+        return bound(it, kend, true);
+    }
+
+    iterator lower_bound(const std::basic_string<AtomT> & str) {
+        return lower_bound(str.begin(), str.end());
+    }
+
+    iterator upper_bound(const std::basic_string<AtomT> & str) {
+        return upper_bound(str.begin(), str.end());
+    }
+
+    std::pair<iterator, iterator> equal_range(const std::basic_string<AtomT> & str) {
+        return std::make_pair(lower_bound(str), upper_bound(str));
+    }
+
+    /** @brief Returns the range of keys in [from, to) */
+    std::pair<iterator, iterator> range(const std::basic_string<AtomT> & from,
+        const std::basic_string<AtomT> & to)
+    {
+        /* In the order of iteration, atoms compare unsigned */
+        if (!std::lexicographical_compare(from.begin(), from.end(),
+                to.begin(), to.end(), detail::atom_less<AtomT>)) {
+            return std::make_pair(end(), end());
+        }
+
+        return std::make_pair(lower_bound(from), lower_bound(to));
+    }
+
+    template <typename KeyIterator>
+    value_type * get(KeyIterator it, KeyIterator end)
+    {
+        if (m_root == nullptr) { return nullptr; }
+
+        value_type * result = nullptr;
+
+        general_search(root(), it, end,
+            [&result] (NodeT * n) {
+                if (n->has_value()) {
+                    result = std::addressof(n->get_value()); }
+            },
+
+            [] (NodeT * , KeyIterator) { },
+            [] (NodeT * , key_iterator ) { },
+            [] (NodeT * , key_iterator , KeyIterator ) { },
+            [] (NodeItr, KeyIterator) { }
+        );
+
+        return result;
+    }
+
+    value_type * get(const std::basic_string<AtomT> & str)
+    {
+        return get(str.begin(), str.end());
+    }
+
+    template <typename KeyIterator>
+    value_type & at(KeyIterator it, KeyIterator end)
+    {
+        value_type * result = get(it, end);
+
+        if (result == nullptr) {
+            throw std::out_of_range("trie::at"); 
+        }
+
+        return *result;
+    }
+
+    value_type & at(const std::basic_string<AtomT> & str)
+    {
+        return at(str.begin(), str.end());
+    }
+
+    value_type & operator [](const std::basic_string<AtomT> & str)
+    {
+        return at(str.begin(), str.end());
+    }
+
+    /**
+     * @brief Calls fn(length, value) for every stored key, which is a prefix of the given one
+     *
+     * The keys come from the shortest one in a single lookup, which does
+     * not allocate. The key found is the first length atoms of the given one.
+     */
+    template <typename KeyIterator, typename Callback>
+    void common_prefixes(KeyIterator it, KeyIterator end, Callback fn)
+    {
+        if (m_root == nullptr) { return; }
+
+        NodeT * n = root();
+        size_t depth = 0; /* The length of the key above n */
+
+        /* The label of x is matched up to its end */
+        auto matched = [&fn, &depth] (NodeT * x)
+        {
+            if (x->has_value()) {
+                fn(depth + (size_t) (x->kend() - x->kbegin()), x->get_value());
+            }
+        };
+
+        general_search(root(), it, end,
+            matched,
+            [&matched] (NodeT * x, KeyIterator) { matched(x); },
+            [] (NodeT * , key_iterator ) { },
+            [] (NodeT * , key_iterator , KeyIterator ) { },
+            [&matched, &n, &depth] (NodeItr x, KeyIterator) {
+                matched(n);
+                depth += n->kend() - n->kbegin();
+                n = NodeT::value(x);
+            }
+        );
+    }
+
+    template <typename Callback>
+    void common_prefixes(const std::basic_string<AtomT> & str, Callback fn)
+    {
+        common_prefixes(str.begin(), str.end(), fn);
+    }
+
+    /**
+     * @brief The value of the longest key, which is a prefix of the given one
+     *
+     * Returns nullptr if there is no such key, otherwise stores the length
+     * of the key found to length.
+     */
+    template <typename KeyIterator>
+    value_type * longest_prefix(KeyIterator it, KeyIterator end, size_t & length)
+    {
+        value_type * result = nullptr;
+
+        common_prefixes(it, end, [&result, &length] (size_t n, value_type & value) {
+            result = std::addressof(value);
+            length = n;
+        });
+
+        return result;
+    }
+
+    value_type * longest_prefix(const std::basic_string<AtomT> & str, size_t & length)
+    {
+        return longest_prefix(str.begin(), str.end(), length);
+    }
+
+    value_type * longest_prefix(const std::basic_string<AtomT> & str)
+    {
+        size_t length = 0;
+        return longest_prefix(str.begin(), str.end(), length);
+    }
+
+private:
+    /* The node, which subtree holds the keys starting with the prefix,
+     * depth is the length of the key above it */
+    template <typename KeyIterator>
+    NodeT * prefix_node(KeyIterator it, KeyIterator end, size_t & depth)
+    {
+        if (m_root == nullptr) { return nullptr; }
+
+        NodeT * n = root();
+        NodeT * result = nullptr;
+        depth = 0;
+
+        general_search(root(), it, end,
+            [&result] (NodeT * x) { result = x; },
+            [] (NodeT * , KeyIterator) { },
+            [&result] (NodeT * x, key_iterator ) { result = x; },
+            [] (NodeT * , key_iterator , KeyIterator) { },
+            [&n, &depth] (NodeItr x, KeyIterator) {
+                depth += n->kend() - n->kbegin();
+                n = NodeT::value(x);
+            }
+        );
+
+        return result;
+    }
+
+public:
+    /**
+     * @brief The k (key, value) pairs with the greatest values among the keys starting with the prefix
+     *
+     * Only for scored_trie_map, where every node keeps the greatest value
+     * below it. The subtree or the value with the greatest score is taken
+     * from a heap, so that only the nodes on the paths to the results and
+     * their children are visited, however many keys start with the prefix.
+     * The pairs come from the greatest value, equal values in no particular order.
+     */
+    template <typename KeyIterator>
+    std::vector< std::pair<std::basic_string<AtomT>, value_type> >
+        top_k(KeyIterator it, KeyIterator end, size_t k)
+    {
+        static_assert(std::is_same<SummaryT, detail::MaxSummary<value_type> >::value,
+            "trie::top_k() needs a scored_trie_map");
+
+        typedef std::pair<std::basic_string<AtomT>, value_type> ResultT;
+
+        /* A node reached, parent is its index in items */
+        struct Item
+        {
+            NodeT * node;
+            size_t parent;
+        };
+
+        struct Entry
+        {
+            value_type score;
+            size_t item;
+            bool value; /* The value of the node, not its subtree */
+        };
+
+        const size_t CNone = (size_t) -1;
+        const std::basic_string<AtomT> prefix(it, end);
+        std::vector<ResultT> result;
+
+        if (m_root == nullptr or k == 0) { return result; }
+
+        size_t depth = 0;
+        NodeT * top = prefix_node(prefix.begin(), prefix.end(), depth);
+
+        if (top == nullptr) { return result; }
+
+        /* Values go before subtrees of the same score */
+        auto less = [] (const Entry & a, const Entry & b) {
+            return a.score < b.score or (!(b.score < a.score) and !a.value and b.value); };
+
+        std::vector<Item> items(1, Item { top, CNone });
+        std::vector<Entry> heap(1, Entry { top->summary().best, 0, false });
+        std::vector<NodeT *> chain;
+
+        result.reserve(std::min(k, msize));
+
+        while (!heap.empty() and result.size() < k)
+        {
+            std::pop_heap(heap.begin(), heap.end(), less);
+            Entry e = heap.back();
+            heap.pop_back();
+
+            NodeT * x = items[e.item].node;
+
+            if (e.value)
+            {
+                chain.clear();
+                for (size_t i = e.item; i != CNone; i = items[i].parent) { chain.push_back(items[i].node); }
+
+                std::basic_string<AtomT> key(prefix, 0, depth);
+                for (size_t i = chain.size(); i-- > 0; ) { key.append(chain[i]->kbegin(), chain[i]->kend()); }
+
+                result.emplace_back(std::move(key), x->get_value());
+                continue;
+            }
+
+            if (x->has_value())
+            {
+                heap.push_back(Entry { x->get_value(), e.item, true });
+                std::push_heap(heap.begin(), heap.end(), less);
+            }
+
+            for (auto c = x->begin(); c != x->end(); ++c)
+            {
+                NodeT * child = NodeT::value(c);
+                if (child == nullptr) { continue; }
+
+                items.push_back(Item { child, e.item });
+                heap.push_back(Entry { child->summary().best, items.size() - 1, false });
+                std::push_heap(heap.begin(), heap.end(), less);
+            }
+        }
+
+        return result;
+    }
+
+    std::vector< std::pair<std::basic_string<AtomT>, value_type> >
+        top_k(const std::basic_string<AtomT> & prefix, size_t k)
+    {
+        return top_k(prefix.begin(), prefix.end(), k);
+    }
+
+    /**
+     * @brief The number of keys starting with the prefix
+     *
+     * Only for counted_trie_map, where every node keeps the number of keys
+     * below it, so that it takes a single lookup.
+     */
+    template <typename KeyIterator>
+    size_t count_prefix(KeyIterator it, KeyIterator end)
+    {
+        static_assert(std::is_same<SummaryT, detail::CountSummary>::value,
+            "trie::count_prefix() needs a counted_trie_map");
+
+        size_t depth = 0;
+        NodeT * n = prefix_node(it, end, depth);
+        return n == nullptr ? 0 : n->summary().count;
+    }
+
+    size_t count_prefix(const std::basic_string<AtomT> & prefix)
+    {
+        return count_prefix(prefix.begin(), prefix.end());
+    }
+
+    /**
+     * @brief The number of keys less than the given one, which need not be stored
+     *
+     * Only for counted_trie_map. On the way down the counts of the children
+     * before the one taken are summed, so it takes a lookup and a scan of
+     * the child tables on the path.
+     */
+    template <typename KeyIterator>
+    size_t rank(KeyIterator it, KeyIterator end)
+    {
+        static_assert(std::is_same<SummaryT, detail::CountSummary>::value,
+            "trie::rank() needs a counted_trie_map");
+
+        if (m_root == nullptr) { return 0; }
+
+        NodeT * n = root();
+        size_t result = 0;
+
+        /* The key of x and the subtrees of its children before last are less */
+        auto less = [&result] (NodeT * x, NodeItr last)
+        {
+            if (x->has_value()) { ++result; }
+
+            for (NodeItr c = x->begin(); c != last; ++c) {
+                if (NodeT::value(c) != nullptr) { result += NodeT::value(c)->summary().count; }
+            }
+        };
+
+        general_search(root(), it, end,
+            [] (NodeT * ) { },
+            [&less] (NodeT * x, KeyIterator kit) { less(x, x->find_after(*kit)); },
+            [] (NodeT * , key_iterator ) { },
+            [&result] (NodeT * x, key_iterator eit, KeyIterator kit) {
+                if (detail::atom_less(*eit, *kit)) { result += x->summary().count; }
+            },
+            [&less, &n] (NodeItr x, KeyIterator) {
+                less(n, x);
+                n = NodeT::value(x);
+            }
+        );
+
+        return result;
+    }
+
+    size_t rank(const std::basic_string<AtomT> & key)
+    {
+        return rank(key.begin(), key.end());
+    }
+
+    /**
+     * @brief The iterator to the key of the given rank, the i-th one in order
+     *
+     * Only for counted_trie_map. The child, which subtree holds the i-th key,
+     * is found by the counts of the children on every level. The iterator
+     * goes on over the rest of the trie. Throws std::out_of_range if i is
+     * not less than size().
+     */
+    iterator select(size_t i)
+    {
+        static_assert(std::is_same<SummaryT, detail::CountSummary>::value,
+            "trie::select() needs a counted_trie_map");
+
+        if (i >= msize) { throw std::out_of_range("trie::select: no key of that rank"); }
+
+        CursorT cursor(root());
+        NodeT * n = root();
+
+        while (true)
+        {
+            if (n->has_value())
+            {
+                if (i == 0) { return iterator(cursor); }
+                --i;
+            }
+
+            for (NodeItr c = n->begin(); c != n->end(); ++c)
+            {
+                NodeT * x = NodeT::value(c);
+                if (x == nullptr) { continue; }
+
+                if (i < x->summary().count)
+                {
+                    cursor.push(c);
+                    n = x;
+                    break;
+                }
+
+                i -= x->summary().count;
+            }
+        }
+    }
+
+    /** @brief A key chosen uniformly at random with the generator, end() if empty */
+    template <typename RandomGenerator>
+    iterator sample(RandomGenerator & g)
+    {
+        if (msize == 0) { return end(); }
+        return select(std::uniform_int_distribution<size_t>(0, msize - 1)(g));
+    }
+
+private:
+    /* The number of lookups get_many() and contains_many() interleave */
+    enum : size_t { CLookupBatch = 16 };
+
+    /**
+     * Looks up the keys of the range in groups, advancing all lookups
+     * of a group in turns. Each turn a lookup either prefetches the
+     * label and the child table slot of its node, or consumes them
+     * and prefetches the next node, so the misses of the group overlap.
+     * Calls found() with the node holding the value, or nullptr,
+     * for every key in order.
+     */
+    template <typename KeyRangeIterator, typename Callback>
+    void search_many(KeyRangeIterator first, KeyRangeIterator last, Callback found)
+    {
+        typedef decltype(std::begin(*first)) KeyIterator;
+
+        struct Lookup
+        {
+            NodeT * n;
+            key_iterator k;
+            KeyIterator it;
+            KeyIterator end;
+            size_t left; /* Atoms from it to end, counting them is linear */
+            bool ready;
+        };
+
+        Lookup group[CLookupBatch];
+        NodeT * result[CLookupBatch];
+
+        while (first != last)
+        {
+            size_t size = 0;
+            size_t active = 0;
+
+            for (; first != last and size < CLookupBatch; ++first, ++size)
+            {
+                Lookup & x = group[size];
+
+                x.it = std::begin(*first);
+                x.end = std::end(*first);
+                x.left = std::distance(x.it, x.end);
+                x.n = m_root;
+                x.ready = false;
+                result[size] = nullptr;
+
+                if (m_root != nullptr)
+                {
+                    x.k = m_root->kbegin();
+                    ++active;
+                }
+            }
+
+            while (active > 0)
+            {
+                for (size_t i = 0; i < size; ++i)
+                {
+                    Lookup & x = group[i];
+
+                    if (x.n == nullptr) { continue; }
+
+                    key_iterator kend = x.n->kend();
+
+                    if (!x.ready)
+                    {
+                        /* The atom to look the child up by, if the key reaches past the label */
+                        size_t rest = kend - x.k;
+
+                        /* The label of the root may be empty */
+                        if (x.k != kend) { detail::prefetch(std::addressof(*x.k)); }
+
+                        if (x.left > rest) {
+                            x.n->prefetch(*std::next(x.it, rest));
+                        }
+
+                        x.ready = true;
+                        continue;
+                    }
+
+                    key_iterator from = x.k;
+                    detail::skip_common(x.k, kend, x.it, x.end);
+                    x.left -= x.k - from;
+
+                    NodeT * next = nullptr;
+
+                    if (x.it == x.end)
+                    {
+                        if (x.k == kend and x.n->has_value()) { result[i] = x.n; }
+                    }
+                    else if (x.k == kend)
+                    {
+                        NodeItr edge = x.n->find(*x.it);
+
+                        if (edge != x.n->nf())
+                        {
+                            next = NodeT::value(edge);
+                            detail::prefetch(next);
+                            x.k = next->kbegin() + 1;
+                            ++x.it; /* Already found the first character */
+                            --x.left;
+                        }
+                    }
+
+                    x.n = next;
+                    x.ready = false;
+
+                    if (next == nullptr) { --active; }
+                }
+            }
+
+            for (size_t i = 0; i < size; ++i) { found(result[i]); }
+        }
+    }
+
+public:
+    /**
+     * @brief Looks up a batch of keys at once
+     *
+     * Writes a pointer to the value, or nullptr, for every key of the
+     * forward range [first, last) to out. Faster than separate get()
+     * calls on tries much larger than the cache, as the memory accesses
+     * of up to CLookupBatch lookups are overlapped.
+     */
+    template <typename KeyRangeIterator, typename OutputIterator>
+    OutputIterator get_many(KeyRangeIterator first, KeyRangeIterator last, OutputIterator out)
+    {
+        search_many(first, last, [&out] (NodeT * n) {
+            *out = n == nullptr ? nullptr : std::addressof(n->get_value());
+            ++out;
+        });
+
+        return out;
+    }
+
+    /** @brief Writes whether the trie contains the key, for every key of [first, last) */
+    template <typename KeyRangeIterator, typename OutputIterator>
+    OutputIterator contains_many(KeyRangeIterator first, KeyRangeIterator last, OutputIterator out)
+    {
+        search_many(first, last, [&out] (NodeT * n) {
+            *out = n != nullptr;
+            ++out;
+        });
+
+        return out;
+    }
+
+    /**
+     * @brief Writes the immutable image of the trie, which frozen_trie can open
+     *
+     * The image is position independent and is meant to be mapped
+     * into memory as is, so the value type has to be trivially copyable.
+     * Throws std::runtime_error if the stream fails.
+     */
+    void write_image(std::ostream & stream) const
+    {
+        static_assert(std::is_trivially_copyable<value_type>::value,
+            "trie::write_image: the value type must be trivially copyable");
+
+        typedef detail::ImageNode ImageNode;
+
+        struct Item
+        {
+            const NodeT * node;
+            uint32_t parent;
+            uint32_t slot;
+        };
+
+        std::vector<ImageNode> nodes;
+        std::vector<uint32_t> children;
+        std::vector<AtomT> atoms;
+        std::vector<AtomT> keys;
+        std::vector<value_type> values;
+
+        if (nedges >= detail::CImageNone) {
+            throw std::length_error("trie::write_image: too many nodes");
+        }
+
+        nodes.reserve(nedges);
+        std::vector<Item> stack;
+
+        if (m_root != nullptr) {
+            stack.push_back(Item { m_root, detail::CImageNone, 0 });
+        }
+
+        /* Depth-first, children in order, as clone_from() does */
+        while (!stack.empty())
+        {
+            Item x = stack.back();
+            stack.pop_back();
+
+            uint32_t index = nodes.size();
+            ImageNode n;
+
+            n.key_offset  = keys.size();
+            n.key_len     = x.node->kend() - x.node->kbegin();
+            n.parent      = x.parent;
+            n.child_begin = children.size();
+            n.child_count = x.node->child_count();
+            n.subtree_end = index + 1;
+            n.value_index = x.node->has_value() ? (uint32_t) values.size() : (uint32_t) detail::CImageNone;
+
+            keys.insert(keys.end(), x.node->kbegin(), x.node->kend());
+            if (x.node->has_value()) { values.push_back(x.node->get_value()); }
+
+            if (x.parent != detail::CImageNone)
+            {
+                children[x.slot] = index;
+                atoms[x.slot] = *(x.node->kbegin());
+            }
+
+            children.resize(n.child_begin + n.child_count);
+            atoms.resize(n.child_begin + n.child_count);
+
+            size_t mark = stack.size();
+            uint32_t slot = n.child_begin;
+
+            for (auto it = x.node->begin(); it != x.node->end(); ++it) {
+                stack.push_back(Item { NodeT::value(it), index, slot++ });
+            }
+
+            std::reverse(stack.begin() + mark, stack.end());
+            nodes.push_back(n);
+        }
+
+        /* Descendants follow their ancestors */
+        for (size_t i = nodes.size(); i-- > 1; )
+        {
+            ImageNode & parent = nodes[nodes[i].parent];
+            parent.subtree_end = std::max(parent.subtree_end, nodes[i].subtree_end);
+        }
+
+        detail::ImageHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, detail::CImageMagic, sizeof(header.magic));
+
+        header.version     = detail::CImageVersion;
+        header.endian      = detail::CImageEndian;
+        header.atom_size   = sizeof(AtomT);
+        header.value_size  = sizeof(value_type);
+        header.node_count  = nodes.size();
+        header.child_count = children.size();
+        header.atom_count  = keys.size();
+        header.value_count = values.size();
+
+        header.nodes_offset    = detail::image_align(sizeof(header));
+        header.children_offset = detail::image_align(header.nodes_offset + nodes.size() * sizeof(ImageNode));
+        header.atoms_offset    = detail::image_align(header.children_offset + children.size() * sizeof(uint32_t));
+        header.keys_offset     = detail::image_align(header.atoms_offset + atoms.size() * sizeof(AtomT));
+        header.values_offset   = detail::image_align(header.keys_offset + keys.size() * sizeof(AtomT));
+        header.total_size      = detail::image_align(header.values_offset + values.size() * sizeof(value_type));
+
+        uint64_t written = 0;
+
+        auto write = [&stream, &written] (uint64_t offset, const void * data, size_t n)
+        {
+            static const char zeros[detail::CImageAlign] = { 0 };
+
+            stream.write(zeros, offset - written);
+            stream.write(static_cast<const char *>(data), n);
+            written = offset + n;
+        };
+
+        write(0, &header, sizeof(header));
+        write(header.nodes_offset, nodes.data(), nodes.size() * sizeof(ImageNode));
+        write(header.children_offset, children.data(), children.size() * sizeof(uint32_t));
+        write(header.atoms_offset, atoms.data(), atoms.size() * sizeof(AtomT));
+        write(header.keys_offset, keys.data(), keys.size() * sizeof(AtomT));
+        write(header.values_offset, values.data(), values.size() * sizeof(value_type));
+        write(header.total_size, nullptr, 0);
+
+        if (!stream) { throw std::runtime_error("trie::write_image: write failed"); }
+    }
+
+    void write_image(const std::string & path) const
+    {
+        std::ofstream stream(path.c_str(), std::ios::binary | std::ios::trunc);
+
+        if (!stream) { throw std::runtime_error("trie::write_image: cannot open " + path); }
+
+        write_image(stream);
+        stream.close();
+
+        if (!stream) { throw std::runtime_error("trie::write_image: write failed"); }
+    }
+
+    size_t _edges()  { return nedges; }
+    size_t _memory() { return arena.allocated(); }
+
+    struct _debug_print
+    {
+        const trie_map & map;
+
+        _debug_print(const trie_map & amap) : map(amap) {};
+
+        std::ostream & operator ()(std::ostream & stream) const
+        {
+            if (map.m_root == nullptr)
+            {
+                return stream << "[ empty ]";
+            }
+
+            trie_map::CursorT it(map.m_root);
+
+            while (it.m_root != nullptr) 
+            {
+                const trie_map::NodeT * n = it.get(0);
+
+                std::copy(n->kbegin(), n->kend(), 
+                    std::ostream_iterator<char, char>(stream));
+
+                if (n->has_value())
+                {
+                    stream << "(=" << n->get_value() << ")";
+                }
+
+                if (it.step_down()) { stream << "{"; continue; }
+                if (it.step_fore()) { stream << "}{"; continue; }
+
+                while (!it.m_ptrs.empty()) 
+                {
+                    stream << "}";
+                    if (it.step_up()) { break; }
+                }
+
+                if (it.m_ptrs.empty()) { it.m_root = nullptr; }
+            }
+
+            return stream;
+        }
+
+        friend std::ostream & operator << (std::ostream & stream,
+            const _debug_print & x)
+        {
+            return x(stream);
+        }
+    };
+};
+
+/**
+ * @brief trie_map, which keeps the greatest value of every subtree for top_k()
+ *
+ * insert(), add(), erase() and the builders keep the scores up to date,
+ * values must not be changed in place through iterators or references.
+ */
+template <typename AtomT, typename ValueT, size_t CMinChunkSize = 0,
+    typename Allocator = std::allocator<char> >
+using scored_trie_map = trie_map<AtomT, ValueT, CMinChunkSize,
+    typename detail::TrieNodeSelector<AtomT, ValueT, CMinChunkSize,
+        detail::MaxSummary<typename detail::ValueHolder<ValueT>::value_type> >::type, Allocator>;
+
+/**
+ * @brief trie_map, which keeps the number of keys of every subtree
+ *
+ * count_prefix(), rank(), select() and sample() take time proportional
+ * to the key length instead of the number of keys. It holds less than
+ * 2^32 keys, insertions throw std::length_error above that.
+ */
+template <typename AtomT, typename ValueT, size_t CMinChunkSize = 0,
+    typename Allocator = std::allocator<char> >
+using counted_trie_map = trie_map<AtomT, ValueT, CMinChunkSize,
+    typename detail::TrieNodeSelector<AtomT, ValueT, CMinChunkSize,
+        detail::CountSummary>::type, Allocator>;
+
+/**
+ * @brief Read-only trie over an image written by trie_map::write_image()
+ *
+ * The image is used in place: opening a file maps it into memory and
+ * only validates the header, so that huge dictionaries open instantly,
+ * are paged in lazily and are shared between processes.
+ * Node contents are trusted, only images written by write_image()
+ * for the same AtomT and ValueT should be opened.
+ */
+template <typename AtomT, typename ValueT>
+struct frozen_trie
+{
+public:
+    typedef typename detail::ValueHolder<ValueT>::value_type value_type;
+    typedef std::basic_string<AtomT>                          key_type;
+    typedef value_type mapped_type;
+
+private:
+    typedef detail::ImageNode ImageNode;
+
+    /* Small child lists are scanned, larger ones are searched */
+    static const uint32_t CLinearChildren = 8;
+
+    detail::MappedFile file;
+
+    const ImageNode * nodes    = nullptr;
+    const uint32_t    * children = nullptr;
+    const AtomT       * atoms    = nullptr;
+    const AtomT       * keys     = nullptr;
+    const value_type  * values   = nullptr;
+
+    uint32_t node_count = 0;
+    size_t   msize = 0;
+
+    void attach(const void * data, size_t size)
+    {
+        const char * base = static_cast<const char *>(data);
+        const detail::ImageHeader * header =
+            static_cast<const detail::ImageHeader *>(data);
+
+        if (size < sizeof(detail::ImageHeader)
+                or (reinterpret_cast<uintptr_t>(data) % detail::CImageAlign) != 0
+                or std::memcmp(header->magic, detail::CImageMagic, sizeof(header->magic)) != 0) {
+            throw std::runtime_error("trie::frozen_trie: not a trie image");
+        }
+
+        if (header->version != detail::CImageVersion
+                or header->endian != detail::CImageEndian
+                or header->atom_size != sizeof(AtomT)
+                or header->value_size != sizeof(value_type)) {
+            throw std::runtime_error("trie::frozen_trie: incompatible trie image");
+        }
+
+        if (header->total_size > size
+                or header->node_count >= detail::CImageNone
+                or header->nodes_offset + header->node_count * sizeof(ImageNode) > header->children_offset
+                or header->children_offset + header->child_count * sizeof(uint32_t) > header->atoms_offset
+                or header->atoms_offset + header->child_count * sizeof(AtomT) > header->keys_offset
+                or header->keys_offset + header->atom_count * sizeof(AtomT) > header->values_offset
+                or header->values_offset + header->value_count * sizeof(value_type) > header->total_size) {
+            throw std::runtime_error("trie::frozen_trie: truncated trie image");
+        }
+
+        nodes    = reinterpret_cast<const ImageNode *>(base + header->nodes_offset);
+        children = reinterpret_cast<const uint32_t *>(base + header->children_offset);
+        atoms    = reinterpret_cast<const AtomT *>(base + header->atoms_offset);
+        keys     = reinterpret_cast<const AtomT *>(base + header->keys_offset);
+        values   = reinterpret_cast<const value_type *>(base + header->values_offset);
+
+        node_count = header->node_count;
+        msize = header->value_count;
+    }
+
+    uint32_t child(const ImageNode & n, AtomT x) const
+    {
+        const AtomT * begin = atoms + n.child_begin;
+        const AtomT * end   = begin + n.child_count;
+
+        if (n.child_count <= CLinearChildren)
+        {
+            for (const AtomT * a = begin; a != end; ++a) {
+                if (*a == x) { return children[a - atoms]; }
+            }
+
+            return detail::CImageNone;
+        }
+
+        const AtomT * a = std::lower_bound(begin, end, x, detail::atom_less<AtomT>);
+        return (a != end and *a == x) ? children[a - atoms] : detail::CImageNone;
+    }
+
+    /**
+     * Walks down along the key. Returns the node the key ends in
+     * (setting exact if it ends exactly at the end of the node label)
+     * or CImageNone if there is no such key.
+     */
+    template <typename KeyIterator>
+    uint32_t search(KeyIterator it, KeyIterator end, bool & exact) const
+    {
+        if (node_count == 0) { return detail::CImageNone; }
+
+        uint32_t x = 0;
+        const AtomT * k = keys + nodes[0].key_offset;
+
+        while (true)
+        {
+            const AtomT * kend = keys + nodes[x].key_offset + nodes[x].key_len;
+
+            detail::skip_common(k, kend, it, end);
+
+            if (it == end)
+            {
+                exact = (k == kend);
+                return x;
+            }
+            else if (k != kend)
+            {
+                return detail::CImageNone;
+            }
+
+            x = child(nodes[x], *it);
+
+            if (x == detail::CImageNone) { return x; }
+
+            k = keys + nodes[x].key_offset + 1;
+            ++it; /* Already found the first character */
+        }
+    }
+
+    /* The node holding the value of the key or CImageNone */
+    template <typename KeyIterator>
+    uint32_t search_value(KeyIterator it, KeyIterator end) const
+    {
+        bool exact = false;
+        uint32_t x = search(it, end, exact);
+
+        if (x == detail::CImageNone or not exact
+                or nodes[x].value_index == detail::CImageNone) {
+            return detail::CImageNone;
+        }
+
+        return x;
+    }
+
+public:
+    /**
+     * Iterates over the keys in lexicographic order, which is the order
+     * of the nodes in the image, so the iterator is just a node range.
+     */
+    struct iterator : public std::forward_iterator_tag
+    {
+        friend struct frozen_trie;
+
+    private:
+        const frozen_trie * trie = nullptr;
+        uint32_t pos  = 0;
+        uint32_t last = 0;
+
+        void normalize()
+        {
+            while (pos < last and trie->nodes[pos].value_index == detail::CImageNone) { ++pos; }
+            if (pos >= last) { trie = nullptr; }
+        }
+
+        iterator(const frozen_trie * a_trie, uint32_t a_pos, uint32_t a_last)
+            : trie(a_trie), pos(a_pos), last(a_last) { normalize(); }
+
+    public:
+        iterator() { };
+
+        const value_type & value() const {
+            return trie->values[trie->nodes[pos].value_index];
+        }
+
+        /* Reconstructs the key following the parent links */
+        key_type key() const
+        {
+            std::vector<uint32_t> path;
+
+            for (uint32_t x = pos; x != detail::CImageNone; x = trie->nodes[x].parent) {
+                path.push_back(x);
+            }
+
+            key_type result;
+
+            for (auto x = path.rbegin(); x != path.rend(); ++x)
+            {
+                const ImageNode & n = trie->nodes[*x];
+                result.append(trie->keys + n.key_offset, n.key_len);
+            }
+
+            return result;
+        }
+
+        const value_type & operator *() const { return value(); }
+
+        iterator & operator ++()
+        {
+            if (trie != nullptr)
+            {
+                ++pos;
+                normalize();
+            }
+
+            return *this;
+        }
+
+        bool operator == (const iterator & other) const
+        {
+            return trie == other.trie and (trie == nullptr or pos == other.pos);
+        }
+
+        bool operator != (const iterator & other) const
+        {
+            return not (*this == other);
+        }
+    };
+
+    frozen_trie() { }
+
+    /** @brief Views the image in the given memory, which must outlive the trie */
+    frozen_trie(const void * data, size_t size) { attach(data, size); }
+
+    /** @brief Maps the image file into memory */
+    static frozen_trie open(const std::string & path)
+    {
+        frozen_trie result;
+        result.file = detail::MappedFile(path);
+        result.attach(result.file.data, result.file.size);
+        return result;
+    }
+
+    frozen_trie(frozen_trie && other) = default;
+    frozen_trie & operator = (frozen_trie && other) = default;
+
+    size_t size() const noexcept { return msize; }
+    bool empty() const noexcept { return msize == 0; }
+
+    template <typename KeyIterator>
+    const value_type * get(KeyIterator it, KeyIterator end) const
+    {
+        uint32_t x = search_value(it, end);
+        return x == detail::CImageNone ? nullptr : values + nodes[x].value_index;
+    }
+
+    const value_type * get(const key_type & str) const
+    {
+        return get(str.begin(), str.end());
+    }
+
+    template <typename KeyIterator>
+    bool contains(KeyIterator it, KeyIterator end) const
+    {
+        return get(it, end) != nullptr;
+    }
+
+    bool contains(const key_type & str) const
+    {
+        return contains(str.begin(), str.end());
+    }
+
+    template <typename KeyIterator>
+    const value_type & at(KeyIterator it, KeyIterator end) const
+    {
+        const value_type * result = get(it, end);
+
+        if (result == nullptr) {
+            throw std::out_of_range("trie::frozen_trie::at");
+        }
+
+        return *result;
+    }
+
+    const value_type & at(const key_type & str) const
+    {
+        return at(str.begin(), str.end());
+    }
+
+    template <typename KeyIterator>
+    iterator find(KeyIterator it, KeyIterator kend) const
+    {
+        uint32_t x = search_value(it, kend);
+        return x == detail::CImageNone ? end() : iterator(this, x, node_count);
+    }
+
+    iterator find(const key_type & str) const
+    {
+        return find(str.begin(), str.end());
+    }
+
+    /** @brief Returns the iterator over the keys starting with the given prefix */
+    template <typename KeyIterator>
+    iterator find_prefix(KeyIterator it, KeyIterator kend, bool & exactMatch) const
+    {
+        bool exact = false;
+        uint32_t x = search(it, kend, exact);
+
+        exactMatch = (x != detail::CImageNone and exact
+            and nodes[x].value_index != detail::CImageNone);
+
+        if (x == detail::CImageNone) { return end(); }
+
+        return iterator(this, x, nodes[x].subtree_end);
+    }
+
+    iterator find_prefix(const key_type & str, bool & exactMatch) const
+    {
+        return find_prefix(str.begin(), str.end(), exactMatch);
+    }
+
+    iterator find_prefix(const key_type & str) const
+    {
+        bool exact;
+        return find_prefix(str.begin(), str.end(), exact);
+    }
+
+    iterator begin() const { return iterator(this, 0, node_count); }
+    iterator end()   const { return iterator(); }
+
+    size_t _edges() const { return node_count; }
+};
+
+/**
+ * @brief Aho-Corasick automaton over the keys of a trie_map
+ *
+ * Finds every occurrence of every key of the dictionary in a text in a
+ * single pass. The automaton is a copy of the trie, which keeps its
+ * compressed labels: each atom of a label is a state, moving along the
+ * label is a comparison with the next atom, only the ends of the labels
+ * have child lists. Each state has a failure link to the state of its
+ * longest proper suffix, which is a prefix of some key, and an output
+ * link to the nearest state on the failure chain, which ends a key.
+ *
+ * The automaton does not refer to the trie, changes of the trie after
+ * the automaton is built are not seen. The empty key never matches.
+ */
+template <typename AtomT, typename ValueT>
+struct aho_corasick
+{
+public:
+    typedef typename detail::ValueHolder<ValueT>::value_type value_type;
+
+private:
+    /* An enum, not to need a definition when bound to a reference */
+    enum : uint32_t { CNone = 0xffffffff };
+
+    /* Small child lists are scanned, larger ones are searched */
+    static const uint32_t CLinearChildren = 8;
+
+    /* Nodes with more children get bitmaps for byte atoms */
+    static const uint32_t CMaskChildren = 4;
+
+    struct Node
+    {
+        uint32_t label;       /* The state of the first atom of the label */
+        uint32_t length;
+        uint32_t depth;       /* The length of the key at the end of the label */
+        uint32_t child_begin;
+        uint32_t child_count;
+        uint32_t value;
+        uint32_t mask;        /* The bitmap of the child atoms, CNone if none */
+    };
+
+    struct Edge
+    {
+        AtomT atom;
+        uint32_t state; /* The first atom of the child */
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Edge> edges;
+    std::vector<value_type> values;
+
+    /* What a scan needs of a state in one place */
+    struct State
+    {
+        uint32_t node;
+        uint32_t fail;
+        uint32_t output;
+        AtomT atom;
+        bool end;        /* The last atom of the label */
+    };
+
+    /* State 0 is the root, which matches nothing */
+    std::vector<State> table;
+
+    /* The goto function of the root for byte atoms, which never fails */
+    std::vector<uint32_t> root_next;
+
+    /*
+     * 256 bit bitmaps of the child atoms of the nodes with many children
+     * for byte atoms, the child is found by the rank of its bit
+     */
+    std::vector<uint64_t> masks;
+
+    /* The goto function, CNone if there is no transition */
+    uint32_t step(uint32_t s, AtomT x) const
+    {
+        if (!table[s].end) {
+            return table[s + 1].atom == x ? s + 1 : CNone;
+        }
+
+        const Node & n = nodes[table[s].node];
+
+        const Edge * begin = edges.data() + n.child_begin;
+        const Edge * end = begin + n.child_count;
+
+        if (n.mask != CNone)
+        {
+            const uint64_t * mask = masks.data() + n.mask;
+            uint8_t k = (uint8_t) x;
+            uint64_t bit = uint64_t(1) << (k & 63);
+
+            if ((mask[k >> 6] & bit) == 0) { return CNone; }
+
+            unsigned rank = detail::popcount(mask[k >> 6] & (bit - 1));
+            for (unsigned i = 0; i < (unsigned) (k >> 6); ++i) { rank += detail::popcount(mask[i]); }
+
+            return begin[rank].state;
+        }
+
+        if (n.child_count <= CLinearChildren)
+        {
+            for (const Edge * e = begin; e != end; ++e) {
+                if (e->atom == x) { return e->state; }
+            }
+
+            return CNone;
+        }
+
+        const Edge * e = std::lower_bound(begin, end, x,
+            [] (const Edge & a, AtomT b) { return detail::atom_less(a.atom, b); });
+
+        return (e != end and e->atom == x) ? e->state : CNone;
+    }
+
+    uint32_t add_node(uint32_t depth, const AtomT * kbegin, const AtomT * kend, uint32_t value)
+    {
+        if (table.size() + (kend - kbegin) >= CNone) {
+            throw std::length_error("trie::aho_corasick: too many states");
+        }
+
+        uint32_t length = (uint32_t) (kend - kbegin);
+        uint32_t index = (uint32_t) nodes.size();
+
+        nodes.push_back(Node { (uint32_t) table.size(), length, depth + length, 0, 0, value, CNone });
+
+        for (const AtomT * k = kbegin; k != kend; ++k) {
+            table.push_back(State { index, 0, CNone, *k, k + 1 == kend });
+        }
+
+        return index;
+    }
+
+    /* The root state is the only atom of a node of its own */
+    void add_root()
+    {
+        const AtomT zero = AtomT();
+        add_node(0, &zero, &zero + 1, CNone);
+        nodes[0].depth = 0;
+    }
+
+    template <typename NodeT>
+    uint32_t add_value(const NodeT * n)
+    {
+        if (!n->has_value()) { return CNone; }
+
+        values.push_back(n->get_value());
+        return (uint32_t) (values.size() - 1);
+    }
+
+    /* Copies the trie breadth first, the children of a node are contiguous */
+    template <typename NodeT>
+    void copy(const NodeT * root)
+    {
+        std::vector< std::pair<const NodeT *, uint32_t> > queue;
+
+        add_root();
+
+        if (root->kbegin() == root->kend()) {
+            queue.push_back(std::make_pair(root, 0));
+        } else {
+            nodes[0].child_begin = 0;
+            nodes[0].child_count = 1;
+            add_node(0, root->kbegin(), root->kend(), add_value(root));
+            edges.push_back(Edge { *root->kbegin(), 1 });
+            queue.push_back(std::make_pair(root, 1));
+        }
+
+        for (size_t head = 0; head < queue.size(); ++head)
+        {
+            const NodeT * n = queue[head].first;
+            uint32_t index = queue[head].second;
+            size_t first = edges.size();
+
+            for (auto it = n->begin(); it != n->end(); ++it)
+            {
+                const NodeT * child = NodeT::value(it);
+                if (child == nullptr) { continue; }
+
+                uint32_t x = add_node(nodes[index].depth, child->kbegin(), child->kend(), add_value(child));
+
+                edges.push_back(Edge { *child->kbegin(), nodes[x].label });
+                queue.push_back(std::make_pair(child, x));
+            }
+
+            std::sort(edges.begin() + first, edges.end(),
+                [] (const Edge & a, const Edge & b) { return detail::atom_less(a.atom, b.atom); });
+
+            nodes[index].child_begin = (uint32_t) first;
+            nodes[index].child_count = (uint32_t) (edges.size() - first);
+
+            if (sizeof(AtomT) == 1 and nodes[index].child_count > CMaskChildren)
+            {
+                nodes[index].mask = (uint32_t) masks.size();
+                masks.resize(masks.size() + 4, 0);
+
+                for (size_t i = first; i < edges.size(); ++i)
+                {
+                    uint8_t k = (uint8_t) edges[i].atom;
+                    masks[nodes[index].mask + (k >> 6)] |= uint64_t(1) << (k & 63);
+                }
+            }
+        }
+    }
+
+    /* Failure and output links breadth first, the shorter states go first */
+    void link()
+    {
+        std::vector<uint32_t> queue(1, 0);
+
+        auto visit = [this, &queue] (uint32_t parent, AtomT x, uint32_t s)
+        {
+            if (parent != 0)
+            {
+                uint32_t f = table[parent].fail;
+                uint32_t next;
+
+                while ((next = step(f, x)) == CNone and f != 0) { f = table[f].fail; }
+
+                table[s].fail = next == CNone ? 0 : next;
+            }
+
+            const State & state = table[s];
+            table[s].output = (state.end and nodes[state.node].value != CNone) ? s : table[state.fail].output;
+
+            queue.push_back(s);
+        };
+
+        for (size_t head = 0; head < queue.size(); ++head)
+        {
+            uint32_t s = queue[head];
+
+            if (!table[s].end)
+            {
+                visit(s, table[s + 1].atom, s + 1);
+                continue;
+            }
+
+            const Node & n = nodes[table[s].node];
+
+            for (uint32_t i = n.child_begin; i < n.child_begin + n.child_count; ++i) {
+                visit(s, edges[i].atom, edges[i].state);
+            }
+        }
+
+        if (sizeof(AtomT) == 1)
+        {
+            root_next.assign(256, 0);
+
+            for (size_t i = 0; i < 256; ++i)
+            {
+                uint32_t next = step(0, (AtomT) i);
+                if (next != CNone) { root_next[i] = next; }
+            }
+        }
+    }
 
 public:
+    /** @brief The automaton, which matches nothing */
+    aho_corasick()
+    {
+        add_root();
+        link();
+    }
+
+    /** @brief Builds the automaton for the keys and the values of the trie */
+    template <size_t CMinChunkSize, typename NodeImpl, typename Allocator>
+    explicit aho_corasick(const trie_map<AtomT, ValueT, CMinChunkSize, NodeImpl, Allocator> & dict)
+    {
+        if (dict.m_root == nullptr) {
+            add_root();
+        } else {
+            copy(dict.m_root);
+        }
+
+        link();
+    }
 
-    /** @brief The iterator with very unfair behaviour
+    /**
+     * @brief Calls fn(offset, length, value) for every occurrence of every key in the text
      *
-     *  There is no const iterator counterpart, because there is no real
-     *  benefit in making this iterator const.
+     * The occurrences are reported in the order of their ends, the
+     * longer ones first for the same end. The key is the part of the
+     * text at [offset, offset + length).
+     */
+    template <typename InputIterator, typename Callback>
+    void scan(InputIterator first, InputIterator last, Callback fn) const
+    {
+        uint32_t s = 0;
+
+        for (size_t pos = 1; first != last; ++first, ++pos)
+        {
+            AtomT x = *first;
+            uint32_t next;
+
+            while (s != 0 and (next = step(s, x)) == CNone) { s = table[s].fail; }
+
+            if (s == 0) {
+                next = root_next.empty() ? step(0, x) : root_next[(uint8_t) x];
+            }
+
+            s = next == CNone ? 0 : next;
+
+            for (uint32_t t = table[s].output; t != CNone; t = table[table[t].fail].output)
+            {
+                const Node & n = nodes[table[t].node];
+                fn(pos - n.depth, (size_t) n.depth, values[n.value]);
+            }
+        }
+    }
+
+    template <typename Callback>
+    void scan(const std::basic_string<AtomT> & text, Callback fn) const
+    {
+        scan(text.begin(), text.end(), fn);
+    }
+
+    /** @brief The number of keys */
+    size_t size() const { return values.size(); }
+
+    /** @brief The number of states, which is the number of atoms in the labels plus one */
+    size_t states() const { return table.size(); }
+};
+
+/**
+ * @brief PATRICIA trie over the bits of fixed width keys
+ *
+ * Keys are unsigned integers or byte arrays, like std::array<uint8_t, 16>
+ * for IPv6 addresses, taken as strings of bits from the most significant
+ * one. Every key is stored with a length, the number of its leading bits
+ * that count, so that a map holds CIDR prefixes: (0x0a000000, 8) is
+ * 10.0.0.0/8. A key without a length is the full one.
+ *
+ * Every node has the key and the length of its prefix, and two children,
+ * which continue it with 0 and 1. A node keeps a value or has both
+ * children, so there are less than two nodes per key. Nodes live in a
+ * vector and refer to each other by index, erased ones are reused.
+ * Values must be default constructible, a node without a value keeps
+ * a default one.
+ */
+template <typename KeyT, typename ValueT>
+struct binary_trie_map
+{
+    template <typename, typename>
+    friend struct lpm_table;
+
+public:
+    typedef KeyT key_type;
+    typedef typename detail::ValueHolder<ValueT>::value_type value_type;
+
+private:
+    typedef detail::BitKey<KeyT> Bits;
+
+    /* An enum, not to need a definition when bound to a reference */
+    enum : uint32_t { CNone = 0xffffffff };
+
+    struct Node
+    {
+        KeyT key;          /* The prefix, the bits after it are cleared */
+        uint32_t child[2];
+        uint16_t length;
+        bool has_value;
+        value_type value;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint32_t root = CNone;
+    size_t msize = 0;
+
+    static void check_length(size_t length)
+    {
+        if (length > Bits::bits) {
+            throw std::invalid_argument("trie::binary_trie_map: the prefix is longer than the key");
+        }
+    }
+
+    uint32_t new_node(const KeyT & key, size_t length)
+    {
+        Node x = { key, { CNone, CNone }, (uint16_t) length, false, value_type() };
+
+        if (free_nodes.empty())
+        {
+            nodes.push_back(x);
+            return (uint32_t) nodes.size() - 1;
+        }
+
+        uint32_t n = free_nodes.back();
+        free_nodes.pop_back();
+        nodes[n] = x;
+        return n;
+    }
+
+    /* The node without a value, which has a child at most, is replaced
+     * by the child. Returns true if the slot has become empty. */
+    bool prune(uint32_t * slot)
+    {
+        Node & x = nodes[*slot];
+
+        if (x.has_value or (x.child[0] != CNone and x.child[1] != CNone)) { return false; }
+
+        uint32_t only = x.child[0] != CNone ? x.child[0] : x.child[1];
+
+        x.value = value_type();
+        free_nodes.push_back(*slot);
+        *slot = only;
+        return only == CNone;
+    }
+
+    void link(uint32_t parent, unsigned side, uint32_t n)
+    {
+        if (parent == CNone) {
+            root = n;
+        } else {
+            nodes[parent].child[side] = n;
+        }
+    }
+
+    void set(uint32_t n, const value_type & value)
+    {
+        nodes[n].has_value = true;
+        nodes[n].value = value;
+        ++msize;
+    }
+
+    /* The node of the exact prefix, CNone if there is none */
+    uint32_t search(const KeyT & key, size_t length) const
+    {
+        uint32_t n = root;
+
+        while (n != CNone)
+        {
+            const Node & x = nodes[n];
+
+            if (x.length > length or Bits::common(x.key, key, x.length) < x.length) { return CNone; }
+            if (x.length == length) { return n; }
+
+            n = x.child[Bits::bit(key, x.length)];
+        }
+
+        return CNone;
+    }
+
+public:
+    /** @brief The number of bits in a key */
+    static const size_t key_bits = Bits::bits;
+
+    size_t size() const { return msize; }
+    bool empty() const { return msize == 0; }
+
+    void reserve(size_t keys) { nodes.reserve(2 * keys); }
+
+    void clear()
+    {
+        nodes.clear();
+        free_nodes.clear();
+        root = CNone;
+        msize = 0;
+    }
+
+    /** @brief Stores the value for the first length bits of the key, replacing the one there was */
+    void insert(const KeyT & key, size_t length, const value_type & value)
+    {
+        check_length(length);
+
+        KeyT k = Bits::masked(key, length);
+        uint32_t parent = CNone;
+        unsigned side = 0;
+        uint32_t n = root;
+
+        while (n != CNone)
+        {
+            const Node & x = nodes[n];
+            size_t common = Bits::common(x.key, k, std::min<size_t>(x.length, length));
+
+            if (common == x.length and common == length)
+            {
+                if (!x.has_value) { ++msize; }
+
+                nodes[n].has_value = true;
+                nodes[n].value = value;
+                return;
+            }
+
+            if (common == x.length)
+            {
+                parent = n;
+                side = Bits::bit(k, common);
+                n = x.child[side];
+                continue;
+            }
+
+            /* The key ends or forks inside the prefix of n, which goes below */
+            unsigned below = Bits::bit(x.key, common);
+            uint32_t fork = new_node(Bits::masked(k, common), common);
+
+            nodes[fork].child[below] = n;
+            link(parent, side, fork);
+
+            if (common == length)
+            {
+                set(fork, value);
+                return;
+            }
+
+            parent = fork;
+            side = 1 - below;
+            break;
+        }
+
+        uint32_t leaf = new_node(k, length);
+        link(parent, side, leaf);
+        set(leaf, value);
+    }
+
+    void insert(const KeyT & key, const value_type & value)
+    {
+        insert(key, Bits::bits, value);
+    }
+
+    /** @brief The value of the exact prefix, nullptr if there is none */
+    value_type * get(const KeyT & key, size_t length)
+    {
+        check_length(length);
+
+        uint32_t n = search(key, length);
+        return n == CNone or !nodes[n].has_value ? nullptr : std::addressof(nodes[n].value);
+    }
+
+    const value_type * get(const KeyT & key, size_t length) const
+    {
+        return const_cast<binary_trie_map *>(this)->get(key, length);
+    }
+
+    value_type * get(const KeyT & key) { return get(key, Bits::bits); }
+    const value_type * get(const KeyT & key) const { return get(key, Bits::bits); }
+
+    bool contains(const KeyT & key, size_t length) const { return get(key, length) != nullptr; }
+    bool contains(const KeyT & key) const { return get(key) != nullptr; }
+
+    size_t erase(const KeyT & key, size_t length)
+    {
+        check_length(length);
+
+        uint32_t * slot = &root;
+        uint32_t * parent_slot = nullptr;
+
+        while (*slot != CNone)
+        {
+            Node & x = nodes[*slot];
+
+            if (x.length > length or Bits::common(x.key, key, x.length) < x.length) { return 0; }
+            if (x.length == length) { break; }
+
+            parent_slot = slot;
+            slot = &x.child[Bits::bit(key, x.length)];
+        }
+
+        if (*slot == CNone or !nodes[*slot].has_value) { return 0; }
+
+        nodes[*slot].has_value = false;
+        --msize;
+
+        /* The parent may be left with a single child */
+        if (prune(slot) and parent_slot != nullptr) { prune(parent_slot); }
+
+        return 1;
+    }
+
+    size_t erase(const KeyT & key) { return erase(key, Bits::bits); }
+
+    /**
+     * @brief The value of the longest stored prefix of the key
+     *
+     * Returns nullptr if there is none, otherwise stores the length of
+     * the prefix found to length. It is a single walk down the trie,
+     * one node per stored prefix length on the way at most.
+     */
+    const value_type * longest_prefix(const KeyT & key, size_t & length) const
+    {
+        const value_type * result = nullptr;
+
+        for (uint32_t n = root; n != CNone; )
+        {
+            const Node & x = nodes[n];
+
+            if (Bits::common(x.key, key, x.length) < x.length) { break; }
+
+            if (x.has_value)
+            {
+                result = std::addressof(x.value);
+                length = x.length;
+            }
+
+            if (x.length == Bits::bits) { break; }
+
+            n = x.child[Bits::bit(key, x.length)];
+        }
+
+        return result;
+    }
+
+    value_type * longest_prefix(const KeyT & key, size_t & length)
+    {
+        return const_cast<value_type *>(
+            static_cast<const binary_trie_map *>(this)->longest_prefix(key, length));
+    }
+
+    const value_type * longest_prefix(const KeyT & key) const
+    {
+        size_t length = 0;
+        return longest_prefix(key, length);
+    }
+
+    value_type * longest_prefix(const KeyT & key)
+    {
+        size_t length = 0;
+        return longest_prefix(key, length);
+    }
+
+    /**
+     * @brief Calls fn(key, length, value) for every stored prefix, which starts with the given one
      *
-     *  @warning: This operator is not copiable in regular sense.
-     *    In order to get a fixed copy of the iterator,
-     *    use explicit clone() method!
+     * Prefixes come in order: a prefix before the longer ones starting
+     * with it, those continuing with 0 before those continuing with 1.
+     */
+    template <typename Callback>
+    void find_prefix(const KeyT & key, size_t length, Callback fn)
+    {
+        check_length(length);
+
+        uint32_t n = root;
+
+        while (n != CNone)
+        {
+            const Node & x = nodes[n];
+            size_t limit = std::min<size_t>(x.length, length);
+
+            if (Bits::common(x.key, key, limit) < limit) { return; }
+            if (x.length >= length) { break; }
+
+            n = x.child[Bits::bit(key, x.length)];
+        }
+
+        if (n == CNone) { return; }
+
+        std::vector<uint32_t> stack(1, n);
+
+        while (!stack.empty())
+        {
+            Node & x = nodes[stack.back()];
+            stack.pop_back();
+
+            if (x.has_value) { fn(static_cast<const KeyT &>(x.key), (size_t) x.length, x.value); }
+
+            for (int i = 1; i >= 0; --i) {
+                if (x.child[i] != CNone) { stack.push_back(x.child[i]); }
+            }
+        }
+    }
+
+    /** @brief Calls fn(key, length, value) for every stored prefix in order */
+    template <typename Callback>
+    void for_each(Callback fn)
+    {
+        find_prefix(KeyT(), 0, fn);
+    }
+
+    /** @brief The number of nodes, less than twice the number of keys */
+    size_t _edges() const { return nodes.size() - free_nodes.size(); }
+};
+
+/**
+ * @brief Longest prefix match table built from a binary_trie_map
+ *
+ * A lookup in binary_trie_map visits a node per bit, which the prefix
+ * lengths on the way differ in, and every node of a large map is a cache
+ * miss. The table is a multibit trie in the way of Poptrie: the first 16
+ * bits of the key index a flat array, then every node takes the next 6
+ * bits. A node has a bitmap of the slots having child nodes and a bitmap
+ * of the slots starting runs of equal leaves, its children and leaves are
+ * consecutive, so that the entry of a slot is found by counting the bits
+ * below it. A lookup of an IPv4 address takes three memory reads at most
+ * for prefixes up to /28.
+ *
+ * The table is a copy, changes of the map after it is built are not seen.
+ */
+template <typename KeyT, typename ValueT>
+struct lpm_table
+{
+public:
+    typedef KeyT key_type;
+    typedef typename detail::ValueHolder<ValueT>::value_type value_type;
+
+private:
+    typedef detail::BitKey<KeyT> Bits;
+    typedef binary_trie_map<KeyT, ValueT> MapT;
+
+    /* Entries are leaves, which are value indexes, or nodes marked with CNodeBit */
+    enum : uint32_t
+    {
+        CNodeBit = 0x80000000u,
+        CNoValue = 0x7fffffffu,
+    };
+
+    static const size_t CStride = 6;
+    static const size_t CDirectBits = Bits::bits < 16 ? Bits::bits : 16;
+
+    struct Node
+    {
+        uint64_t children; /* The slots with child nodes */
+        uint64_t runs;     /* The leaf slots with a value other than of the leaf before */
+        uint32_t leaf_begin;
+        uint32_t child_begin;
+    };
+
+    /* A stored prefix, in the order of binary_trie_map::for_each() */
+    struct Prefix
+    {
+        KeyT key;
+        size_t length;
+        uint32_t value;
+    };
+
+    std::vector<uint32_t> direct;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> leaves;
+    std::vector<value_type> values;
+    std::vector<uint16_t> lengths;
+
+    /**
+     * The entries of the 2^width slots at the depth, from the prefixes
+     * longer than depth, which share the bits before it. Prefixes ending
+     * within the slots give the leaves, the longest one covering a slot
+     * wins, the others go to the child nodes.
      */
-    struct iterator : public std::forward_iterator_tag
+    static void split(const Prefix * first, const Prefix * last, size_t depth, size_t width,
+        uint32_t fallback, std::vector<uint32_t> & best, std::vector< std::pair<size_t, size_t> > & below)
     {
-        friend class trie_map;
-
-    private:
-        IteratorPtr _impl;
+        best.assign((size_t) 1 << width, fallback);
+        below.assign((size_t) 1 << width, std::make_pair(0, 0));
 
-        iterator() : _impl() { };
+        for (const Prefix * p = first; p != last; ++p)
+        {
+            unsigned slot = Bits::chunk(p->key, depth, width);
 
-        void normalize() {
-            if (!_impl->get()->has_value()) { ++(*this); }
+            if (p->length <= depth + width)
+            {
+                /* A prefix goes before the longer ones starting with it */
+                size_t span = (size_t) 1 << (depth + width - p->length);
+                std::fill(best.begin() + slot, best.begin() + slot + span, p->value);
+            }
+            else
+            {
+                std::pair<size_t, size_t> & x = below[slot];
+                if (x.first == x.second) { x.first = p - first; }
+                x.second = p - first + 1;
+            }
         }
+    }
 
-        explicit iterator(IteratorPtr a_impl)
-            : _impl(a_impl) { normalize(); }
+    void build(uint32_t n, const Prefix * first, const Prefix * last, size_t depth, uint32_t fallback)
+    {
+        std::vector<uint32_t> best;
+        std::vector< std::pair<size_t, size_t> > below;
 
-        explicit iterator(IteratorInternalT * a_impl)
-            : _impl(a_impl) { normalize(); }
+        split(first, last, depth, CStride, fallback, best, below);
 
-    public:
-        value_type & value() {
-            return _impl->get_value();
+        Node x = { 0, 0, (uint32_t) leaves.size(), (uint32_t) nodes.size() };
+
+        for (unsigned slot = 0; slot < (1u << CStride); ++slot)
+        {
+            if (below[slot].first != below[slot].second)
+            {
+                x.children |= uint64_t(1) << slot;
+            }
+            else if (leaves.size() == x.leaf_begin or leaves.back() != best[slot])
+            {
+                x.runs |= uint64_t(1) << slot;
+                leaves.push_back(best[slot]);
+            }
         }
 
-        std::basic_string<AtomT> key() {
-            return _impl->get_key_str();
+        nodes[n] = x;
+        nodes.resize(nodes.size() + detail::popcount(x.children));
+
+        uint32_t child = x.child_begin;
+
+        for (unsigned slot = 0; slot < (1u << CStride); ++slot)
+        {
+            if (below[slot].first != below[slot].second)
+            {
+                build(child++, first + below[slot].first, first + below[slot].second,
+                    depth + CStride, best[slot]);
+            }
         }
+    }
 
-        value_type & operator *() { return value(); }
+public:
+    explicit lpm_table(const MapT & map)
+    {
+        std::vector<Prefix> prefixes;
+        std::vector<uint32_t> stack;
 
-        /*
-         * There is only one increment operator, since the postfix one
-         * is very heavy if implemented correctly.
-         */
-        iterator & operator ++()
+        if (map.root != MapT::CNone) { stack.push_back(map.root); }
+
+        values.reserve(map.size());
+        lengths.reserve(map.size());
+
+        while (!stack.empty())
         {
-            if (_impl.get() != nullptr)  {
-                if (!_impl->next_value()) { _impl.reset(); }
+            const typename MapT::Node & x = map.nodes[stack.back()];
+            stack.pop_back();
+
+            if (x.has_value)
+            {
+                prefixes.push_back(Prefix { x.key, x.length, (uint32_t) values.size() });
+                values.push_back(x.value);
+                lengths.push_back(x.length);
             }
 
-            return *this;
+            for (int i = 1; i >= 0; --i) {
+                if (x.child[i] != MapT::CNone) { stack.push_back(x.child[i]); }
+            }
         }
 
-        /**
-         * Returns a "real" copy of the iterator, may be a heavy operation.
-         */
-        iterator clone() {
-            return (_impl.get() == nullptr) ?
-                iterator() : iterator(new IteratorInternalT(*_impl));
+        if (values.size() >= CNoValue) {
+            throw std::length_error("trie::lpm_table: too many prefixes");
         }
 
-        bool operator == (const iterator & other) const
+        std::vector< std::pair<size_t, size_t> > below;
+        split(prefixes.data(), prefixes.data() + prefixes.size(), 0, CDirectBits, CNoValue, direct, below);
+
+        for (size_t slot = 0; slot < direct.size(); ++slot)
         {
-            return _impl.get() == other._impl.get()
-                || (_impl.get() && other._impl.get()
-                        && _impl->get() == other._impl->get());
+            if (below[slot].first != below[slot].second)
+            {
+                uint32_t n = (uint32_t) nodes.size();
+                nodes.emplace_back();
+
+                build(n, prefixes.data() + below[slot].first, prefixes.data() + below[slot].second,
+                    CDirectBits, direct[slot]);
+
+                direct[slot] = n | CNodeBit;
+            }
         }
 
-        bool operator != (const iterator & other) const
+        if (nodes.size() >= CNodeBit) {
+            throw std::length_error("trie::lpm_table: too many nodes");
+        }
+    }
+
+    /**
+     * @brief The value of the longest prefix of the key in the map
+     *
+     * Returns nullptr if there is none, otherwise stores the length of
+     * the prefix found to length.
+     */
+    const value_type * longest_prefix(const KeyT & key, size_t & length) const
+    {
+        uint32_t e = direct[Bits::chunk(key, 0, CDirectBits)];
+        size_t depth = CDirectBits;
+
+        while (e & CNodeBit)
         {
-            return not (*this == other);
+            const Node & x = nodes[e & ~CNodeBit];
+            unsigned slot = Bits::chunk(key, depth, CStride);
+            uint64_t upto = ~uint64_t(0) >> (63 - slot);
+
+            if ((x.children >> slot) & 1) {
+                e = CNodeBit | (x.child_begin + detail::popcount(x.children & upto) - 1);
+            } else {
+                e = leaves[x.leaf_begin + detail::popcount(x.runs & upto) - 1];
+            }
+
+            depth += CStride;
+        }
+
+        if (e == CNoValue) { return nullptr; }
+
+        length = lengths[e];
+        return std::addressof(values[e]);
+    }
+
+    const value_type * longest_prefix(const KeyT & key) const
+    {
+        size_t length = 0;
+        return longest_prefix(key, length);
+    }
+
+    /** @brief The number of prefixes */
+    size_t size() const { return values.size(); }
+
+    /** @brief The number of bytes the table takes */
+    size_t footprint() const
+    {
+        return direct.size() * sizeof(uint32_t) + nodes.size() * sizeof(Node) +
+            leaves.size() * sizeof(uint32_t) + values.size() * (sizeof(value_type) + sizeof(uint16_t));
+    }
+};
+
+/**
+ * @brief Trie map with lock-free readers and a single writer
+ *
+ * Readers take a snapshot of the trie, a reader object, which pins the
+ * current epoch and the current root. Lookups and iteration through it do
+ * not lock and always see the trie as it was when the reader was created.
+ *
+ * Updates are serialized by a mutex and never touch nodes readers can
+ * reach: the path from the root to the updated node is copied, the copies
+ * are changed the same way trie_map changes its nodes, and the new root
+ * is published atomically. The replaced nodes, child tables and values
+ * are reused once no reader from an earlier epoch is active.
+ */
+template <typename AtomT, typename ValueT, size_t CMinChunkSize = 0,
+    typename Allocator = std::allocator<char> >
+struct concurrent_trie_map
+{
+private:
+    typedef trie_map<AtomT, ValueT, CMinChunkSize,
+        trie_node<AtomT, ValueT, CMinChunkSize>, Allocator> MapT;
+    typedef typename MapT::NodeT        NodeT;
+    typedef typename MapT::NodeItr      NodeItr;
+    typedef typename MapT::CursorT      CursorT;
+    typedef typename MapT::key_iterator key_iterator;
+    typedef typename MapT::HolderT      HolderT;
+    typedef typename MapT::iterator     MapIterator;
+
+public:
+    typedef typename MapT::value_type value_type;
+    typedef value_type mapped_type;
+
+    /** @brief Iterator of a reader, the values are shared with
+     *  the other readers, so they are read-only
+     */
+    struct const_iterator : public std::forward_iterator_tag
+    {
+        friend struct concurrent_trie_map;
+
+    private:
+        mutable MapIterator _it;
+
+        explicit const_iterator(const MapIterator & a_it) : _it(a_it) { }
+
+    public:
+        const_iterator() { }
+
+        const value_type & value() const { return _it.value(); }
+        const value_type & operator *() const { return value(); }
+
+        std::basic_string<AtomT> key() const { return _it.key(); }
+
+        const_iterator & operator ++()
+        {
+            ++_it;
+            return *this;
         }
+
+        bool operator == (const const_iterator & other) const { return _it == other._it; }
+        bool operator != (const const_iterator & other) const { return _it != other._it; }
     };
 
 private:
-    typedef typename NodeT::map_iterator NodeItr;
+    /* Unlinked memory is collected after this many nodes were retired */
+    enum : size_t { CCollectBatch = 64 };
+
+    /* A replaced node, or a holder of a replaced value or key */
+    enum RetiredKind { CNode, CValue, CKey };
+
+    struct Retired
+    {
+        NodeT * node;
+        uint64_t epoch;
+        RetiredKind kind;
+    };
+
+    /* The writer side: the arena, the counters and the published root */
+    MapT map;
+
+    std::atomic<NodeT *> m_root;
+    std::atomic<size_t> msize;
+
+    mutable detail::EpochDomain epochs;
+    std::mutex writer;
+
+    std::vector<Retired> retired;
+    std::vector<Retired> unlinked; /* By the update in progress */
+    std::vector<NodeT *> created;  /* Private nodes of the update in progress */
+    std::vector<NodeT *> path;
 
     /**
-     * Generalized lookup algorithm.
+     * Makes room for the bookkeeping of an update along the path, so that
+     * recording the nodes and publishing the update do not throw. An update
+     * retires at most the path, a merged child, a value holder and three keys.
      */
-    template<typename KeyIterator, typename A, typename B, typename C, typename D, typename E>
-    inline void general_search
-    (
-        NodeT * n,
-        KeyIterator it,
-        KeyIterator end,
-        A exactMatchAction,
-        B noNextEdgeAction,
-        C endInTheMiddleAction,
-        D splitInTheMiddleAction,
-        E edgeAction
-    )
+    void prepare()
     {
-        key_iterator kbegin = n->kbegin();
+        size_t n = path.size() + 5;
 
-        while (n != nullptr)
+        unlinked.reserve(n);
+        created.reserve(n + 2);
+        retired.reserve(retired.size() + n);
+    }
+
+    /* A private copy of a published node, sharing the key, children and value */
+    NodeT * copy(NodeT * x)
+    {
+        NodeT * n = map.arena.template create<NodeT>(*x);
+
+        try {
+            n->unshare_table(map.arena);
+        } catch (...) {
+            map.arena.destroy(n); /* The table is still the published one */
+            throw;
+        }
+
+        created.push_back(n);
+        unlinked.push_back(Retired { x, 0, CNode });
+        return n;
+    }
+
+    NodeT * track(NodeT * n)
+    {
+        created.push_back(n);
+        return n;
+    }
+
+    /**
+     * Drops an update, which has thrown. The published nodes stay as they
+     * are, the private copies are released. Their values and keys and the
+     * detached ones are still shared with the published nodes, so they are kept.
+     */
+    void abort_update(size_t edges)
+    {
+        for (NodeT * x : created)
         {
-            key_iterator kend   = n->kend();
-            key_iterator k      = kbegin;
+            x->clear(map.arena);
+            map.arena.destroy(x);
+        }
 
-            while ((it != end) and (k != kend) and (*k == *it))
-                { ++k; ++it; }
+        for (const Retired & x : unlinked) {
+            if (x.kind != CNode) { map.arena.destroy(x.node); }
+        }
 
-            if (it == end)
-            {
-                if (k == kend) {
-                    exactMatchAction(n);
-                } else {
-                    endInTheMiddleAction(n, k);
-                }
+        created.clear();
+        unlinked.clear();
+        map.nedges = edges;
+    }
 
-                return;
-            }
-            else if (k != kend)
-            {
-                splitInTheMiddleAction(n, k, it);
-                return;
-            }
+    /* Replaces the published nodes of the path with linked copies */
+    NodeT * copy_path()
+    {
+        NodeT * parent = nullptr;
 
-            NodeItr next_edge = n->find(*it);
+        for (NodeT *& x : path)
+        {
+            x = copy(x);
+            if (parent != nullptr) { parent->set_child(parent->find(*x->kbegin()), x); }
+            parent = x;
+        }
 
-            if (next_edge == n->nf())
+        return parent;
+    }
+
+    /* Moves the value out of a copy, readers of the original may still use it */
+    void detach_value(NodeT * n)
+    {
+        NodeT * holder = map.arena.template create<NodeT>();
+        n->swap_value(*holder);
+        unlinked.push_back(Retired { holder, 0, CValue });
+    }
+
+    /* Retires the key of a copy, which is about to be replaced */
+    void retire_key(NodeT * n)
+    {
+        NodeT * holder = map.arena.template create<NodeT>();
+        holder->share_key(n);
+        unlinked.push_back(Retired { holder, 0, CKey });
+    }
+
+    /* merge_edge() with a published child, nothing may throw after it
+     * in an update, as the copy of the child is released by the merge */
+    void merge_child(NodeT * n, NodeT * child)
+    {
+        NodeT * x = copy(child);
+
+        retire_key(n);
+        retire_key(x);
+        n->set_child(n->find(*x->kbegin()), x);
+
+        /* Adjacent keys are joined in place and stay in use */
+        if (!map.merge_edge(n, x, false))
+        {
+            for (int i = 0; i < 2; ++i)
             {
-                noNextEdgeAction(n, it);
-                return;
+                map.arena.destroy(unlinked.back().node);
+                unlinked.pop_back();
             }
+        }
+    }
 
-            edgeAction(next_edge, it);
+    void release(const Retired & x)
+    {
+        if (x.kind == CValue) { x.node->clr_value(map.arena); }
+        if (x.kind == CKey) { map.release_key(x.node); }
+        x.node->clear(map.arena);
+        map.arena.destroy(x.node);
+    }
 
-            n = NodeT::value(next_edge);
-            kbegin = n->kbegin() + 1;
-            ++it; /* Already found the first character */
+    void collect()
+    {
+        uint64_t oldest = epochs.oldest();
+        size_t i = 0;
+
+        for (; i < retired.size() and retired[i].epoch < oldest; ++i) {
+            release(retired[i]);
+        }
+
+        retired.erase(retired.begin(), retired.begin() + i);
+    }
+
+    /* Does not throw after prepare() */
+    void publish(NodeT * root)
+    {
+        map.m_root = root;
+        m_root.store(root);
+        msize.store(map.msize, std::memory_order_relaxed);
+
+        uint64_t epoch = epochs.advance();
+
+        for (Retired & x : unlinked)
+        {
+            x.epoch = epoch;
+            retired.push_back(x);
         }
+
+        unlinked.clear();
+        created.clear();
+
+        if (retired.size() >= CCollectBatch) { collect(); }
+    }
+
+    /* Collects the path to the key, calls found() with the end node */
+    template <typename KeyIterator, typename Callback>
+    bool search(KeyIterator it, KeyIterator end, Callback found)
+    {
+        bool exact = false;
+
+        path.assign(1, map.m_root);
+
+        MapT::general_search(map.m_root, it, end,
+            [&exact] (NodeT *) { exact = true; },
+            [&found] (NodeT *, KeyIterator kit) { found(nullptr, kit); },
+            [&found, end] (NodeT *, key_iterator eit) { found(&eit, end); },
+            [&found] (NodeT *, key_iterator eit, KeyIterator kit) { found(&eit, kit); },
+            [this] (NodeItr x, KeyIterator) { path.push_back(NodeT::value(x)); }
+        );
+
+        return exact;
     }
 
 public:
+    /**
+     * @brief Consistent snapshot of the trie for lock-free reading
+     *
+     * Values and iterators obtained from the reader stay valid while it
+     * lives. Readers are meant to be short-lived, as they delay reuse
+     * of the memory replaced by updates.
+     */
+    struct reader
+    {
+    private:
+        const concurrent_trie_map & owner;
+        size_t slot;
+        NodeT * root;
+
+    public:
+        explicit reader(const concurrent_trie_map & a_owner)
+            : owner(a_owner), slot(owner.epochs.enter()), root(owner.m_root.load()) { }
+
+        reader(const reader &) = delete;
+        reader & operator = (const reader &) = delete;
+
+        ~reader() { owner.epochs.leave(slot); }
+
+        template <typename KeyIterator>
+        const value_type * get(KeyIterator it, KeyIterator end) const
+        {
+            if (root == nullptr) { return nullptr; }
+
+            const value_type * result = nullptr;
+
+            MapT::general_search(root, it, end,
+                [&result] (NodeT * n) {
+                    if (n->has_value()) {
+                        result = std::addressof(n->get_value()); }
+                },
+
+                [] (NodeT * , KeyIterator) { },
+                [] (NodeT * , key_iterator ) { },
+                [] (NodeT * , key_iterator , KeyIterator ) { },
+                [] (NodeItr, KeyIterator) { }
+            );
+
+            return result;
+        }
+
+        const value_type * get(const std::basic_string<AtomT> & str) const
+        {
+            return get(str.begin(), str.end());
+        }
+
+        template <typename KeyIterator>
+        bool contains(KeyIterator it, KeyIterator end) const
+        {
+            return get(it, end) != nullptr;
+        }
+
+        bool contains(const std::basic_string<AtomT> & str) const
+        {
+            return contains(str.begin(), str.end());
+        }
+
+        /** @brief Iterates over the keys of the snapshot starting with the prefix */
+        const_iterator find_prefix(const std::basic_string<AtomT> & str) const
+        {
+            if (root == nullptr) { return const_iterator(); }
+            return const_iterator(MapT::find_prefix_int(CursorT(root), str.begin(), str.end(), nullptr));
+        }
+
+        const_iterator begin() const { return find_prefix(std::basic_string<AtomT>()); }
+        const_iterator end()   const { return const_iterator(); }
+    };
+
+    explicit concurrent_trie_map(const Allocator & alloc = Allocator())
+        : map(alloc), m_root(nullptr), msize(0) { }
+
+    concurrent_trie_map(const concurrent_trie_map &) = delete;
+    concurrent_trie_map & operator = (const concurrent_trie_map &) = delete;
+
+    /* There must be no readers left */
+    ~concurrent_trie_map()
+    {
+        for (const Retired & x : retired) { release(x); }
+    }
+
+    size_t size() const noexcept { return msize.load(std::memory_order_relaxed); }
+
     template<typename KeyIterator, typename ReplacePolicy>
     void insert(KeyIterator it, KeyIterator end, const value_type & value,
                     const ReplacePolicy & replace)
     {
-        if (edges.empty())
+        std::lock_guard<std::mutex> lock(writer);
+
+        /* The new value is built before any published node is retired,
+         * so that a throwing copy or replace() leaves nothing to undo */
+        HolderT fresh;
+        size_t edges = map.nedges;
+
+        if (map.m_root == nullptr)
         {
-            insert_edge(nullptr, it, end, value);
-            ++msize;
+            fresh.set_value(map.arena, value);
+            path.clear();
+
+            try {
+                prepare();
+                NodeT * n = map.insert_edge(nullptr, it, end);
+                n->swap_value(fresh);
+                ++map.msize;
+                publish(n);
+            } catch (...) {
+                fresh.clr_value(map.arena);
+                map.nedges = edges;
+                throw;
+            }
+
             return;
         }
 
-        general_search(root(), it, end,
-            [this, &value, &replace] (NodeT * n) {
-                insert_value(*n, value, replace);
-            },
+        key_iterator split = nullptr;
+        bool splits = false;
+        KeyIterator rest = end;
 
-            [this, &value, end] (NodeT * n, KeyIterator kit) {
-                insert_edge(n, kit, end, value);
-                ++msize;
-            },
+        bool exact = search(it, end, [&split, &splits, &rest] (key_iterator * eit, KeyIterator kit) {
+            if (eit != nullptr) { split = *eit; splits = true; }
+            rest = kit;
+        });
 
-            [this, &value] (NodeT * n, key_iterator eit) {
-                n->split(new_edge(1), eit - n->kbegin());
-                n->set_value(value);
-                ++msize;
-            },
+        bool added = not (exact and path.back()->has_value());
 
-            [this, &value, end] (NodeT * n, key_iterator eit, KeyIterator kit) {
-                n->split(new_edge(2), eit - n->kbegin());
-                insert_edge(n, kit, end, value);
-                ++msize;
-            },
+        if (added) {
+            fresh.set_value(map.arena, value);
+        } else {
+            value_type x(path.back()->get_value());
+            replace(x, value);
+            fresh.emplace_value(map.arena, std::move(x));
+        }
+
+        try
+        {
+            prepare();
+
+            /* The key is shared with the copy */
+            NodeT * n = copy_path();
+            NodeT * target = n;
+
+            if (!added)
+            {
+                detach_value(n);
+            }
+            else if (splits)
+            {
+                NodeT * next = track(map.new_edge(rest == end ? 1 : 2));
+                size_t idx = split - n->kbegin();
+
+                /* The parts get keys of their own, the old one is retired */
+                if (CMinChunkSize == 0) { retire_key(n); }
+                map.split_key(n, next, idx,
+                    [this, n, next, idx] () { n->split(map.arena, next, idx); }, false);
 
-            [] (NodeItr x, KeyIterator) { (void)x; }
-        );
-    }
+                if (rest != end) { target = track(map.insert_edge(n, rest, end)); }
+            }
+            else if (!exact)
+            {
+                target = track(map.insert_edge(n, rest, end));
+            }
 
-    size_t size() const noexcept { return msize; }
+            target->swap_value(fresh);
+        }
+        catch (...)
+        {
+            fresh.clr_value(map.arena);
+            abort_update(edges);
+            throw;
+        }
 
-    template<typename KeyIterator>
-    void add(KeyIterator it, KeyIterator end, const value_type & value) {
-        return insert(it, end, value,
-            [] (value_type & old, const value_type & n) { old += n; } );
+        if (added) { ++map.msize; }
+        publish(path.front());
     }
 
     template<typename KeyIterator>
@@ -639,297 +6609,374 @@ public:
             [] (value_type & old, const value_type & n) { old = n; });
     }
 
-    template<typename ReplacePolicy>
-    void insert(const std::basic_string<AtomT> & str, const value_type & value,
-                    const ReplacePolicy & replace)
-    {
-        return insert(str.begin(), str.end(), value, replace);
-    }
-
-    void add(const std::basic_string<AtomT> & str, const value_type & value) {
-        return add(str.begin(), str.end(), value);
+    template<typename KeyIterator>
+    void add(KeyIterator it, KeyIterator end, const value_type & value) {
+        return insert(it, end, value,
+            [] (value_type & old, const value_type & n) { old += n; } );
     }
 
     void insert(const std::basic_string<AtomT> & str, const value_type & value) {
         return insert(str.begin(), str.end(), value);
     }
 
-private:
-    template<typename _ValueT, 
-        typename = typename std::enable_if<std::is_same<_ValueT, SetCounter>::value>::type>
-    struct SetSpecific { };
-
-public:
-
-    template<typename KeyIterator, typename _ValueT = ValueT, typename = SetSpecific<_ValueT> >
-    void insert(KeyIterator it, KeyIterator end) {
-        return insert(it, end, 1);
-    }
-
-    template<typename KeyIterator, typename _ValueT = ValueT, typename = SetSpecific<_ValueT>  >
-    void add(KeyIterator it, KeyIterator end) {
-        return add(it, end, 1);
-    }
-
-    template<typename _ValueT = ValueT, typename = SetSpecific<_ValueT> >
-    void insert(const std::basic_string<AtomT> & str) {
-        return insert(str.begin(), str.end(), 1);
-    }
-
-    template<typename _ValueT = ValueT, typename = SetSpecific<_ValueT>  >
-    void add(const std::basic_string<AtomT> & str) {
-        return add(str.begin(), str.end(), 1);
+    void add(const std::basic_string<AtomT> & str, const value_type & value) {
+        return add(str.begin(), str.end(), value);
     }
 
     template<typename KeyIterator>
-    bool contains(KeyIterator it, KeyIterator end)
+    size_t erase(KeyIterator it, KeyIterator end)
     {
-        if (edges.empty()) { return false; }
+        std::lock_guard<std::mutex> lock(writer);
 
-        bool result = false;
+        if (map.m_root == nullptr) { return 0; }
 
-        general_search(root(), it, end,
-            [&result] (NodeT * n) {
-                if (n->has_value()) { result = true; } },
+        bool exact = search(it, end, [] (key_iterator *, KeyIterator) { });
 
-            [] (NodeT * , KeyIterator) { },
-            [] (NodeT * , key_iterator ) { },
-            [] (NodeT * , key_iterator , KeyIterator ) { },
-            [] (NodeItr, KeyIterator) { }
-        );
+        if (!exact or !path.back()->has_value()) { return 0; }
 
-        return result;
-    }
+        size_t edges = map.nedges;
+        NodeT * root = nullptr;
 
-    bool contains(const std::basic_string<AtomT> & str)
-    {
-        return contains(str.begin(), str.end());
-    }
+        try
+        {
+            prepare();
 
-private:
-    template <typename KeyIterator, typename CallbackType>
-    iterator find_prefix_int(NodeT * root_node, KeyIterator it, KeyIterator kend, CallbackType exactMatch)
-    {
-        iterator output;
-        KeyIterator inputEnd;
+            NodeT * n = copy_path();
+            NodeT * parent = path.size() > 1 ? path[path.size() - 2] : nullptr;
 
-        general_search(root_node, it, kend,
-            /* Exact Match */
-            [&exactMatch, &output] (NodeT * n)  {
-                if (n->has_value()) { exactMatch(); }
-                output._impl.reset(new IteratorInternalT(n));
-            },
+            detach_value(n);
+            root = path.front();
 
-            [] (NodeT *, KeyIterator) { },
+            /* The same as trie_map::erase() does */
+            NodeT * child = n->single_child();
 
-            [&output] (NodeT * n, key_iterator) { 
-                output._impl.reset(new IteratorInternalT(n));
-            },
+            if (child != nullptr) {
+                merge_child(n, child);
+            } else if (n->empty()) {
+                retire_key(n);
 
-            [] (NodeT *, key_iterator, KeyIterator) {  },
+                if (parent != nullptr)
+                {
+                    parent->remove(map.arena, *n->kbegin());
+                    child = parent->single_child();
 
-            [&inputEnd] (NodeItr, KeyIterator iend) {
-                inputEnd = iend; }
-        );
+                    if (child != nullptr and !parent->has_value()) {
+                        merge_child(parent, child);
+                    }
+                } else {
+                    root = nullptr;
+                }
 
-        if (output._impl.get() != nullptr)
+                /* Last, as it cannot be undone */
+                map.release_edge(n);
+            }
+        }
+        catch (...)
         {
-            output.normalize();
-            std::copy(it, inputEnd, std::back_inserter(output._impl->base_prefix));
+            abort_update(edges);
+            throw;
         }
 
-        return output;
+        --map.msize;
+        publish(root);
+        return 1;
     }
 
-    template <typename KeyIterator>
-    iterator find_prefix_int(NodeT * root_node, KeyIterator it, KeyIterator kend, bool & exactMatch)
+    size_t erase(const std::basic_string<AtomT> & str)
     {
-        exactMatch = false;
-        return find_prefix_int(root_node, it, kend, [&exactMatch] () { exactMatch = true; });
+        return erase(str.begin(), str.end());
     }
 
+    /** @brief Copies the value out, if the key is found */
     template <typename KeyIterator>
-    iterator find_prefix_int(NodeT * root_node, KeyIterator it, KeyIterator kend, std::nullptr_t)
+    bool get(KeyIterator it, KeyIterator end, value_type & out) const
     {
-        return find_prefix_int(root_node, it, kend, [] () {});
+        reader snapshot(*this);
+        const value_type * result = snapshot.get(it, end);
+
+        if (result != nullptr) { out = *result; }
+
+        return result != nullptr;
     }
 
-public:
-    template <typename KeyIterator, typename CallbackType>
-    iterator find_prefix(KeyIterator it, KeyIterator kend, CallbackType exactMatch)
+    bool get(const std::basic_string<AtomT> & str, value_type & out) const
     {
-        if (edges.empty()) { return end(); }
-        return find_prefix_int(root(), it, kend, exactMatch);
+        return get(str.begin(), str.end(), out);
     }
 
-    /* NOTE : this specialization is needed to catch bool as reference, not as value */
     template <typename KeyIterator>
-    iterator find_prefix(KeyIterator it, KeyIterator kend, bool & exactMatch)
+    bool contains(KeyIterator it, KeyIterator end) const
     {
-        if (edges.empty()) { return end(); }
-        return find_prefix_int(root(), it, kend, exactMatch);
+        return reader(*this).contains(it, end);
     }
 
-    template <typename KeyIterator, typename CallbackType>
-    iterator find_prefix(const iterator & base, KeyIterator it, KeyIterator kend, CallbackType exactMatch)
+    bool contains(const std::basic_string<AtomT> & str) const
     {
-        if (base._impl.get() == nullptr || base._impl->get() == nullptr) {
-            return end();
-        }
-
-        return find_prefix_int(base._impl->get(), it, kend, exactMatch);
-    }
-
-    template <typename CallbackType>
-    iterator find_prefix(const std::basic_string<AtomT> & str, CallbackType exactMatch) {
-        return find_prefix(str.begin(), str.end(), exactMatch);
+        return contains(str.begin(), str.end());
     }
 
-    /* NOTE : this "specialization" (overload actually) is needed to catch 
-     * bool as reference, not as value */
-    iterator find_prefix(const std::basic_string<AtomT> & str, bool & exactMatch) {
-        return find_prefix(str.begin(), str.end(), exactMatch);
-    }
+    size_t _edges()  { return map._edges(); }
+    size_t _memory() { return map._memory(); }
+};
 
-    iterator find_prefix(const std::basic_string<AtomT> & str) {
-        return find_prefix(str.begin(), str.end(), [] () {});
-    }
+/**
+ * @brief Trie map split into independently locked shards
+ *
+ * A key goes to the shard chosen by a hash of its first prefix_atoms
+ * atoms, so that writers of different keys mostly take different
+ * locks. Lookups with a prefix at least that long touch one shard,
+ * shorter prefixes and whole-trie iteration merge all the shards
+ * in key order.
+ */
+template <typename AtomT, typename ValueT, size_t CMinChunkSize = 0,
+    typename Allocator = std::allocator<char> >
+struct sharded_trie_map
+{
+public:
+    typedef trie_map<AtomT, ValueT, CMinChunkSize,
+        trie_node<AtomT, ValueT, CMinChunkSize>, Allocator> map_type;
+    typedef typename map_type::value_type value_type;
+    typedef value_type mapped_type;
 
-    template <typename KeyIterator>
-    iterator find(KeyIterator it, KeyIterator kend)
+private:
+    struct Shard
     {
-        if (edges.empty()) { return end(); }
+        std::mutex lock;
+        map_type map;
+        char padding[64]; /* Keeps the next lock off the cache line */
+    };
 
-        IteratorInternalT * root_it = new IteratorInternalT(root());
-        IteratorPtr output(root_it);
+    std::unique_ptr<Shard[]> shards;
+    size_t nshards;
+    size_t prefix_atoms;
 
-        general_search(root(), it, kend,
-            [&output] (NodeT * n) {
-                if (!n->has_value()) {
-                    output.reset(); } },
+    template <typename KeyIterator>
+    size_t shard_of(KeyIterator it, KeyIterator end) const
+    {
+        typedef typename std::make_unsigned<AtomT>::type UnsignedT;
 
-            [&output] (NodeT * n, KeyIterator  ) { output.reset(); },
-            [&output] (NodeT * n, key_iterator ) { output.reset(); },
-            [&output] (NodeT * n, key_iterator, KeyIterator ) 
-                { output.reset(); },
+        /* FNV-1a over the leading atoms */
+        uint64_t h = 14695981039346656037ull;
 
-            [&output] (NodeItr x, KeyIterator)   { output->push(x); }
-        );
+        for (size_t i = 0; i < prefix_atoms and it != end; ++i, ++it) {
+            h = (h ^ (UnsignedT) *it) * 1099511628211ull;
+        }
 
-        return (output == nullptr) ? iterator() : iterator(output);
+        return h % nshards;
     }
 
-    iterator find(const std::basic_string<AtomT> & str)
+public:
+    /**
+     * @brief Merged, ordered view of one or more shards
+     *
+     * Holds the locks of the shards it covers until destroyed, so
+     * writers to those shards wait for it. Single pass.
+     */
+    struct view
     {
-        return find(str.begin(), str.end());
-    }
+        friend struct sharded_trie_map;
 
-    iterator begin() { 
-        return edges.empty() ? end() :
-            iterator(IteratorPtr(new IteratorInternalT(root()))); }
+    private:
+        typedef typename map_type::iterator Source;
 
-    iterator end()   { return iterator(); }
+        /* The keys are compared in place, they are only built by key() */
+        struct Greater
+        {
+            bool operator ()(const Source & a, const Source & b) const {
+                return b.key_less(a);
+            }
+        };
 
-    template <typename KeyIterator>
-    value_type * get(KeyIterator it, KeyIterator end)
-    {
-        if (edges.empty()) { return nullptr; }
+        std::vector< std::unique_lock<std::mutex> > locks;
+        std::vector<Source> heap; /* Min-heap on the current key */
 
-        value_type * result = nullptr;
+        view() { }
 
-        general_search(root(), it, end,
-            [&result] (NodeT * n) {
-                if (n->has_value()) {
-                    result = std::addressof(n->get_value()); }
-            },
+        void add(map_type & map, const typename map_type::iterator & it)
+        {
+            if (it != map.end())
+            {
+                heap.push_back(it);
+                std::push_heap(heap.begin(), heap.end(), Greater());
+            }
+        }
 
-            [] (NodeT * , KeyIterator) { },
-            [] (NodeT * , key_iterator ) { },
-            [] (NodeT * , key_iterator , KeyIterator ) { },
-            [] (NodeItr, KeyIterator) { }
-        );
+        void next()
+        {
+            std::pop_heap(heap.begin(), heap.end(), Greater());
+            Source & x = heap.back();
 
-        return result;
-    }
+            ++x;
 
-    value_type * get(const std::basic_string<AtomT> & str)
+            if (x == Source()) {
+                heap.pop_back();
+            } else {
+                std::push_heap(heap.begin(), heap.end(), Greater());
+            }
+        }
+
+    public:
+        struct iterator : public std::forward_iterator_tag
+        {
+            friend struct view;
+
+        private:
+            view * owner = nullptr;
+
+            explicit iterator(view * a_owner)
+                : owner(a_owner->heap.empty() ? nullptr : a_owner) { }
+
+        public:
+            iterator() { }
+
+            std::basic_string<AtomT> key() const { return owner->heap.front().key(); }
+            value_type & value() { return owner->heap.front().value(); }
+            value_type & operator *() { return value(); }
+
+            iterator & operator ++()
+            {
+                owner->next();
+                if (owner->heap.empty()) { owner = nullptr; }
+                return *this;
+            }
+
+            bool operator == (const iterator & other) const { return owner == other.owner; }
+            bool operator != (const iterator & other) const { return owner != other.owner; }
+        };
+
+        view(view && other) = default;
+
+        iterator begin() { return iterator(this); }
+        iterator end()   { return iterator(); }
+    };
+
+    /**
+     * @param shards the number of shards, about the number of writing threads
+     * @param prefix_atoms the number of leading atoms choosing the shard,
+     *        at least 1, all the keys would go to the same shard otherwise
+     */
+    explicit sharded_trie_map(size_t a_shards = 16, size_t a_prefix_atoms = 1,
+            const Allocator & alloc = Allocator())
+        : shards(new Shard[std::max<size_t>(a_shards, 1)]),
+          nshards(std::max<size_t>(a_shards, 1)),
+          prefix_atoms(a_prefix_atoms)
     {
-        return get(str.begin(), str.end());
+        if (prefix_atoms == 0) {
+            throw std::invalid_argument("trie::sharded_trie_map: prefix_atoms must be at least 1");
+        }
+
+        for (size_t i = 0; i < nshards; ++i) { shards[i].map = map_type(alloc); }
     }
 
-    template <typename KeyIterator>
-    value_type & at(KeyIterator it, KeyIterator end)
+    size_t shard_count() const noexcept { return nshards; }
+
+    size_t size()
     {
-        value_type * result = get(it, end);
+        size_t result = 0;
 
-        if (result == nullptr) {
-            throw std::out_of_range("trie::at"); 
+        for (size_t i = 0; i < nshards; ++i)
+        {
+            std::lock_guard<std::mutex> lock(shards[i].lock);
+            result += shards[i].map.size();
         }
 
-        return *result;
+        return result;
     }
 
-    value_type & at(const std::basic_string<AtomT> & str)
+    template<typename KeyIterator>
+    void insert(KeyIterator it, KeyIterator end, const value_type & value)
     {
-        return at(str.begin(), str.end());
+        Shard & x = shards[shard_of(it, end)];
+        std::lock_guard<std::mutex> lock(x.lock);
+        x.map.insert(it, end, value);
     }
 
-    value_type & operator [](const std::basic_string<AtomT> & str)
+    template<typename KeyIterator>
+    void add(KeyIterator it, KeyIterator end, const value_type & value)
     {
-        return at(str.begin(), str.end());
+        Shard & x = shards[shard_of(it, end)];
+        std::lock_guard<std::mutex> lock(x.lock);
+        x.map.add(it, end, value);
     }
 
-    size_t _edges() { return edges.size(); }
-    size_t _keys()  { return keys.size(); }
+    void insert(const std::basic_string<AtomT> & str, const value_type & value) {
+        return insert(str.begin(), str.end(), value);
+    }
 
-    struct _debug_print
-    {
-        const trie_map & map;
+    void add(const std::basic_string<AtomT> & str, const value_type & value) {
+        return add(str.begin(), str.end(), value);
+    }
 
-        _debug_print(const trie_map & amap) : map(amap) {};
+    template<typename KeyIterator>
+    size_t erase(KeyIterator it, KeyIterator end)
+    {
+        Shard & x = shards[shard_of(it, end)];
+        std::lock_guard<std::mutex> lock(x.lock);
+        return x.map.erase(it, end);
+    }
 
-        std::ostream & operator ()(std::ostream & stream) const
-        {
-            if (map.edges.empty())
-            {
-                return stream << "[ empty ]";
-            }
+    size_t erase(const std::basic_string<AtomT> & str)
+    {
+        return erase(str.begin(), str.end());
+    }
 
-            trie_map::IteratorInternalT it(std::addressof(map.edges[0]));
+    /** @brief Copies the value out, if the key is found */
+    template <typename KeyIterator>
+    bool get(KeyIterator it, KeyIterator end, value_type & out)
+    {
+        Shard & x = shards[shard_of(it, end)];
+        std::lock_guard<std::mutex> lock(x.lock);
 
-            while (it.m_root != nullptr) 
-            {
-                const trie_map::NodeT * n = it.get(0);
+        value_type * result = x.map.get(it, end);
+        if (result != nullptr) { out = *result; }
 
-                std::copy(n->kbegin(), n->kend(), 
-                    std::ostream_iterator<char, char>(stream));
+        return result != nullptr;
+    }
 
-                if (n->has_value())
-                {
-                    stream << "(=" << n->get_value() << ")";
-                }
+    bool get(const std::basic_string<AtomT> & str, value_type & out)
+    {
+        return get(str.begin(), str.end(), out);
+    }
 
-                if (it.step_down()) { stream << "{"; continue; }
-                if (it.step_fore()) { stream << "}{"; continue; }
+    template <typename KeyIterator>
+    bool contains(KeyIterator it, KeyIterator end)
+    {
+        Shard & x = shards[shard_of(it, end)];
+        std::lock_guard<std::mutex> lock(x.lock);
+        return x.map.contains(it, end);
+    }
 
-                while (!it.m_ptrs.empty()) 
-                {
-                    stream << "}";
-                    if (it.step_up()) { break; }
-                }
+    bool contains(const std::basic_string<AtomT> & str)
+    {
+        return contains(str.begin(), str.end());
+    }
 
-                if (it.m_ptrs.empty()) { it.m_root = nullptr; }
-            }
+    /** @brief Ordered view of the keys starting with the prefix */
+    view find_prefix(const std::basic_string<AtomT> & str)
+    {
+        view result;
 
-            return stream;
+        if (str.size() >= prefix_atoms)
+        {
+            Shard & x = shards[shard_of(str.begin(), str.end())];
+            result.locks.emplace_back(x.lock);
+            result.add(x.map, x.map.find_prefix(str));
+            return result;
         }
 
-        friend std::ostream & operator << (std::ostream & stream,
-            const _debug_print & x)
+        /* Always locked in the same order */
+        for (size_t i = 0; i < nshards; ++i)
         {
-            return x(stream);
+            result.locks.emplace_back(shards[i].lock);
+            result.add(shards[i].map, shards[i].map.find_prefix(str));
         }
-    };
+
+        return result;
+    }
+
+    /** @brief Ordered view of all the keys */
+    view all() { return find_prefix(std::basic_string<AtomT>()); }
+
 };
 
 /**
@@ -6,10 +6,65 @@
 
 #include <string>
 #include <set>
+#include <list>
+#include <random>
+#include <map>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <tuple>
 #include <src/trie.h>
 
 namespace utf  = boost::unit_test;
 
+/*
+ * Counts heap allocations to check allocation-free code paths. The whole
+ * set is replaced so that every form of new is paired with its delete.
+ * GCC must not inline the deletes, otherwise it sees free() applied to
+ * the result of operator new and warns about a mismatch.
+ */
+static std::atomic<size_t> heap_allocations(0);
+
+#if defined(__GNUC__)
+#define TEST_NOINLINE __attribute__((noinline))
+#else
+#define TEST_NOINLINE
+#endif
+
+/* When set, the n-th next allocation of this thread fails */
+static thread_local size_t failing_allocation = 0;
+
+static void * counted_malloc(size_t n)
+{
+    if (failing_allocation != 0 and --failing_allocation == 0) { return nullptr; }
+
+    ++heap_allocations;
+    return malloc(n == 0 ? 1 : n);
+}
+
+void * operator new(size_t n)
+{
+    void * result = counted_malloc(n);
+    if (result == nullptr) { throw std::bad_alloc(); }
+    return result;
+}
+
+void * operator new[](size_t n) { return operator new(n); }
+void * operator new(size_t n, const std::nothrow_t &) noexcept { return counted_malloc(n); }
+void * operator new[](size_t n, const std::nothrow_t &) noexcept { return counted_malloc(n); }
+
+TEST_NOINLINE void operator delete(void * p) noexcept { free(p); }
+TEST_NOINLINE void operator delete[](void * p) noexcept { free(p); }
+TEST_NOINLINE void operator delete(void * p, size_t) noexcept { free(p); }
+TEST_NOINLINE void operator delete[](void * p, size_t) noexcept { free(p); }
+TEST_NOINLINE void operator delete(void * p, const std::nothrow_t &) noexcept { free(p); }
+TEST_NOINLINE void operator delete[](void * p, const std::nothrow_t &) noexcept { free(p); }
+
 #define ITEMS_TO_TEST (128*1024)
 #define MAX_LENGTH 1024
 
@@ -141,12 +196,12 @@ BOOST_AUTO_TEST_CASE(simple_test_1)
     int count;
     bool found;
 
-    auto it = simple.cont.find_prefix("abc", found);
+    auto it = t.find_prefix("abc", found);
     BOOST_CHECK(found == false);
 
     count = 0;
 
-    for (; it != simple.cont.end(); ++it)
+    for (; it != t.end(); ++it)
     {
         BOOST_CHECK(boost::starts_with(it.key(), "abc"));
         ++count;
@@ -154,11 +209,11 @@ BOOST_AUTO_TEST_CASE(simple_test_1)
 
     BOOST_CHECK(count == 5);
 
-    it = simple.cont.find_prefix("abcabc", found);
+    it = t.find_prefix("abcabc", found);
 
     count = 0;
 
-    for (; it != simple.cont.end(); ++it)
+    for (; it != t.end(); ++it)
     {
         BOOST_CHECK(boost::starts_with(it.key(), "abcabc"));
         ++count;
@@ -167,11 +222,11 @@ BOOST_AUTO_TEST_CASE(simple_test_1)
     BOOST_CHECK(count == 2);
 
     count = 0;
-    it = simple.cont.find_prefix("xabc", [&count] () { ++count; });
+    it = t.find_prefix("xabc", [&count] () { ++count; });
     BOOST_CHECK(count == 0);
 
     count = 0;
-    it = simple.cont.find_prefix("xabcxabc", [&count] () { ++count; });
+    it = t.find_prefix("xabcxabc", [&count] () { ++count; });
     BOOST_CHECK(count == 1);
 }
 
@@ -214,3 +269,2393 @@ BOOST_AUTO_TEST_CASE(empty_set_iterators)
     BOOST_CHECK(t.find("something") == t.end());
     BOOST_CHECK(t.find_prefix("something") == t.end());
 }
+
+BOOST_AUTO_TEST_CASE(erase_keys)
+{
+    DefaultGenerator g(2);
+    TestMapI t;
+    std::set<std::string> t_model;
+
+    for (int i = ITEMS_TO_TEST / 8; i > 0; --i)
+    {
+        std::string x = generate(g);
+        t_model.insert(x);
+        t.insert(x, x);
+    }
+
+    size_t edgeCount = t._edges();
+    std::set<std::string> erased;
+
+    for (const std::string & x : t_model)
+    {
+        if (g() % 2 == 0) { erased.insert(x); }
+    }
+
+    for (const std::string & x : erased)
+    {
+        BOOST_CHECK(t.erase(x) == 1);
+        BOOST_CHECK(t.erase(x) == 0);
+    }
+
+    BOOST_CHECK(t.size() == t_model.size() - erased.size());
+
+    for (const std::string & x : t_model)
+    {
+        bool present = erased.find(x) == erased.end();
+        BOOST_CHECK(t.contains(x) == present);
+        BOOST_CHECK(present ? (t.at(x) == x) : (t.get(x) == nullptr));
+    }
+
+    size_t count = 0;
+
+    for (auto it = t.begin(); it != t.end(); ++it)
+    {
+        BOOST_CHECK(erased.find(it.key()) == erased.end());
+        ++count;
+    }
+
+    BOOST_CHECK(count == t.size());
+
+    /* Released edges must be reused */
+    for (const std::string & x : erased) { t.insert(x, x); }
+
+    BOOST_CHECK(t.size() == t_model.size());
+    BOOST_CHECK(t._edges() == edgeCount);
+
+    for (const std::string & x : t_model) { BOOST_CHECK(t.erase(x) == 1); }
+
+    BOOST_CHECK(t.size() == 0);
+    BOOST_CHECK(t.begin() == t.end());
+    BOOST_CHECK(t.contains("") == false);
+}
+
+BOOST_AUTO_TEST_CASE(erase_merge)
+{
+    TestSet t;
+    simple(t);
+
+    BOOST_CHECK(t.erase("abcabc") == 1);
+    BOOST_CHECK(t.erase("abc") == 0);
+    BOOST_CHECK(t.contains("abcabcabc"));
+    BOOST_CHECK(!t.contains("abcabc"));
+
+    BOOST_CHECK(t.erase("abcxabc") == 1);
+    BOOST_CHECK(t.erase("abcyasbc") == 1);
+    BOOST_CHECK(t.erase("abcvabc") == 1);
+    BOOST_CHECK(t.contains("abcabcabc"));
+
+    int count = 0;
+    for (auto it = t.find_prefix("abc"); it != t.end(); ++it) {
+        BOOST_CHECK(it.key() == "abcabcabc");
+        ++count;
+    }
+
+    BOOST_CHECK(count == 1);
+    BOOST_CHECK(t.size() == 4);
+}
+
+template <typename Map>
+void churn(Map & t)
+{
+    DefaultGenerator g(11);
+    std::vector<std::string> keys;
+    size_t settled = 0;
+
+    t.insert("persistent", 1);
+
+    for (int round = 0; round < 8; ++round)
+    {
+        keys.clear();
+
+        for (int i = 0; i < ITEMS_TO_TEST / 8; ++i)
+        {
+            keys.push_back(generate(g).substr(0, 64));
+            t.insert(keys.back(), i);
+        }
+
+        for (const std::string & x : keys) { t.erase(x); }
+
+        BOOST_CHECK(t.size() == 1);
+
+        /* Erased keys give their storage back, the arena does not grow */
+        if (round == 0) {
+            settled = t._memory();
+        } else {
+            BOOST_CHECK(t._memory() <= settled + settled / 8);
+        }
+    }
+
+    BOOST_CHECK(t.contains("persistent"));
+}
+
+BOOST_AUTO_TEST_CASE(erase_churn)
+{
+    trie::trie_map<char, int> t;
+    churn(t);
+
+    trie::trie_map<char, int, 16> c;
+    churn(c);
+
+    /* Keys replaced by updates are retired with the nodes */
+    trie::concurrent_trie_map<char, int> r;
+    churn(r);
+
+    trie::concurrent_trie_map<char, int, 16> rc;
+    churn(rc);
+}
+
+static size_t allocated_bytes = 0;
+static size_t allocation_count = 0;
+
+template <typename T>
+struct CountingAllocator : std::allocator<T>
+{
+    template <typename U> struct rebind { typedef CountingAllocator<U> other; };
+
+    CountingAllocator() { }
+    template <typename U> CountingAllocator(const CountingAllocator<U> &) { }
+
+    T * allocate(size_t n)
+    {
+        allocated_bytes += n * sizeof(T);
+        ++allocation_count;
+        return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T * p, size_t n)
+    {
+        allocated_bytes -= n * sizeof(T);
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(arena_allocator)
+{
+    typedef trie::trie_map<char, std::string, 0,
+        trie::trie_node<char, std::string>, CountingAllocator<char> > TestMapA;
+
+    /* The node is still the fourth argument, as it was before the allocator */
+    static_assert(std::is_same<trie::trie_map<char, int, 0, trie::trie_node<char, int> >,
+        trie::trie_map<char, int> >::value, "the allocator is the last argument");
+
+    DefaultGenerator g(3);
+    std::set<std::string> t_model;
+
+    {
+        TestMapA t;
+
+        for (int i = ITEMS_TO_TEST / 8; i > 0; --i)
+        {
+            std::string x = generate(g);
+            t_model.insert(x);
+            t.insert(x, x);
+        }
+
+        BOOST_CHECK(allocated_bytes == t._memory());
+        BOOST_CHECK(allocation_count < t_model.size() / 16);
+
+        for (const std::string & x : t_model) { BOOST_CHECK(t.at(x) == x); }
+
+        TestMapA moved(std::move(t));
+
+        BOOST_CHECK(t.size() == 0);
+        BOOST_CHECK(moved.size() == t_model.size());
+        BOOST_CHECK(moved.contains(*t_model.begin()));
+
+        moved.clear();
+
+        BOOST_CHECK(allocated_bytes == 0);
+        BOOST_CHECK(moved.size() == 0);
+        BOOST_CHECK(moved.begin() == moved.end());
+
+        moved.insert("abc", "abc");
+        BOOST_CHECK(moved.at("abc") == "abc");
+    }
+
+    BOOST_CHECK(allocated_bytes == 0);
+
+    /* An empty map takes no memory, the free lists come with the first slab */
+    {
+        TestMapA empty;
+        BOOST_CHECK(sizeof(empty) < 256);
+        BOOST_CHECK(allocated_bytes == 0);
+    }
+
+    /* Over-aligned values get upstream blocks of their own */
+    struct alignas(32) Wide { double x[4]; };
+    {
+        trie::trie_map<char, Wide, 0, trie::trie_node<char, Wide>, CountingAllocator<char> > w;
+
+        for (int i = 0; i < 1000; ++i) {
+            w.insert(std::to_string(i), Wide { { (double) i, 0, 0, 0 } });
+        }
+
+        for (int i = 0; i < 1000; i += 2) { BOOST_CHECK(w.erase(std::to_string(i)) == 1); }
+
+        for (int i = 1; i < 1000; i += 2)
+        {
+            const Wide * x = w.get(std::to_string(i));
+            BOOST_CHECK(x != nullptr and reinterpret_cast<uintptr_t>(x) % alignof(Wide) == 0);
+            BOOST_CHECK(x != nullptr and x->x[0] == i);
+        }
+    }
+
+    BOOST_CHECK(allocated_bytes == 0);
+
+    trie::trie_map<char, long double> ld;
+    ld.insert("abc", 1.5L);
+    BOOST_CHECK(*ld.get("abc") == 1.5L);
+}
+
+BOOST_AUTO_TEST_CASE(adaptive_nodes)
+{
+    TestMapI t;
+    std::set<std::string> t_model;
+
+    /* Grow a single node through all the table layouts and back */
+    for (int i = 0; i < 256; ++i)
+    {
+        std::string x = std::string("/") + (char) ((i * 7) & 0xff) + "/";
+        t_model.insert(x);
+        t.insert(x, x);
+
+        BOOST_CHECK(t.contains(x));
+        BOOST_CHECK(t.size() == t_model.size());
+    }
+
+    for (const std::string & x : t_model) { BOOST_CHECK(t.at(x) == x); }
+
+    auto model_it = t_model.begin();
+
+    for (auto it = t.begin(); it != t.end(); ++it, ++model_it) {
+        BOOST_CHECK(it.key() == *model_it);
+    }
+
+    for (int i = 0; i < 256; i += 2)
+    {
+        std::string x = std::string("/") + (char) ((i * 7) & 0xff) + "/";
+        t_model.erase(x);
+        BOOST_CHECK(t.erase(x) == 1);
+    }
+
+    for (int i = 0; i < 256; ++i)
+    {
+        std::string x = std::string("/") + (char) ((i * 7) & 0xff) + "/";
+        BOOST_CHECK(t.contains(x) == (i % 2 == 1));
+    }
+
+    model_it = t_model.begin();
+
+    for (auto it = t.begin(); it != t.end(); ++it, ++model_it) {
+        BOOST_CHECK(it.key() == *model_it);
+    }
+
+    BOOST_CHECK(model_it == t_model.end());
+}
+
+BOOST_AUTO_TEST_CASE(long_labels)
+{
+    TestMapI t;
+    std::string base;
+
+    for (int i = 0; i < 200; ++i) { base += (char) ('a' + i % 26); }
+
+    /* Keys diverging from the long common label at every offset */
+    for (size_t i = 0; i < base.size(); i += 3)
+    {
+        std::string x = base.substr(0, i) + "#" + base.substr(i);
+        t.insert(x, x);
+    }
+
+    t.insert(base, base);
+
+    for (size_t i = 0; i < base.size(); ++i)
+    {
+        std::string x = base.substr(0, i) + "#" + base.substr(i);
+        bool present = (i % 3 == 0);
+
+        std::vector<char> v(x.begin(), x.end());
+        std::list<char> l(x.begin(), x.end());
+
+        BOOST_CHECK(t.contains(x) == present);
+        BOOST_CHECK(t.contains(x.data(), x.data() + x.size()) == present);
+        BOOST_CHECK(t.contains(v.begin(), v.end()) == present);
+        BOOST_CHECK(t.contains(l.begin(), l.end()) == present);
+
+        if (present) { BOOST_CHECK(*t.get(v.cbegin(), v.cend()) == x); }
+
+        BOOST_CHECK(!t.contains(base.substr(0, i)));
+        BOOST_CHECK(!t.contains(base.substr(0, i) + "$"));
+    }
+
+    BOOST_CHECK(t.at(base.data(), base.data() + base.size()) == base);
+}
+
+BOOST_AUTO_TEST_CASE(ordered_bounds)
+{
+    DefaultGenerator g(4);
+    TestMapI t;
+    std::set<std::string> t_model;
+
+    auto short_key = [&g] () {
+        std::string x;
+        x.resize(g() % 6);
+        for (char & c : x) { c = "ab/\xe1"[g() % 4]; }
+        return x;
+    };
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        std::string x = short_key();
+        t_model.insert(x);
+        t.insert(x, x);
+    }
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        std::string x = short_key();
+        auto lb = t_model.lower_bound(x);
+        auto ub = t_model.upper_bound(x);
+
+        BOOST_CHECK(lb == t_model.end() ? t.lower_bound(x) == t.end() : t.lower_bound(x).key() == *lb);
+        BOOST_CHECK(ub == t_model.end() ? t.upper_bound(x) == t.end() : t.upper_bound(x).key() == *ub);
+
+        std::string y = short_key();
+        auto r = t.range(x, y);
+        auto model_it = t_model.lower_bound(x);
+
+        for (; r.first != r.second; ++r.first, ++model_it) {
+            BOOST_CHECK(r.first.key() == *model_it);
+        }
+
+        BOOST_CHECK(model_it == (x < y ? t_model.lower_bound(y) : t_model.lower_bound(x)));
+    }
+
+    auto r = t.equal_range(*t_model.begin());
+    BOOST_CHECK(r.first.key() == *t_model.begin());
+    ++r.first;
+    BOOST_CHECK(r.first == r.second);
+
+    /* The bounds compare as the keys iterate, with unsigned atoms even
+     * where the string compares them signed */
+    trie::trie_map<wchar_t, int> w;
+    std::wstring high(1, (wchar_t) -1);
+
+    w.insert(L"a", 1);
+    w.insert(L"b", 2);
+    w.insert(high, 3);
+
+    auto wr = w.range(L"a", high);
+    int count = 0;
+    for (; wr.first != wr.second; ++wr.first) { ++count; }
+
+    BOOST_CHECK(count == 2);
+    BOOST_CHECK(w.range(high, L"a").first == w.end());
+}
+
+BOOST_AUTO_TEST_CASE(cursor_values)
+{
+    trie::trie_map<char, int> t;
+    std::string deep;
+
+    simple(t);
+
+    size_t before = heap_allocations;
+
+    auto it = t.find("abcvabc");
+    auto copy = it;
+    bool exact = false;
+    auto sub = t.find_prefix("abc", exact);
+    auto missing = t.find("abcd");
+    int count = 0;
+
+    for (auto x = t.begin(); x != t.end(); ++x) { ++count; }
+
+    BOOST_CHECK(heap_allocations == before);
+    BOOST_CHECK(count == 8);
+    BOOST_CHECK(missing == t.end());
+    BOOST_CHECK(!exact);
+
+    ++copy;
+    BOOST_CHECK(it != copy);
+    BOOST_CHECK(it.key() == "abcvabc");
+    BOOST_CHECK(copy.key() == "abcxabc");
+
+    count = 0;
+    for (; sub != t.end(); ++sub) { ++count; }
+    BOOST_CHECK(count == 5);
+
+    /* Deeper than the inline part of the cursor path */
+    for (int i = 0; i < 40; ++i)
+    {
+        deep += (char) ('a' + i % 26);
+        t.insert(deep + "!", i);
+    }
+
+    count = 0;
+
+    for (auto x = t.find_prefix("abcdefghijklmnopqrstuvwxyzabc"); x != t.end(); ++x)
+    {
+        BOOST_CHECK(x.key().size() == (size_t) x.value() + 2);
+        ++count;
+    }
+
+    BOOST_CHECK(count == 40 - 28);
+}
+
+BOOST_AUTO_TEST_CASE(squeeze_relayout)
+{
+    DefaultGenerator g(5);
+    TestMapI t;
+    std::set<std::string> t_model;
+
+    t.squeeze();
+    BOOST_CHECK(t.size() == 0);
+
+    for (int i = ITEMS_TO_TEST / 16; i > 0; --i)
+    {
+        std::string x = generate(g).substr(0, 64);
+        t_model.insert(x);
+        t.insert(x, x);
+    }
+
+    for (auto it = t_model.begin(); it != t_model.end(); )
+    {
+        if (g() % 3 == 0) {
+            BOOST_CHECK(t.erase(*it) == 1);
+            it = t_model.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    size_t before = t._memory();
+    t.squeeze();
+
+    BOOST_CHECK(t._memory() < before);
+    BOOST_CHECK(t.size() == t_model.size());
+
+    auto model_it = t_model.begin();
+
+    for (auto it = t.begin(); it != t.end(); ++it, ++model_it)
+    {
+        BOOST_CHECK(it.key() == *model_it);
+        BOOST_CHECK(it.value() == *model_it);
+    }
+
+    BOOST_CHECK(model_it == t_model.end());
+
+    /* Still mutable */
+    for (int i = 0; i < 1000; ++i)
+    {
+        std::string x = generate(g).substr(0, 64);
+
+        if (t_model.insert(x).second) {
+            t.insert(x, x);
+        } else {
+            BOOST_CHECK(t.erase(x) == 1);
+            t_model.erase(x);
+        }
+    }
+
+    for (const std::string & x : t_model) { BOOST_CHECK(t.at(x) == x); }
+
+    BOOST_CHECK(t.size() == t_model.size());
+}
+
+BOOST_AUTO_TEST_CASE(frozen_image)
+{
+    DefaultGenerator g(6);
+    trie::trie_map<char, int> t;
+    std::map<std::string, int> t_model;
+
+    for (int i = ITEMS_TO_TEST / 16; i > 0; --i)
+    {
+        std::string x = generate(g).substr(0, 64);
+        t_model[x] = i;
+        t.insert(x, i);
+    }
+
+    std::string path = "/tmp/triefunc_frozen_image.bin";
+    t.write_image(path);
+
+    {
+        typedef trie::frozen_trie<char, int> FrozenT;
+        FrozenT f = FrozenT::open(path);
+
+        BOOST_CHECK(f.size() == t_model.size());
+
+        for (const auto & x : t_model)
+        {
+            BOOST_CHECK(f.contains(x.first));
+            BOOST_CHECK(f.at(x.first) == x.second);
+            BOOST_CHECK(f.find(x.first).key() == x.first);
+        }
+
+        for (int i = 0; i < 1000; ++i)
+        {
+            std::string x = generate(g).substr(0, 64);
+            BOOST_CHECK(f.contains(x) == (t_model.count(x) == 1));
+        }
+
+        auto model_it = t_model.begin();
+
+        for (auto it = f.begin(); it != f.end(); ++it, ++model_it)
+        {
+            BOOST_CHECK(it.key() == model_it->first);
+            BOOST_CHECK(it.value() == model_it->second);
+        }
+
+        BOOST_CHECK(model_it == t_model.end());
+
+        /* The same keys as the mutable trie gives */
+        for (int i = 0; i < 256; ++i)
+        {
+            std::string prefix(1, (char) i);
+            bool exact = false, fexact = false;
+
+            auto it = t.find_prefix(prefix, exact);
+            auto fit = f.find_prefix(prefix, fexact);
+
+            BOOST_CHECK(exact == fexact);
+
+            for (; it != t.end() and fit != f.end(); ++it, ++fit) {
+                BOOST_CHECK(it.key() == fit.key());
+            }
+
+            BOOST_CHECK(it == t.end() and fit == f.end());
+        }
+
+        BOOST_CHECK_THROW(f.at(std::string("\xff\xff\xff\xff\xff")), std::out_of_range);
+
+        typedef trie::frozen_trie<char16_t, int> WideFrozenT;
+        BOOST_CHECK_THROW(WideFrozenT::open(path), std::runtime_error);
+    }
+
+    std::remove(path.c_str());
+
+    trie::trie_map<char, int> empty;
+    std::stringstream stream;
+    empty.write_image(stream);
+
+    std::string image = stream.str();
+    std::vector<uint64_t> buffer(image.size() / sizeof(uint64_t) + 1);
+    std::memcpy(buffer.data(), image.data(), image.size());
+
+    trie::frozen_trie<char, int> f(buffer.data(), image.size());
+    BOOST_CHECK(f.size() == 0 and f.begin() == f.end());
+    BOOST_CHECK(f.get(std::string()) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(sorted_build)
+{
+    DefaultGenerator g(7);
+    std::map<std::string, std::string> t_model;
+
+    for (int i = ITEMS_TO_TEST / 16; i > 0; --i)
+    {
+        std::string x = generate(g).substr(0, 64);
+        t_model[x] = x;
+    }
+
+    TestMapI t, t_inserted;
+    t.build_sorted(t_model.begin(), t_model.end());
+
+    for (const auto & x : t_model) { t_inserted.insert(x.first, x.second); }
+
+    BOOST_CHECK(t.size() == t_model.size());
+    BOOST_CHECK(t._edges() == t_inserted._edges());
+
+    auto model_it = t_model.begin();
+
+    for (auto it = t.begin(); it != t.end(); ++it, ++model_it)
+    {
+        BOOST_CHECK(it.key() == model_it->first);
+        BOOST_CHECK(it.value() == model_it->second);
+    }
+
+    BOOST_CHECK(model_it == t_model.end());
+
+    /* Still mutable */
+    for (auto it = t_model.begin(); it != t_model.end(); )
+    {
+        if (g() % 3 == 0) {
+            BOOST_CHECK(t.erase(it->first) == 1);
+            it = t_model.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    t.insert(std::string("abc"), std::string("abc"));
+    t_model["abc"] = "abc";
+
+    for (const auto & x : t_model) { BOOST_CHECK(t.at(x.first) == x.second); }
+
+    BOOST_CHECK(t.size() == t_model.size());
+
+    /* Streaming, with chunked key storage */
+    trie::trie_map<char, int, 16> c;
+
+    {
+        trie::trie_map<char, int, 16>::sorted_builder builder(c);
+
+        builder.push(std::string(""), 1);
+        builder.push(std::string("ab"), 2);
+        builder.push(std::string("abc"), 3);
+        builder.push(std::string("abc"), 4);
+        builder.push(std::string("abd"), 5);
+        builder.push(std::string("b"), 6);
+
+        BOOST_CHECK_THROW(builder.push(std::string("a"), 7), std::invalid_argument);
+        BOOST_CHECK_THROW(builder.push(std::string(""), 7), std::invalid_argument);
+
+        builder.push(std::string("bcd"), 8);
+        builder.finish();
+    }
+
+    BOOST_CHECK(c.size() == 6);
+    BOOST_CHECK(c.at(std::string("")) == 1);
+    BOOST_CHECK(c.at(std::string("ab")) == 2);
+    BOOST_CHECK(c.at(std::string("abc")) == 4);
+    BOOST_CHECK(c.at(std::string("abd")) == 5);
+    BOOST_CHECK(c.at(std::string("b")) == 6);
+    BOOST_CHECK(c.at(std::string("bcd")) == 8);
+    BOOST_CHECK(!c.contains(std::string("a")));
+    BOOST_CHECK(!c.contains(std::string("bc")));
+
+    std::map<std::string, int> empty;
+    c.build_sorted(empty.begin(), empty.end());
+    BOOST_CHECK(c.size() == 0 and c.begin() == c.end());
+
+    /* Without finish() the trie is rolled back, values destroyed */
+    for (size_t n = 0; n < 64; n += 7)
+    {
+        TestMapI r;
+
+        {
+            TestMapI::sorted_builder builder(r);
+
+            size_t i = 0;
+            for (auto it = t_model.begin(); it != t_model.end() and i < n; ++it, ++i) {
+                builder.push(it->first, it->second);
+            }
+        }
+
+        BOOST_CHECK(r.size() == 0 and r.begin() == r.end());
+
+        r.insert(std::string("abc"), std::string("abc"));
+        BOOST_CHECK(r.size() == 1 and r.at(std::string("abc")) == "abc");
+    }
+
+    BOOST_CHECK_THROW(
+        {
+            TestMapI::sorted_builder builder(t);
+            builder.push(std::string("b"), std::string("b"));
+            builder.push(std::string("a"), std::string("a"));
+            builder.finish();
+        },
+        std::invalid_argument);
+
+    BOOST_CHECK(t.size() == 0 and t.begin() == t.end());
+}
+
+BOOST_AUTO_TEST_CASE(batched_lookups)
+{
+    DefaultGenerator g(8);
+    TestMapI t;
+    std::vector<std::string> keys;
+
+    for (int i = ITEMS_TO_TEST / 16; i > 0; --i)
+    {
+        std::string x = generate(g).substr(0, 64);
+        t.insert(x, x);
+        keys.push_back(x);
+
+        /* Absent ones, including prefixes and extensions of present ones */
+        keys.push_back(generate(g).substr(0, 64));
+        keys.push_back(x.substr(0, x.size() / 2));
+        keys.push_back(x + "\x01");
+    }
+
+    std::vector<std::string *> values;
+    std::vector<bool> found;
+
+    t.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+    t.contains_many(keys.begin(), keys.end(), std::back_inserter(found));
+
+    BOOST_REQUIRE(values.size() == keys.size());
+    BOOST_REQUIRE(found.size() == keys.size());
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        BOOST_CHECK(values[i] == t.get(keys[i]));
+        BOOST_CHECK(found[i] == t.contains(keys[i]));
+    }
+
+    /* Any forward range of keys */
+    std::list<std::string> few = { "", keys[0], keys[1] };
+    bool out[3];
+
+    t.contains_many(few.begin(), few.end(), out);
+    BOOST_CHECK(out[0] == t.contains(std::string()));
+    BOOST_CHECK(out[1] == true);
+    BOOST_CHECK(out[2] == t.contains(keys[1]));
+
+    TestMapI empty;
+    empty.contains_many(few.begin(), few.end(), out);
+    BOOST_CHECK(!out[0] and !out[1] and !out[2]);
+
+    /* Keys with forward iterators only, under a root with an empty label */
+    TestMapI split;
+    split.insert("abc", "abc");
+    split.insert("xyz", "xyz");
+
+    std::vector< std::list<char> > lists;
+    for (const char * x : { "abc", "xyz", "ab", "abcd", "", "q" }) {
+        lists.push_back(std::list<char>(x, x + strlen(x)));
+    }
+
+    std::vector<std::string *> listed;
+    split.get_many(lists.begin(), lists.end(), std::back_inserter(listed));
+
+    BOOST_REQUIRE(listed.size() == lists.size());
+    BOOST_CHECK(listed[0] != nullptr and *listed[0] == "abc");
+    BOOST_CHECK(listed[1] != nullptr and *listed[1] == "xyz");
+    for (size_t i = 2; i < listed.size(); ++i) { BOOST_CHECK(listed[i] == nullptr); }
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_single_thread)
+{
+    DefaultGenerator g(9);
+    trie::concurrent_trie_map<char, std::string> t;
+    std::map<std::string, std::string> t_model;
+
+    for (int i = 0; i < ITEMS_TO_TEST / 4; ++i)
+    {
+        std::string x = generate(g).substr(0, 16);
+
+        if (g() % 3 == 0 and t_model.count(x)) {
+            BOOST_CHECK(t.erase(x) == 1);
+            t_model.erase(x);
+        } else {
+            t.insert(x, x + "!");
+            t_model[x] = x + "!";
+        }
+    }
+
+    BOOST_CHECK(t.size() == t_model.size());
+
+    trie::concurrent_trie_map<char, std::string>::reader snapshot(t);
+    auto model_it = t_model.begin();
+
+    for (auto it = snapshot.begin(); it != snapshot.end(); ++it, ++model_it)
+    {
+        BOOST_CHECK(it.key() == model_it->first);
+        BOOST_CHECK(it.value() == model_it->second);
+    }
+
+    BOOST_CHECK(model_it == t_model.end());
+
+    /* Other readers share the values */
+    static_assert(std::is_const<std::remove_reference<
+        decltype(snapshot.begin().value())>::type>::value, "reader values are read-only");
+
+    /* The snapshot does not see later updates */
+    std::string first = t_model.begin()->first;
+
+    BOOST_CHECK(t.erase(first) == 1);
+    t.insert(std::string("\x01new"), std::string("new"));
+
+    BOOST_CHECK(snapshot.contains(first));
+    BOOST_CHECK(!snapshot.contains(std::string("\x01new")));
+    BOOST_CHECK(!t.contains(first));
+
+    std::string value;
+    BOOST_CHECK(t.get(std::string("\x01new"), value) and value == "new");
+
+    trie::concurrent_trie_map<char, int> counter;
+    counter.add(std::string("abc"), 1);
+    counter.add(std::string("abc"), 2);
+    counter.add(std::string("ab"), 1);
+
+    int x = 0;
+    BOOST_CHECK(counter.get(std::string("abc"), x) and x == 3);
+    BOOST_CHECK(counter.size() == 2);
+    BOOST_CHECK(counter.erase(std::string("abc")) == 1);
+    BOOST_CHECK(counter.erase(std::string("ab")) == 1);
+    BOOST_CHECK(counter.size() == 0 and !counter.contains(std::string("ab")));
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_readers)
+{
+    typedef trie::concurrent_trie_map<char, int> MapT;
+    MapT t;
+
+    /* The stable keys are always there, the volatile ones come and go */
+    for (int i = 0; i < 1000; ++i) { t.insert("stable" + std::to_string(i), i); }
+
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+
+    for (int r = 0; r < 4; ++r)
+    {
+        readers.emplace_back([&t, &done, &errors] () {
+            while (!done.load())
+            {
+                MapT::reader snapshot(t);
+
+                for (int i = 0; i < 1000; i += 7)
+                {
+                    const int * x = snapshot.get("stable" + std::to_string(i));
+                    if (x == nullptr or *x != i) { ++errors; }
+
+                    x = snapshot.get("volatile" + std::to_string(i));
+                    if (x != nullptr and *x != -i) { ++errors; }
+                }
+            }
+        });
+    }
+
+    for (int round = 0; round < 20; ++round)
+    {
+        for (int i = 0; i < 1000; ++i) { t.insert("volatile" + std::to_string(i), -i); }
+        for (int i = 0; i < 1000; ++i) { t.erase("volatile" + std::to_string(i)); }
+    }
+
+    done = true;
+    for (std::thread & x : readers) { x.join(); }
+
+    BOOST_CHECK(errors.load() == 0);
+    BOOST_CHECK(t.size() == 1000);
+}
+
+/* A value, which copies throw while the flag is set */
+struct Fragile
+{
+    static bool fail;
+    int x;
+
+    Fragile(int a_x = 0) : x(a_x) { }
+
+    Fragile(const Fragile & other) : x(other.x)
+    {
+        if (fail) { throw std::runtime_error("Fragile"); }
+    }
+
+    Fragile & operator = (const Fragile & other) { x = other.x; return *this; }
+};
+
+bool Fragile::fail = false;
+
+/* Refuses the allocations above the limit */
+static size_t flaky_limit = SIZE_MAX;
+
+template <typename T>
+struct FlakyAllocator : std::allocator<T>
+{
+    template <typename U> struct rebind { typedef FlakyAllocator<U> other; };
+
+    FlakyAllocator() { }
+    template <typename U> FlakyAllocator(const FlakyAllocator<U> &) { }
+
+    T * allocate(size_t n)
+    {
+        if (n * sizeof(T) > flaky_limit) { throw std::bad_alloc(); }
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+/* Checks that the map and a reader of it both hold exactly the model */
+template <typename MapT, typename Model, typename Get>
+static void check_concurrent_model(MapT & t, const Model & model, Get get)
+{
+    typename MapT::reader snapshot(t);
+    size_t count = 0;
+
+    for (auto it = snapshot.begin(); it != snapshot.end(); ++it)
+    {
+        auto x = model.find(it.key());
+        BOOST_CHECK(x != model.end() and get(it.value()) == x->second);
+        ++count;
+    }
+
+    BOOST_CHECK(count == model.size());
+    BOOST_CHECK(t.size() == model.size());
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_update_failures)
+{
+    typedef trie::concurrent_trie_map<char, Fragile> MapT;
+    auto get = [] (const Fragile & v) { return v.x; };
+
+    DefaultGenerator g(27);
+    MapT t;
+    std::map<std::string, int> model;
+
+    auto word = [&g] ()
+    {
+        std::string x;
+        for (int j = g() % 6; j >= 0; --j) { x += "abc"[g() % 3]; }
+        return x;
+    };
+
+    for (int i = 0; i < 300; ++i)
+    {
+        std::string x = word();
+        t.insert(x, Fragile(i));
+        model[x] = i;
+    }
+
+    /* Failed updates must not retire nodes the trie still uses,
+     * the later ones collect them and the reader would see it */
+    for (int i = 0; i < 3000; ++i)
+    {
+        std::string x = word();
+
+        switch (g() % 3)
+        {
+            case 0:
+                Fragile::fail = true;
+                BOOST_CHECK_THROW(t.insert(x, Fragile(i)), std::runtime_error);
+                Fragile::fail = false;
+                break;
+            case 1:
+                if (model.count(x) == 0) { break; } /* replace() is for the existing keys */
+                BOOST_CHECK_THROW(t.insert(x.begin(), x.end(), Fragile(i),
+                    [] (Fragile &, const Fragile &) { throw std::runtime_error("replace"); }),
+                    std::runtime_error);
+                break;
+            default:
+                if (g() % 2 == 0) {
+                    t.insert(x, Fragile(i));
+                    model[x] = i;
+                } else {
+                    BOOST_CHECK(t.erase(x) == model.erase(x));
+                }
+        }
+
+        if (i % 500 == 0) { check_concurrent_model(t, model, get); }
+    }
+
+    check_concurrent_model(t, model, get);
+
+    /* Keys longer than the arena slab size are allocated on their own,
+     * failing them makes the updates throw halfway through */
+    typedef trie::concurrent_trie_map<char, int, 0, FlakyAllocator<char> > FlakyMapT;
+    auto same = [] (int v) { return v; };
+
+    FlakyMapT f;
+    std::map<std::string, int> fmodel;
+    std::string longer(6000, 'x');
+
+    for (const char * x : { "a", "ab", "abc", "b", "bcd" }) {
+        f.insert(std::string(x), 1);
+        fmodel[x] = 1;
+    }
+
+    f.insert(std::string("c") + longer, 2);
+    fmodel["c" + longer] = 2;
+
+    for (int round = 0; round < 100; ++round)
+    {
+        flaky_limit = 4096;
+
+        /* A new leaf, a split and a merge of long keys */
+        BOOST_CHECK_THROW(f.insert(std::string("ab") + longer, 3), std::bad_alloc);
+        BOOST_CHECK_THROW(f.insert(std::string("bd") + longer, 3), std::bad_alloc);
+        BOOST_CHECK_THROW(f.insert(longer, 3), std::bad_alloc);
+
+        flaky_limit = SIZE_MAX;
+        f.insert(std::string("d") + longer, 4);
+        f.insert(std::string("d") + longer + "e" + longer, 5);
+
+        flaky_limit = 4096;
+        BOOST_CHECK_THROW(f.erase(std::string("d") + longer), std::bad_alloc);
+        flaky_limit = SIZE_MAX;
+
+        BOOST_CHECK(f.erase(std::string("d") + longer) == 1);
+        BOOST_CHECK(f.erase(std::string("d") + longer + "e" + longer) == 1);
+
+        check_concurrent_model(f, fmodel, same);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(epoch_slots_exhausted)
+{
+    typedef trie::detail::EpochDomain DomainT;
+    std::unique_ptr<DomainT> domain(new DomainT());
+    std::vector<size_t> taken;
+
+    for (size_t i = 0; i < DomainT::CSlots; ++i) { taken.push_back(domain->enter()); }
+    BOOST_CHECK(std::set<size_t>(taken.begin(), taken.end()).size() == DomainT::CSlots);
+
+    /* A reader waits for a slot and gets the one freed */
+    std::atomic<size_t> got(DomainT::CSlots);
+    std::thread waiter([&domain, &got] () { got = domain->enter(); });
+
+    /* It blocks instead of spinning */
+    while (domain->waiting.load() == 0) { std::this_thread::yield(); }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    BOOST_CHECK(got.load() == DomainT::CSlots);
+
+    domain->leave(taken[5]);
+    waiter.join();
+
+    BOOST_CHECK(got.load() == taken[5]);
+    BOOST_CHECK(domain->waiting.load() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(sharded_map)
+{
+    typedef trie::sharded_trie_map<char, int> MapT;
+    MapT t(8, 2);
+    std::vector<std::thread> writers;
+
+    /* Every writer adds 1 to every key */
+    for (int w = 0; w < 4; ++w)
+    {
+        writers.emplace_back([&t] () {
+            for (int i = 0; i < 2000; ++i) { t.add(std::to_string(i * 7919 % 2000), 1); }
+        });
+    }
+
+    for (std::thread & x : writers) { x.join(); }
+
+    BOOST_CHECK(t.shard_count() == 8);
+    BOOST_CHECK(t.size() == 2000);
+
+    std::map<std::string, int> t_model;
+    for (int i = 0; i < 2000; ++i) { t_model[std::to_string(i)] = 4; }
+
+    {
+        MapT::view all = t.all();
+        auto model_it = t_model.begin();
+
+        for (auto it = all.begin(); it != all.end(); ++it, ++model_it)
+        {
+            BOOST_CHECK(it.key() == model_it->first);
+            BOOST_CHECK(it.value() == model_it->second);
+        }
+
+        BOOST_CHECK(model_it == t_model.end());
+    }
+
+    /* Short prefixes merge the shards, long ones take one */
+    for (const std::string & prefix : { std::string("1"), std::string("19"), std::string("199") })
+    {
+        MapT::view v = t.find_prefix(prefix);
+        auto model_it = t_model.lower_bound(prefix);
+
+        for (auto it = v.begin(); it != v.end(); ++it, ++model_it) {
+            BOOST_CHECK(it.key() == model_it->first);
+        }
+
+        BOOST_CHECK(model_it == t_model.end() or
+            !boost::starts_with(model_it->first, prefix));
+    }
+
+    int x = 0;
+    BOOST_CHECK(t.get(std::string("1999"), x) and x == 4);
+    BOOST_CHECK(t.erase(std::string("1999")) == 1);
+    BOOST_CHECK(!t.contains(std::string("1999")));
+    BOOST_CHECK(t.find_prefix("1999").begin() == MapT::view::iterator());
+    BOOST_CHECK(t.size() == 1999);
+
+    /* Every key would go to the same shard */
+    BOOST_CHECK_THROW(MapT(8, 0), std::invalid_argument);
+
+    /* The merge compares the keys in place, in the order of atom_less */
+    MapT h(4, 1);
+    std::set<std::string> h_model;
+
+    for (int i = 0; i < 500; ++i)
+    {
+        std::string x = std::string(16 + i % 3, '\xe1') + std::to_string(i) + "\x80" + std::to_string(i % 7);
+        h.insert(x, i);
+        h_model.insert(x);
+    }
+
+    {
+        MapT::view hv = h.all();
+        size_t before = heap_allocations;
+        int sum = 0;
+
+        for (auto it = hv.begin(); it != hv.end(); ++it) { sum += it.value(); }
+
+        BOOST_CHECK(heap_allocations == before);
+        BOOST_CHECK(sum == 499 * 500 / 2);
+    }
+
+    MapT::view hv = h.all();
+    auto model_it = h_model.begin();
+
+    for (auto it = hv.begin(); it != hv.end(); ++it, ++model_it) {
+        BOOST_CHECK(it.key() == *model_it);
+    }
+
+    BOOST_CHECK(model_it == h_model.end());
+}
+
+BOOST_AUTO_TEST_CASE(parallel_build)
+{
+    DefaultGenerator g(13);
+    std::map<std::string, std::string> t_model;
+
+    for (int i = ITEMS_TO_TEST / 8; i > 0; --i)
+    {
+        std::string x = generate(g).substr(0, 64);
+        t_model[x] = x;
+
+        /* Skewed, most of them below one long prefix */
+        x = "http://www.example.com/" + x.substr(0, 16);
+        t_model[x] = x;
+    }
+
+    t_model[""] = "root";
+    t_model["http://www.example.com/"] = "inner";
+
+    std::vector< std::pair<std::string, std::string> > input(t_model.begin(), t_model.end());
+
+    TestMapI t, t_sorted;
+    t.build_sorted_parallel(input.begin(), input.end(), 4);
+    t_sorted.build_sorted(input.begin(), input.end());
+
+    BOOST_CHECK(t.size() == t_model.size());
+    BOOST_CHECK(t._edges() == t_sorted._edges());
+
+    auto model_it = t_model.begin();
+
+    for (auto it = t.begin(); it != t.end(); ++it, ++model_it)
+    {
+        BOOST_CHECK(it.key() == model_it->first);
+        BOOST_CHECK(it.value() == model_it->second);
+    }
+
+    BOOST_CHECK(model_it == t_model.end());
+
+    /* The grafted nodes are released to the arena of the trie */
+    for (const auto & x : input) { BOOST_CHECK(t.erase(x.first) == 1); }
+
+    BOOST_CHECK(t.size() == 0 and t.begin() == t.end());
+
+    /* Out of order keys are found by the thread, which builds them */
+    std::swap(input[input.size() / 2], input[input.size() / 2 + 1]);
+    BOOST_CHECK_THROW(t.build_sorted_parallel(input.begin(), input.end(), 4), std::invalid_argument);
+    BOOST_CHECK(t.size() == 0 and t.begin() == t.end());
+
+    /* Sets, with duplicate keys */
+    std::vector< std::pair<std::string, int> > words;
+
+    for (int i = 0; i < 5000; ++i)
+    {
+        words.push_back(std::make_pair(std::to_string(i / 2), 1));
+    }
+
+    std::sort(words.begin(), words.end());
+
+    TestSet s;
+    s.build_sorted_parallel(words.begin(), words.end(), 3);
+
+    BOOST_CHECK(s.size() == 2500);
+    BOOST_CHECK(s.contains(std::string("1249")));
+    BOOST_CHECK(!s.contains(std::string("2500")));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_start_failure)
+{
+    DefaultGenerator g(17);
+    std::map<std::string, std::string> t_model;
+
+    for (int i = ITEMS_TO_TEST / 32; i > 0; --i)
+    {
+        std::string x = generate(g).substr(0, 32);
+        t_model[x] = x;
+    }
+
+    std::vector< std::pair<std::string, std::string> > input(t_model.begin(), t_model.end());
+
+    TestSet s;
+    for (const auto & x : t_model) { s.add(x.first); }
+
+    /* Fail each allocation of the calling thread in turn, thread starts included */
+    for (size_t n = 1; n < 64; ++n)
+    {
+        TestMapI t;
+
+        failing_allocation = n;
+
+        try {
+            t.build_sorted_parallel(input.begin(), input.end(), 8);
+            failing_allocation = 0;
+            BOOST_CHECK(t.size() == t_model.size());
+        } catch (const std::bad_alloc &) {
+            failing_allocation = 0;
+            BOOST_CHECK(t.size() == 0 and t.begin() == t.end());
+        }
+
+        std::atomic<size_t> visited(0);
+
+        failing_allocation = n;
+
+        try {
+            s.parallel_for_each([&visited] (int) { ++visited; }, 8);
+            failing_allocation = 0;
+            BOOST_CHECK(visited == t_model.size());
+        } catch (const std::bad_alloc &) {
+            failing_allocation = 0;
+            BOOST_CHECK(visited <= t_model.size());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parallel_visit)
+{
+    DefaultGenerator g(14);
+    TestSet t;
+    std::map<std::string, int> t_model;
+
+    for (int i = ITEMS_TO_TEST / 4; i > 0; --i)
+    {
+        std::string x = generate(g).substr(0, 16);
+
+        /* Skewed, most of them below one prefix */
+        if (i % 4 != 0) { x = "skew/" + x; }
+
+        t.add(x);
+        ++t_model[x];
+    }
+
+    long long expected = 0;
+    for (const auto & x : t_model) { expected += x.second; }
+
+    auto sum = [] (long long a, long long b) { return a + b; };
+
+    BOOST_CHECK(t.parallel_reduce(0LL, [] (int x) { return (long long) x; }, sum, 4) == expected);
+
+    /* Values can be updated in place */
+    t.parallel_for_each([] (int & x) { x *= 2; }, 4);
+    BOOST_CHECK(t.parallel_reduce(0LL, [] (int x) { return (long long) x; }, sum, 3) == 2 * expected);
+
+    /* With the keys, over the prefix subtrie */
+    std::mutex lock;
+    std::map<std::string, int> seen;
+
+    t.parallel_for_each(t.find_prefix(std::string("skew/")),
+        [&lock, &seen] (const std::string & key, int x) {
+            std::lock_guard<std::mutex> guard(lock);
+            BOOST_CHECK(seen.insert(std::make_pair(key, x)).second);
+        }, 4);
+
+    auto model_it = t_model.lower_bound("skew/");
+
+    for (const auto & x : seen)
+    {
+        BOOST_CHECK(x.first == model_it->first);
+        BOOST_CHECK(x.second == 2 * model_it->second);
+        ++model_it;
+    }
+
+    BOOST_CHECK(model_it == t_model.end() or !boost::starts_with(model_it->first, "skew/"));
+
+    size_t key_atoms = 0;
+    for (const auto & x : t_model) { key_atoms += x.first.size(); }
+
+    BOOST_CHECK(t.parallel_reduce((size_t) 0,
+        [] (const std::string & key, int) { return key.size(); },
+        [] (size_t a, size_t b) { return a + b; }) == key_atoms);
+
+    /* Nothing to visit */
+    BOOST_CHECK(t.parallel_reduce(t.find_prefix(std::string("\x01\x02")), 0LL,
+        [] (int x) { return (long long) x; }, sum, 4) == 0);
+
+    TestSet empty;
+    BOOST_CHECK(empty.parallel_reduce(0LL, [] (int x) { return (long long) x; }, sum, 4) == 0);
+
+    /* The first exception of a visitor is rethrown */
+    BOOST_CHECK_THROW(t.parallel_for_each([] (int) { throw std::runtime_error("stop"); }, 4),
+        std::runtime_error);
+}
+
+static size_t levenshtein(const std::string & a, const std::string & b)
+{
+    std::vector<size_t> row(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); ++j) { row[j] = j; }
+
+    for (size_t i = 1; i <= a.size(); ++i)
+    {
+        size_t diagonal = row[0];
+        row[0] = i;
+
+        for (size_t j = 1; j <= b.size(); ++j)
+        {
+            size_t up = row[j];
+            row[j] = std::min(std::min(row[j] + 1, row[j - 1] + 1),
+                diagonal + (a[i - 1] == b[j - 1] ? 0 : 1));
+            diagonal = up;
+        }
+    }
+
+    return row[b.size()];
+}
+
+BOOST_AUTO_TEST_CASE(fuzzy_search)
+{
+    DefaultGenerator g(15);
+    TestMapI t;
+    std::set<std::string> words;
+
+    /* Short words over a small alphabet have many close neighbours */
+    for (int i = 0; i < 5000; ++i)
+    {
+        std::string x;
+        for (int j = g() % 8; j >= 0; --j) { x += (char) ('a' + g() % 4); }
+
+        t.insert(x, x);
+        words.insert(x);
+    }
+
+    t.insert(std::string(""), std::string(""));
+    words.insert("");
+
+    for (int i = 0; i < 50; ++i)
+    {
+        std::string query;
+        for (int j = g() % 9; j > 0; --j) { query += (char) ('a' + g() % 5); }
+
+        for (size_t k = 0; k <= 2; ++k)
+        {
+            std::vector< std::pair<std::string, size_t> > expected;
+
+            for (const std::string & x : words)
+            {
+                size_t d = levenshtein(x, query);
+                if (d <= k) { expected.push_back(std::make_pair(x, d)); }
+            }
+
+            BOOST_CHECK(t.find_fuzzy(query, k) == expected);
+        }
+    }
+
+    /* With the values */
+    t.find_fuzzy(std::string("abcd"), 1,
+        [] (const std::string & key, std::string & value, size_t distance) {
+            BOOST_CHECK(key == value);
+            BOOST_CHECK(distance <= 1);
+        });
+
+    TestMapI empty;
+    BOOST_CHECK(empty.find_fuzzy(std::string("abc"), 3).empty());
+}
+
+/* Reference matcher, '[' is always a class here */
+static bool glob_match(const char * p, const char * s)
+{
+    if (*p == '\0') { return *s == '\0'; }
+
+    if (*p == '*') { return glob_match(p + 1, s) or (*s != '\0' and glob_match(p, s + 1)); }
+
+    if (*s == '\0') { return false; }
+
+    if (*p == '[')
+    {
+        const char * q = p + 1;
+        bool negated = (*q == '!');
+        bool found = false;
+
+        if (negated) { ++q; }
+
+        for (; *q != ']'; ++q)
+        {
+            if (q[1] == '-' and q[2] != ']') {
+                found = found or (*s >= q[0] and *s <= q[2]);
+                q += 2;
+            } else {
+                found = found or (*s == *q);
+            }
+        }
+
+        return found != negated and glob_match(q + 1, s + 1);
+    }
+
+    return (*p == '?' or *p == *s) and glob_match(p + 1, s + 1);
+}
+
+BOOST_AUTO_TEST_CASE(pattern_matching)
+{
+    DefaultGenerator g(16);
+    TestMapI t;
+    std::set<std::string> words;
+
+    for (int i = 0; i < 5000; ++i)
+    {
+        std::string x;
+        for (int j = g() % 10; j >= 0; --j) { x += "ab/c"[g() % 4]; }
+
+        t.insert(x, x);
+        words.insert(x);
+    }
+
+    const char * patterns[] = { "", "*", "a*", "*b", "a?c*", "*/*", "??", "[ab]*/c",
+        "[!a]*", "*[a-b]", "a*b*c", "**c", "/*/?", "ab/cab", "*a*b*/*", "ab/x*", "c/c/cx" };
+
+    for (const char * pattern : patterns)
+    {
+        std::vector<std::string> expected, found;
+
+        for (const std::string & x : words) {
+            if (glob_match(pattern, x.c_str())) { expected.push_back(x); }
+        }
+
+        t.match_pattern(std::string(pattern),
+            [&found] (const std::string & key, std::string & value) {
+                BOOST_CHECK(key == value);
+                found.push_back(key);
+            });
+
+        BOOST_CHECK_MESSAGE(found == expected, pattern);
+    }
+
+    TestSet s;
+    s.add(std::string("/home/user1/audio/01.mp3"));
+    s.add(std::string("/home/user2/audio/02.mp3"));
+    s.add(std::string("/home/user2/audio/123.mp3"));
+    s.add(std::string("/home/user3/video/03.mp3"));
+    s.add(std::string("/home/[x]"));
+    s.add(std::string("/home/*"));
+
+    std::vector<std::string> found;
+    auto collect = [&found] (const std::string & key, int) { found.push_back(key); };
+
+    s.match_pattern(std::string("/home/*/audio/??.mp3"), collect);
+    BOOST_CHECK(found == std::vector<std::string>({ "/home/user1/audio/01.mp3", "/home/user2/audio/02.mp3" }));
+
+    /* Escapes, unterminated classes and negation */
+    found.clear();
+    s.match_pattern(std::string("/home/\\*"), collect);
+    s.match_pattern(std::string("/home/[x"), collect);
+    s.match_pattern(std::string("/home/[^u[]*"), collect);
+    BOOST_CHECK(found == std::vector<std::string>({ "/home/*", "/home/*" }));
+
+    found.clear();
+    s.match_pattern(std::string("/home/[[]x]"), collect);
+    s.match_pattern(std::string("/home/user[]2]/*/1*"), collect);
+    BOOST_CHECK(found == std::vector<std::string>({ "/home/[x]", "/home/user2/audio/123.mp3" }));
+}
+
+BOOST_AUTO_TEST_CASE(multi_pattern_scan)
+{
+    DefaultGenerator g(17);
+
+    /* Few children per node, and many, which get bitmaps */
+    for (const std::string & alphabet : { std::string("abc"), std::string("abcdefghij") })
+    {
+        trie::trie_map<char, int> dict;
+        std::map<std::string, int> words;
+
+        for (int i = 0; i < 300; ++i)
+        {
+            std::string x;
+            for (int j = g() % 6; j >= 0; --j) { x += alphabet[g() % alphabet.size()]; }
+
+            dict.insert(x, i);
+            words[x] = i;
+        }
+
+        /* The empty key never matches */
+        dict.insert(std::string(""), -1);
+
+        trie::aho_corasick<char, int> ac(dict);
+        BOOST_CHECK(ac.size() == words.size());
+
+        std::string text;
+        for (int i = 0; i < 2000; ++i) { text += (alphabet + "z")[g() % (alphabet.size() + 1)]; }
+
+        typedef std::tuple<size_t, size_t, int> MatchT;
+        std::vector<MatchT> expected, found;
+
+        for (size_t end = 1; end <= text.size(); ++end)
+        {
+            for (size_t begin = 0; begin < end; ++begin)
+            {
+                auto it = words.find(text.substr(begin, end - begin));
+                if (it != words.end()) { expected.push_back(MatchT(begin, end - begin, it->second)); }
+            }
+        }
+
+        ac.scan(text, [&found] (size_t offset, size_t length, int value) {
+            found.push_back(MatchT(offset, length, value)); });
+
+        BOOST_CHECK(!expected.empty());
+        BOOST_CHECK(found == expected);
+    }
+
+    /* A root with a label of its own */
+    trie::trie_map<char, trie::SetCounter> paths;
+    paths.add(std::string("/usr/lib"));
+    paths.add(std::string("/usr/libexec"));
+    paths.add(std::string("/usr/bin"));
+
+    trie::aho_corasick<char, trie::SetCounter> pac(paths);
+    std::vector<std::string> keys;
+
+    pac.scan(std::string("x/usr/libexec/usr/bin/usr"),
+        [&keys] (size_t offset, size_t length, int) {
+            keys.push_back(std::string("x/usr/libexec/usr/bin/usr").substr(offset, length)); });
+
+    BOOST_CHECK(keys == std::vector<std::string>({ "/usr/lib", "/usr/libexec", "/usr/bin" }));
+
+    trie::trie_map<char, int> empty;
+    trie::aho_corasick<char, int> none(empty);
+    none.scan(std::string("abc"), [] (size_t, size_t, int) { BOOST_CHECK(false); });
+    BOOST_CHECK(none.size() == 0 and none.states() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(longest_prefix_match)
+{
+    DefaultGenerator g(18);
+    TestMapI t;
+    std::set<std::string> routes;
+
+    BOOST_CHECK(t.longest_prefix(std::string("/")) == nullptr);
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        std::string x;
+        for (int j = g() % 5; j > 0; --j) { x += "/ab"[g() % 3]; }
+
+        t.insert(x, x);
+        routes.insert(x);
+    }
+
+    t.erase(std::string(""));
+    routes.erase("");
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        std::string query;
+        for (int j = g() % 8; j > 0; --j) { query += "/abc"[g() % 4]; }
+
+        std::string expected;
+        bool found = false;
+
+        for (size_t n = 0; n <= query.size(); ++n)
+        {
+            if (routes.count(query.substr(0, n)) != 0)
+            {
+                expected = query.substr(0, n);
+                found = true;
+            }
+        }
+
+        size_t length = 12345;
+        std::string * value = t.longest_prefix(query, length);
+
+        BOOST_CHECK(found == (value != nullptr));
+
+        if (value != nullptr)
+        {
+            BOOST_CHECK(*value == expected);
+            BOOST_CHECK(length == expected.size());
+        } else {
+            BOOST_CHECK(length == 12345);
+        }
+    }
+
+    trie::trie_map<char, int> mounts;
+    mounts.insert(std::string("/"), 1);
+    mounts.insert(std::string("/home"), 2);
+    mounts.insert(std::string("/home/user/data"), 3);
+
+    std::string queries[] = { "/home/user/docs", "/home/user/data/x", "/homer", "/hom", "home" };
+    size_t length = 0;
+    size_t before = heap_allocations;
+
+    BOOST_CHECK(*mounts.longest_prefix(queries[0], length) == 2 and length == 5);
+    BOOST_CHECK(*mounts.longest_prefix(queries[1], length) == 3 and length == 15);
+    BOOST_CHECK(*mounts.longest_prefix(queries[2], length) == 2 and length == 5);
+    BOOST_CHECK(*mounts.longest_prefix(queries[3], length) == 1 and length == 1);
+    BOOST_CHECK(mounts.longest_prefix(queries[4]) == nullptr);
+
+    BOOST_CHECK(heap_allocations == before);
+}
+
+BOOST_AUTO_TEST_CASE(common_prefix_search)
+{
+    DefaultGenerator g(19);
+    TestSet t;
+    std::set<std::string> words;
+
+    for (int i = 0; i < 3000; ++i)
+    {
+        std::string x;
+        for (int j = g() % 6; j >= 0; --j) { x += "abc"[g() % 3]; }
+
+        t.add(x);
+        words.insert(x);
+    }
+
+    /* All the words at every position of a text */
+    std::string text;
+    for (int i = 0; i < 300; ++i) { text += "abcd"[g() % 4]; }
+
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        std::vector<size_t> expected, found;
+
+        for (size_t n = 1; i + n <= text.size(); ++n) {
+            if (words.count(text.substr(i, n)) != 0) { expected.push_back(n); }
+        }
+
+        t.common_prefixes(text.begin() + i, text.end(), [&found] (size_t length, int count) {
+            BOOST_CHECK(count >= 1);
+            found.push_back(length);
+        });
+
+        BOOST_CHECK(found == expected);
+    }
+
+    /* The empty key is a prefix of any */
+    t.add(std::string(""));
+
+    std::string query = "abcabc";
+    std::vector<size_t> found;
+    found.reserve(query.size() + 1);
+    size_t before = heap_allocations;
+
+    t.common_prefixes(query, [&found] (size_t length, int) { found.push_back(length); });
+
+    BOOST_CHECK(heap_allocations == before);
+    BOOST_CHECK(!found.empty() and found[0] == 0);
+
+    TestSet empty;
+    empty.common_prefixes(query, [] (size_t, int) { BOOST_CHECK(false); });
+}
+
+BOOST_AUTO_TEST_CASE(top_k_scores)
+{
+    typedef trie::scored_trie_map<char, int> ScoredMap;
+
+    DefaultGenerator g(20);
+    ScoredMap t;
+    std::map<std::string, int> model;
+
+    auto check = [&t, &model] (const std::string & prefix, size_t k)
+    {
+        std::vector<int> expected;
+
+        for (const auto & x : model) {
+            if (boost::starts_with(x.first, prefix)) { expected.push_back(x.second); }
+        }
+
+        std::sort(expected.rbegin(), expected.rend());
+        if (expected.size() > k) { expected.resize(k); }
+
+        std::vector<int> found;
+        std::set<std::string> keys;
+
+        for (const auto & x : t.top_k(prefix, k))
+        {
+            BOOST_CHECK(boost::starts_with(x.first, prefix));
+            BOOST_CHECK(model.count(x.first) != 0 and model[x.first] == x.second);
+            keys.insert(x.first);
+            found.push_back(x.second);
+        }
+
+        BOOST_CHECK(found == expected);
+        BOOST_CHECK(keys.size() == found.size());
+    };
+
+    auto check_all = [&check] ()
+    {
+        for (const char * prefix : { "", "a", "b", "ab", "abc", "ca", "cab", "ddd" }) {
+            for (size_t k : { 0, 1, 3, 10, 100000 }) { check(prefix, k); }
+        }
+    };
+
+    auto word = [&g] ()
+    {
+        std::string x;
+        for (int j = g() % 8; j >= 0; --j) { x += "abcd"[g() % 4]; }
+        return x;
+    };
+
+    for (int i = 0; i < 4000; ++i)
+    {
+        std::string x = word();
+        int score = (int) (g() % 1000) - 100;
+
+        if (i % 3 == 0) {
+            t.add(x, score);
+            model[x] += score;
+        } else {
+            t.insert(x, score);
+            model[x] = score;
+        }
+    }
+
+    check_all();
+
+    /* The best ones go first, so that the scores are recomputed */
+    for (int i = 0; i < 300; ++i)
+    {
+        auto best = t.top_k("", 1);
+        if (best.empty()) { break; }
+
+        t.erase(best[0].first);
+        model.erase(best[0].first);
+
+        std::string x = word();
+        t.erase(x);
+        model.erase(x);
+    }
+
+    check_all();
+
+    /* Lower a score in place of the greatest one */
+    std::string first = t.top_k("", 1)[0].first;
+    t.insert(first, -1000);
+    model[first] = -1000;
+
+    check_all();
+
+    t.squeeze();
+    check_all();
+
+    std::vector< std::pair<std::string, int> > sorted(model.begin(), model.end());
+
+    ScoredMap built;
+    built.build_sorted(sorted.begin(), sorted.end());
+    std::swap(t, built);
+    check_all();
+
+    t.build_sorted_parallel(sorted.begin(), sorted.end(), 2);
+    check_all();
+
+    BOOST_CHECK(ScoredMap().top_k("", 5).empty());
+}
+
+BOOST_AUTO_TEST_CASE(subtree_counts)
+{
+    typedef trie::counted_trie_map<char, int> CountedMap;
+
+    DefaultGenerator g(21);
+    CountedMap t;
+    std::map<std::string, int> model;
+
+    auto word = [&g] ()
+    {
+        std::string x;
+        for (int j = g() % 7; j >= 0; --j) { x += "abcd"[g() % 4]; }
+        return x;
+    };
+
+    auto check = [&t, &model, &word] ()
+    {
+        BOOST_CHECK(t.size() == model.size());
+
+        for (const char * prefix : { "", "a", "b", "ab", "abc", "cad", "dddd", "x" })
+        {
+            size_t expected = 0;
+            for (const auto & x : model) { expected += boost::starts_with(x.first, prefix) ? 1 : 0; }
+
+            BOOST_CHECK(t.count_prefix(prefix) == expected);
+        }
+
+        /* Keys stored or not, rank() is where they would go */
+        for (int i = 0; i < 200; ++i)
+        {
+            std::string x = word();
+            size_t expected = std::distance(model.begin(), model.lower_bound(x));
+
+            BOOST_CHECK(t.rank(x) == expected);
+        }
+
+        size_t i = 0;
+
+        for (auto it = model.begin(); it != model.end(); ++it, ++i)
+        {
+            auto found = t.select(i);
+
+            BOOST_CHECK(found.key() == it->first);
+            BOOST_CHECK(*found == it->second);
+            BOOST_CHECK(t.rank(it->first) == i);
+
+            /* The iterator goes on in order */
+            if (i % 50 == 0 and std::next(it) != model.end()) {
+                BOOST_CHECK((++found).key() == std::next(it)->first);
+            }
+        }
+
+        BOOST_CHECK_THROW(t.select(model.size()), std::out_of_range);
+    };
+
+    for (int i = 0; i < 3000; ++i)
+    {
+        std::string x = word();
+        t.add(x, 1);
+        model[x] += 1;
+    }
+
+    check();
+
+    for (int i = 0; i < 1500; ++i)
+    {
+        std::string x = word();
+        t.erase(x);
+        model.erase(x);
+    }
+
+    check();
+
+    t.squeeze();
+    check();
+
+    std::vector< std::pair<std::string, int> > sorted(model.begin(), model.end());
+    t.build_sorted_parallel(sorted.begin(), sorted.end(), 2);
+    check();
+
+    /* Every key is equally likely */
+    CountedMap few;
+    for (const char * x : { "a", "ab", "abc", "b", "bcd" }) { few.insert(x, 0); }
+
+    std::map<std::string, int> hits;
+    for (int i = 0; i < 50000; ++i) { ++hits[few.sample(g).key()]; }
+
+    BOOST_CHECK(hits.size() == 5);
+    for (const auto & x : hits) { BOOST_CHECK(x.second > 9000 and x.second < 11000); }
+
+    CountedMap empty;
+    BOOST_CHECK(empty.sample(g) == empty.end());
+    BOOST_CHECK(empty.count_prefix("a") == 0 and empty.rank("a") == 0);
+}
+
+BOOST_AUTO_TEST_CASE(binary_trie)
+{
+    typedef trie::binary_trie_map<uint32_t, int> RouteMap;
+
+    DefaultGenerator g(22);
+    RouteMap t;
+    std::map<std::pair<uint32_t, size_t>, int> model; /* (prefix, length) */
+
+    auto mask = [] (uint32_t x, size_t length) {
+        return length == 0 ? 0 : x & (uint32_t) (~0ull << (32 - length)); };
+
+    /* Few distinct high bits, so that prefixes nest */
+    auto address = [&g] () { return (uint32_t) ((g() % 8) << 29 | (g() % 4) << 20 | (g() & 0xfffff)); };
+
+    auto check = [&t, &model, &mask, &address] ()
+    {
+        BOOST_CHECK(t.size() == model.size());
+        BOOST_CHECK(t._edges() < 2 * model.size() + 1);
+
+        for (int i = 0; i < 2000; ++i)
+        {
+            uint32_t x = address();
+            const int * expected = nullptr;
+            size_t expected_length = 0;
+
+            for (size_t length = 0; length <= 32; ++length)
+            {
+                auto it = model.find(std::make_pair(mask(x, length), length));
+
+                if (it != model.end())
+                {
+                    expected = &it->second;
+                    expected_length = length;
+                }
+            }
+
+            size_t length = 100;
+            const int * found = t.longest_prefix(x, length);
+
+            BOOST_CHECK((found == nullptr) == (expected == nullptr));
+            if (found != nullptr and expected != nullptr) {
+                BOOST_CHECK(*found == *expected and length == expected_length);
+            }
+        }
+
+        for (const auto & x : model)
+        {
+            BOOST_CHECK(t.get(x.first.first, x.first.second) != nullptr);
+            BOOST_CHECK(*t.get(x.first.first, x.first.second) == x.second);
+        }
+
+        /* Prefixes within 32.0.0.0/3, shorter ones first */
+        std::vector< std::pair<uint32_t, size_t> > expected, found;
+
+        for (const auto & x : model) {
+            if (x.first.second >= 3 and mask(x.first.first, 3) == 0x20000000) { expected.push_back(x.first); }
+        }
+
+        t.find_prefix(0x20000000, 3, [&found, &model] (uint32_t key, size_t length, int value) {
+            BOOST_CHECK(model[std::make_pair(key, length)] == value);
+            found.push_back(std::make_pair(key, length));
+        });
+
+        /* In bit order a prefix goes before its extensions */
+        auto bit_less = [] (const std::pair<uint32_t, size_t> & a, const std::pair<uint32_t, size_t> & b) {
+            return a.first != b.first ? a.first < b.first : a.second < b.second; };
+
+        std::sort(expected.begin(), expected.end(), bit_less);
+        BOOST_CHECK(found == expected);
+    };
+
+    for (int i = 0; i < 5000; ++i)
+    {
+        uint32_t x = address();
+        size_t length = i % 10 == 0 ? 32 : 8 + g() % 25;
+        int value = (int) g();
+
+        t.insert(x, length, value);
+        model[std::make_pair(mask(x, length), length)] = value;
+    }
+
+    /* The default route */
+    t.insert(0, 0, -1);
+    model[std::make_pair(0u, (size_t) 0)] = -1;
+
+    check();
+
+    for (int i = 0; i < 3000; ++i)
+    {
+        auto it = model.begin();
+        std::advance(it, g() % model.size());
+
+        BOOST_CHECK(t.erase(it->first.first, it->first.second) == 1);
+        BOOST_CHECK(t.erase(it->first.first, it->first.second) == 0);
+        model.erase(it);
+    }
+
+    check();
+
+    t.insert(0x12345678, 7);
+    BOOST_CHECK(t.contains(0x12345678) and !t.contains(0x12345679));
+    BOOST_CHECK(t.erase(0x12345678) == 1 and !t.contains(0x12345678));
+    BOOST_CHECK_THROW(t.insert(0, 33, 0), std::invalid_argument);
+
+    /* Every prefix of every byte */
+    trie::binary_trie_map<uint8_t, int> bytes;
+
+    for (int length = 0; length <= 8; ++length) {
+        for (int x = 0; x < 256; x += 1 << (8 - length)) { bytes.insert((uint8_t) x, length, x * 16 + length); }
+    }
+
+    BOOST_CHECK(bytes.size() == 511);
+
+    for (int x = 0; x < 256; ++x)
+    {
+        size_t length = 0;
+        BOOST_CHECK(*bytes.longest_prefix((uint8_t) x, length) == x * 16 + 8 and length == 8);
+        BOOST_CHECK(*bytes.get((uint8_t) x, 4) == (x & 0xf0) * 16 + 4);
+    }
+
+    int count = 0;
+    bytes.for_each([&count] (uint8_t, size_t, int) { ++count; });
+    BOOST_CHECK(count == 511);
+
+    /* IPv6 */
+    typedef std::array<uint8_t, 16> Address;
+    trie::binary_trie_map<Address, std::string> routes;
+
+    Address net = {{ 0x20, 0x01, 0x0d, 0xb8 }};
+    Address host = net;
+    host[15] = 1;
+
+    routes.insert(Address(), 0, "default");
+    routes.insert(net, 32, "documentation");
+    routes.insert(host, "host");
+
+    size_t length = 0;
+    BOOST_CHECK(*routes.longest_prefix(host, length) == "host" and length == 128);
+
+    host[14] = 1;
+    BOOST_CHECK(*routes.longest_prefix(host, length) == "documentation" and length == 32);
+
+    host[3] = 0xb9;
+    BOOST_CHECK(*routes.longest_prefix(host, length) == "default" and length == 0);
+
+    BOOST_CHECK(routes.erase(Address(), 0) == 1);
+    BOOST_CHECK(routes.longest_prefix(host) == nullptr);
+}
+
+template <typename KeyT, typename Generator>
+static void check_lpm_table(trie::binary_trie_map<KeyT, int> & t, Generator address)
+{
+    trie::lpm_table<KeyT, int> table(t);
+
+    BOOST_CHECK(table.size() == t.size());
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        KeyT x = address();
+        size_t expected_length = 1000, length = 1000;
+        const int * expected = t.longest_prefix(x, expected_length);
+        const int * found = table.longest_prefix(x, length);
+
+        BOOST_CHECK((found == nullptr) == (expected == nullptr));
+        if (found != nullptr and expected != nullptr) {
+            BOOST_CHECK(*found == *expected and length == expected_length);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lpm_table_lookup)
+{
+    DefaultGenerator g(23);
+
+    trie::binary_trie_map<uint32_t, int> v4;
+    auto address = [&g] () { return (uint32_t) ((g() % 4) << 30 | (g() % 4) << 18 | (g() & 0x3ffff)); };
+
+    check_lpm_table(v4, address);
+
+    for (int i = 0; i < 20000; ++i) { v4.insert(address(), g() % 33, i); }
+    check_lpm_table(v4, address);
+
+    v4.insert(0, 0, -1);
+    check_lpm_table(v4, address);
+
+    trie::binary_trie_map<uint64_t, int> wide;
+    auto wide_address = [&g] () { return (uint64_t) (g() % 4) << 62 | (uint64_t) g() << 20 | (g() & 0xfffff); };
+
+    for (int i = 0; i < 20000; ++i) { wide.insert(wide_address(), g() % 65, i); }
+    check_lpm_table(wide, wide_address);
+
+    trie::binary_trie_map<uint8_t, int> bytes;
+    auto byte = [&g] () { return (uint8_t) g(); };
+
+    for (int i = 0; i < 30; ++i) { bytes.insert(byte(), g() % 9, i); }
+    check_lpm_table(bytes, byte);
+
+    typedef std::array<uint8_t, 16> Address;
+    trie::binary_trie_map<Address, int> v6;
+
+    auto v6_address = [&g] ()
+    {
+        Address x = {{ 0x20, 0x01, (uint8_t) (g() % 2) }};
+        for (size_t i = 3; i < x.size(); ++i) { x[i] = (uint8_t) (g() % (i < 8 ? 4 : 256)); }
+        return x;
+    };
+
+    for (int i = 0; i < 20000; ++i) { v6.insert(v6_address(), 16 + g() % 113, i); }
+    check_lpm_table(v6, v6_address);
+}
+
+BOOST_AUTO_TEST_CASE(wide_atoms)
+{
+    typedef std::u32string Text;
+
+    DefaultGenerator g(24);
+    trie::trie_map<char32_t, int> t;
+    std::map<Text, int> model;
+
+    /* Code points from all over the range, a few frequent ones */
+    auto word = [&g] ()
+    {
+        Text x;
+        for (int j = g() % 5; j >= 0; --j) {
+            x += g() % 3 == 0 ? (char32_t) (0x10000 + g() % 0xf0000) : (char32_t) (U'a' + g() % 4);
+        }
+        return x;
+    };
+
+    auto check = [&t, &model, &word] ()
+    {
+        BOOST_CHECK(t.size() == model.size());
+
+        auto it = t.begin();
+        for (const auto & x : model)
+        {
+            BOOST_CHECK(it.key() == x.first and *it == x.second);
+            ++it;
+        }
+
+        BOOST_CHECK(it == t.end());
+
+        for (int i = 0; i < 500; ++i)
+        {
+            Text x = word();
+            auto expected = model.lower_bound(x);
+            auto found = t.lower_bound(x);
+
+            BOOST_CHECK((found == t.end()) == (expected == model.end()));
+            if (found != t.end() and expected != model.end()) { BOOST_CHECK(found.key() == expected->first); }
+        }
+    };
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        Text x = word();
+        t.insert(x, i);
+        model[x] = i;
+    }
+
+    check();
+
+    for (int i = 0; i < 15000; ++i)
+    {
+        Text x = word();
+        BOOST_CHECK(t.erase(x) == model.erase(x));
+    }
+
+    check();
+
+    t.squeeze();
+    check();
+
+    /* Token ids, with thousands of children at the root */
+    trie::counted_trie_map<uint32_t, int> grams;
+    std::map<std::vector<uint32_t>, int> gram_model;
+
+    for (int i = 0; i < 30000; ++i)
+    {
+        std::vector<uint32_t> x = { (uint32_t) g() % 5000 * 800000u, (uint32_t) g() % 3, (uint32_t) g() };
+
+        grams.insert(x.begin(), x.end(), i);
+        gram_model[x] = i;
+    }
+
+    BOOST_CHECK(grams.size() == gram_model.size());
+
+    size_t rank = 0;
+    for (const auto & x : gram_model)
+    {
+        BOOST_CHECK(*grams.get(x.first.begin(), x.first.end()) == x.second);
+        BOOST_CHECK(grams.rank(x.first.begin(), x.first.end()) == rank++);
+    }
+
+    std::vector<uint32_t> first = { gram_model.begin()->first[0] };
+    size_t expected = 0;
+    for (const auto & x : gram_model) { expected += x.first[0] == first[0] ? 1 : 0; }
+
+    BOOST_CHECK(grams.count_prefix(first.begin(), first.end()) == expected);
+
+    /* Above 0x7fff the atoms go after the lower ones, as in std::u16string */
+    trie::trie_map<char16_t, int> utf16;
+    utf16.insert(u"\xff01", 1);
+    utf16.insert(u"a", 2);
+    BOOST_CHECK(*utf16.begin() == 2);
+}
+
+/* Small enough to be kept in the node */
+struct Point3
+{
+    int16_t x, y, z;
+    bool operator == (const Point3 & other) const { return x == other.x and y == other.y and z == other.z; }
+};
+
+/* Trivially copyable, but not trivial */
+struct Tagged
+{
+    int32_t id = -1;
+    float score = 0;
+    bool operator == (const Tagged & other) const { return id == other.id and score == other.score; }
+};
+
+/* Kept out of the node */
+struct Point4
+{
+    int32_t x, y, z, w;
+    bool operator == (const Point4 & other) const { return x == other.x and w == other.w; }
+};
+
+template <typename ValueT, typename Make>
+static void check_value_storage(Make make)
+{
+    DefaultGenerator g(25);
+    trie::trie_map<char, ValueT> t;
+    std::map<std::string, ValueT> model;
+
+    auto word = [&g] ()
+    {
+        std::string x;
+        for (int j = g() % 6; j >= 0; --j) { x += "abc"[g() % 3]; }
+        return x;
+    };
+
+    for (int round = 0; round < 3; ++round)
+    {
+        /* Splits and merges move values between nodes */
+        for (int i = 0; i < 3000; ++i)
+        {
+            std::string x = word();
+            ValueT value = make(i);
+
+            if (g() % 3 == 0) {
+                BOOST_CHECK(t.erase(x) == model.erase(x));
+            } else {
+                t.insert(x, value);
+                model[x] = value;
+            }
+        }
+
+        BOOST_CHECK(t.size() == model.size());
+
+        for (const auto & x : model) {
+            BOOST_CHECK(t.get(x.first) != nullptr and *t.get(x.first) == x.second);
+        }
+
+        t.squeeze();
+    }
+
+    auto it = t.begin();
+    for (const auto & x : model) { BOOST_CHECK(*it == x.second); ++it; }
+}
+
+BOOST_AUTO_TEST_CASE(value_storage)
+{
+    check_value_storage<char>([] (int i) { return (char) i; });
+    check_value_storage<Point3>([] (int i) { return Point3 { (int16_t) i, 1, (int16_t) -i }; });
+    check_value_storage<Point4>([] (int i) { return Point4 { i, 1, 2, -i }; });
+    check_value_storage<double>([] (int i) { return i * 0.5; });
+    check_value_storage<uint64_t>([] (int i) { return (uint64_t) i << 40; });
+    check_value_storage<Tagged>([] (int i) { Tagged x; x.id = i; x.score = i * 0.25f; return x; });
+    check_value_storage<std::string>([] (int i) { return std::to_string(i); });
+
+    static const char * names[] = { "a", "b", "c" };
+    check_value_storage<const char *>([] (int i) { return names[i % 3]; });
+
+    /* Trivially copyable values up to a pointer size live in the node */
+    BOOST_CHECK(trie::detail::ValueHolder<double>::value_footprint() == 0);
+    BOOST_CHECK(trie::detail::ValueHolder<uint64_t>::value_footprint() == 0);
+    BOOST_CHECK(trie::detail::ValueHolder<Tagged>::value_footprint() == 0);
+    BOOST_CHECK(trie::detail::ValueHolder<const char *>::value_footprint() == 0);
+    BOOST_CHECK(trie::detail::ValueHolder<Point4>::value_footprint() == sizeof(Point4));
+
+    /* Values smaller than a pointer do not make the nodes larger */
+    BOOST_CHECK(sizeof(trie::detail::TrieNodeSelector<char, Point3, 0>::type) ==
+        sizeof(trie::detail::TrieNodeSelector<char, std::string, 0>::type));
+}
+
+/* Counts the copies and can refuse to be constructed */
+struct Tracked
+{
+    static int copies, moves, throw_at;
+
+    std::string text;
+
+    Tracked(const std::string & a, int n)
+        : text(a + std::to_string(n))
+    {
+        if (n == throw_at) { throw std::runtime_error("Tracked"); }
+    }
+
+    Tracked(const Tracked & other) : text(other.text) { ++copies; }
+    Tracked(Tracked && other) : text(std::move(other.text)) { ++moves; }
+
+    Tracked & operator = (const Tracked & other) { text = other.text; ++copies; return *this; }
+    Tracked & operator = (Tracked && other) { text = std::move(other.text); ++moves; return *this; }
+};
+
+int Tracked::copies = 0, Tracked::moves = 0, Tracked::throw_at = -1;
+
+BOOST_AUTO_TEST_CASE(emplace_insert)
+{
+    DefaultGenerator g(26);
+    trie::trie_map<char, Tracked> t;
+    std::map<std::string, std::string> model;
+
+    auto word = [&g] ()
+    {
+        std::string x;
+        for (int j = g() % 6; j >= 0; --j) { x += "abc"[g() % 3]; }
+        return x;
+    };
+
+    int made = 0;
+
+    for (int i = 0; i < 5000; ++i)
+    {
+        std::string x = word();
+        bool fresh = model.count(x) == 0;
+        std::pair<trie::trie_map<char, Tracked>::iterator, bool> r;
+
+        switch (g() % 4)
+        {
+            case 0:
+                r = t.emplace(x, "e", i);
+                model[x] = "e" + std::to_string(i);
+                break;
+            case 1:
+                r = t.try_emplace(x, "t", i);
+                model.insert(std::make_pair(x, "t" + std::to_string(i)));
+                break;
+            case 2:
+                r.second = t.insert(x, Tracked("m", i));
+                r.first = t.find(x);
+                model[x] = "m" + std::to_string(i);
+                break;
+            default:
+                r = t.upsert(x,
+                    [&made, i] () { ++made; return Tracked("u", i); },
+                    [] (Tracked & v) { v.text += "+"; });
+                if (fresh) { model[x] = "u" + std::to_string(i); } else { model[x] += "+"; }
+        }
+
+        BOOST_CHECK(r.second == fresh);
+        BOOST_CHECK(r.first.key() == x and r.first.value().text == model[x]);
+    }
+
+    /* Values are never copied and the factory is only called for new keys */
+    BOOST_CHECK(Tracked::copies == 0);
+    BOOST_CHECK(made <= (int) model.size());
+
+    BOOST_CHECK(t.size() == model.size());
+    auto it = t.begin();
+    for (const auto & x : model) {
+        BOOST_CHECK(it.key() == x.first and it.value().text == x.second);
+        ++it;
+    }
+    BOOST_CHECK(it == t.end());
+
+    /* A throwing constructor leaves the trie intact */
+    Tracked::throw_at = 7;
+    for (const char * x : { "", "a", "ab", "abd", "abcabcabc", "d" }) {
+        BOOST_CHECK_THROW(t.emplace(std::string(x), "x", 7), std::runtime_error);
+        BOOST_CHECK(t.get(x) == nullptr or t.get(x)->text == model[x]);
+    }
+
+    /* So does the holder of a value, which is replaced */
+    trie::detail::TrieArena<std::allocator<char> > arena;
+    trie::detail::ValueHolder<Tracked> holder;
+
+    holder.emplace_value(arena, "h", 1);
+    BOOST_CHECK_THROW(holder.emplace_value(arena, "h", 7), std::runtime_error);
+    BOOST_CHECK(holder.has_value() and holder.get_value().text == "h1");
+    holder.clr_value(arena);
+
+    Tracked::throw_at = -1;
+
+    BOOST_CHECK(t.size() == model.size());
+    it = t.begin();
+    for (const auto & x : model) { BOOST_CHECK(it.key() == x.first); ++it; }
+    BOOST_CHECK(it == t.end());
+
+    /* The scores follow the values placed in */
+    trie::scored_trie_map<char, int> s;
+    BOOST_CHECK(s.try_emplace(std::string("abc"), 5).second);
+    BOOST_CHECK(!s.try_emplace(std::string("abc"), 50).second);
+    BOOST_CHECK(s.emplace(std::string("abd"), 7).second);
+    s.upsert(std::string("abc"), [] () { return 0; }, [] (int & v) { v = 9; });
+    s.insert(std::string("ab"), 8);
+
+    std::vector<std::pair<std::string, int> > best = s.top_k("ab", 2);
+    BOOST_CHECK(best.size() == 2 and best[0].second == 9 and best[1].second == 8);
+
+    /* Two string literals are the key and the value, not a range */
+    trie::trie_map<char, std::string> w;
+    BOOST_CHECK(w.emplace("key", "value").second);
+    BOOST_CHECK(w.try_emplace("abc", "x").second);
+    BOOST_CHECK(!w.try_emplace("abc", "y").second);
+    BOOST_CHECK(!w.emplace("key", "other").second);
+
+    const char * key = "abd";
+    BOOST_CHECK(w.emplace(key, "z").second);
+    BOOST_CHECK(w.emplace(key, key + 2, "range").second);
+
+    BOOST_CHECK(w.size() == 4);
+    BOOST_CHECK(*w.get("key") == "other" and *w.get("abc") == "x");
+    BOOST_CHECK(*w.get("abd") == "z" and *w.get("ab") == "range");
+}